@@ -0,0 +1,134 @@
+/*
+ ****************************************************************************
+ *  BENCH_DISPATCH.C
+ *
+ *  Cost of finding the callback of a request in the amb library, against
+ *  the number of registered ranges.  Monitor requests are fed to
+ *  amb_can_isr through the host back end of the HAL and timed with the
+ *  processor clock of the workstation, so the numbers only compare with
+ *  each other: the cost of the table search as it grows, with the lookup
+ *  cache hit (every request on one range) and missed (the requests spread
+ *  over all ranges).  A builtin point, which is answered without looking at
+ *  the table, gives the cost of the rest of the path.
+ *
+ *  It also checks that amb_register_function refuses a registration which
+ *  does not fit in the callback memory given to amb_init_slave.
+ *
+ *  Build, from the top of the repository:
+ *    gcc -std=c99 -O2 -DHOST_ARCH -Ilibraries/hal -o bench_dispatch
+ *        host/bench_dispatch.c libraries/amb/amb.c libraries/hal/hal_host.c
+ *
+ *  Usage:
+ *    bench_dispatch [requests]
+ *
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hal.h"
+
+#define MAX_RANGES		128
+#define RANGE_WIDTH		4			/* RCAs per range */
+#define FIRST_RCA		0x00100L	/* RCA of the first range, away from the builtin points */
+#define BUILTIN_RCA		0x30001L	/* Answered by the library itself */
+
+static CALLBACK_STRUCT cb_memory[MAX_RANGES];
+static ulong node_base;
+static ulong replies;
+
+static void on_transmit(ulong id, ubyte len, ubyte *data){
+	(void) id;
+	(void) len;
+	(void) data;
+	replies++;
+}
+
+static int answer(CAN_MSG_TYPE *message){
+	message->len = 4;
+	message->data[0] = (ubyte) (message->relative_address >> 24);
+	message->data[1] = (ubyte) (message->relative_address >> 16);
+	message->data[2] = (ubyte) (message->relative_address >> 8);
+	message->data[3] = (ubyte) message->relative_address;
+	return 0;
+}
+
+/* Register ranges ranges and check that one more does not fit */
+static int setup(int ranges){
+	int i;
+
+	if (amb_init_slave((void *) cb_memory, (ubyte) ranges) != 0) {
+		printf("amb_init_slave failed\n");
+		return -1;
+	}
+	amb_start();
+	for (i = 0; i < ranges; i++) {
+		if (amb_register_function(FIRST_RCA + i * RANGE_WIDTH, FIRST_RCA + i * RANGE_WIDTH + RANGE_WIDTH - 1, answer) != 0) {
+			printf("Registration %d of %d failed\n", i, ranges);
+			return -1;
+		}
+	}
+	if (amb_register_function(FIRST_RCA + ranges * RANGE_WIDTH, FIRST_RCA + ranges * RANGE_WIDTH, answer) != -1) {
+		printf("Registration beyond %d elements accepted\n", ranges);
+		return -1;
+	}
+	return 0;
+}
+
+/* Mean time per request in ns, best of RUNS runs: on the builtin point for
+   no ranges, else on one range or on all of them in turn */
+#define RUNS	5
+
+static double run(int requests, int ranges, int spread){
+	clock_t start, elapsed, best;
+	ulong rca;
+	int i, n;
+
+	best = 0;
+	for (n = 0; n < RUNS; n++) {
+		replies = 0;
+		start = clock();
+		for (i = 0; i < requests; i++) {
+			if (ranges == 0)
+				rca = BUILTIN_RCA;
+			else if (spread)
+				rca = FIRST_RCA + (((ulong) i * 7919) % ranges) * RANGE_WIDTH + (i & (RANGE_WIDTH - 1));
+			else
+				rca = FIRST_RCA + (ranges / 2) * RANGE_WIDTH + (i & (RANGE_WIDTH - 1));
+			hal_host_can_receive(node_base + rca, 0, 0);
+		}
+		elapsed = clock() - start;
+		if (replies != (ulong) requests)
+			printf("%lu replies to %d requests\n", (unsigned long) replies, requests);
+		if (n == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return (double) best * 1e9 / CLOCKS_PER_SEC / requests;
+}
+
+int main(int argc, char **argv){
+	int requests = 1000000;
+	int ranges;
+
+	if (argc > 1)
+		requests = atoi(argv[1]);
+	if (requests < 1)
+		requests = 1;
+
+	hal_host_node_address = 0;
+	node_base = ((ulong) (hal_host_node_address + 1)) * 262144;
+	hal_host_can_tx_hook = on_transmit;
+
+	if (setup(1) != 0)
+		return 1;
+	printf("Builtin point: %.1f ns per request\n\n", run(requests, 0, 0));
+	printf("Ranges   One range   Spread\n");
+	for (ranges = 1; ranges <= MAX_RANGES; ranges *= 2) {
+		if (setup(ranges) != 0)
+			return 1;
+		printf("%6d   %9.1f   %6.1f\n", ranges, run(requests, ranges, 0), run(requests, ranges, 1));
+	}
+	return 0;
+}
@@ -0,0 +1,423 @@
+/*
+ ****************************************************************************
+ *  BENCH_LATENCY.C
+ *
+ *  End-to-end request latency of the CAN -> ARCOM bridge on the host back
+ *  end of the HAL.  Mixes of monitor and control requests are replayed into
+ *  amb_can_isr against the simulated ARCOM; the latency of a monitor request
+ *  runs from its arrival to amb_transmit_monitor setting TXRQ.  Times are in
+ *  emulated time (hal_host_clock_ns), so they depend on the poll and access
+ *  costs of the host back end and on the ARCOM timing given on the command
+ *  line, not on the speed of the workstation.  Only the parallel port
+ *  accesses advance emulated time: the CPU time of the firmware itself is
+ *  not modelled, so points served locally by the AMBSI1 read as zero.
+ *
+ *  Requests arriving while the ISR is busy wait in object 15.  Only the last
+ *  of them survives (MSGLST), the others are counted as lost.  With
+ *  DEFERRED_CAN the ISR only queues them and the main loop runs them in
+ *  order; they are lost only when the ring of the amb library is full.
+ *
+ *  Build, from the top of the repository:
+ *    gcc -std=c99 -O2 -DHOST_ARCH -Dmain=ambsi_main -c src/main.c -o main.o
+ *    gcc -std=c99 -O2 -DHOST_ARCH -Ilibraries/hal -o bench_latency
+ *        host/bench_latency.c main.o libraries/amb/amb.c
+ *        libraries/hal/hal_host.c libraries/hal/hal_host_arcom.c
+ *  Add -DDEFERRED_CAN to both to measure the deferred mode, or -DCAN_RX_FIFO
+ *  for the receive FIFO in the spare message objects.  With -DLINK_CRC the
+ *  simulated ARCOM checks the frames too.  With -DSTROBE_INT -DSPLIT_MONITOR
+ *  the reply of a monitor request comes after the ISR returns: the bench
+ *  runs the main loop after every request and while the bus is idle, and
+ *  matches the late replies to their requests by RCA.  Add -DLINK_TAGS
+ *  -DLINK_CRC for the tagged requests, whose replies may come out of order.  A request
+ *  answered at once with an empty reply found the link queue full or the
+ *  breaker open: it is counted as refused, like a lost one, and not as
+ *  asked.
+ *
+ *  The first mix is then replayed with faults injected into the simulated
+ *  ARCOM, to show the timeouts and the retry of implMonitorSingle at work,
+ *  and a mix with monitor and control requests with the odd RCAs answered
+ *  later than the even ones.
+ *  A monitor request which gets no reply at all counts as "no reply", one
+ *  answered with an empty reply, the error response of the node, as "error
+ *  reply" and one answered with anything but its own RCA as "bad reply".
+ *
+ *  A run fails if it gets a bad reply, unless the ARCOM drops or corrupts
+ *  bytes and the link has no check (LINK_CRC), or if a monitor request is
+ *  not answered while the ARCOM is only slow.  Each failure is printed and
+ *  the bench exits with 1 if there was any.  A change to the firmware must
+ *  keep it passing in each of the builds above, with both files compiled
+ *  with the same options:
+ *    (none)   -DDEFERRED_CAN   -DCAN_RX_FIFO   -DLINK_CRC
+ *    -DSTROBE_INT -DSPLIT_MONITOR
+ *    -DSTROBE_INT -DSPLIT_MONITOR -DLINK_TAGS -DLINK_CRC
+ *
+ *  Usage:
+ *    bench_latency [byte_ns [reply_ns [requests]]]
+ *
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "hal.h"
+#include "hal_host_arcom.h"
+
+/* The firmware entry point, renamed at compile time */
+extern void ambsi_main(void);
+#ifdef SPLIT_MONITOR
+	/* The work of the firmware main loop */
+	extern void backgroundTasks(void);
+#endif
+
+#define MONITOR_DEADLINE_NS	150000UL	/* ICD monitor response deadline */
+#define MAX_REQUESTS		100000
+
+#ifdef DEFERRED_CAN
+	#define WAITING_SIZE	8	/* Ring of the amb library, RX_RING_SIZE */
+#elif defined(CAN_RX_FIFO)
+	#define WAITING_SIZE	8	/* Message objects 4 to 11, if the RCAs differ in bits 2..0 */
+#else
+	#define WAITING_SIZE	1	/* Message object 15 */
+#endif
+
+/* One request of a mix */
+typedef struct {
+	unsigned long long	arrival;	/* Emulated arrival time */
+	ulong				rca;
+	ubyte				len;		/* 0 -> monitor */
+} REQUEST;
+
+/* One mix of requests */
+typedef struct {
+	const char	*name;
+	ubyte		monitor_pct;	/* Percentage of monitor requests */
+	ulong		lowest_rca;		/* Requests are spread over this range */
+	ulong		highest_rca;
+	ulong		mean_gap_ns;	/* Mean time between arrivals */
+} MIX;
+
+static const MIX mixes[] = {
+	{ "monitor, idle bus",         100, 0x00100, 0x001FF, 2000000 },
+	{ "monitor, back to back",     100, 0x00100, 0x001FF,   50000 },
+	{ "80% monitor / 20% control",  80, 0x00100, 0x001FF,  200000 },
+	{ "50% monitor / 50% control",  50, 0x00100, 0x001FF,  200000 },
+	{ "AMBSI1 local points",       100, 0x20020, 0x20021,  200000 }
+};
+
+/* Faults of the simulated ARCOM, replayed with one of the mixes */
+typedef struct {
+	const char		*name;
+	ubyte			mix;			/* Index in mixes */
+	ubyte			slow_phase;		/* Phase 1..7 delayed by slow_ns, 0 for none */
+	unsigned long	slow_ns;
+	unsigned long	jitter_ns;
+	ubyte			drop_phase;		/* As in HAL_HOST_ARCOM_FAULTS */
+	unsigned int	drop_every;
+	unsigned long	resync_ns;
+	ubyte			dstrobe;
+	ubyte			corrupt_phase;
+	unsigned int	corrupt_every;
+	unsigned long	odd_ns;			/* Odd RCAs answered this much later */
+} SCENARIO;
+
+static const SCENARIO scenarios[] = {
+	{ "fault: reply 100 us late",                    0, 6, 100000,     0, 0,  0,      0, HAL_HOST_ARCOM_FREE, 0,  0, 0 },
+	{ "fault: jitter up to 20 us per byte",          0, 0,      0, 20000, 0,  0,      0, HAL_HOST_ARCOM_FREE, 0,  0, 0 },
+	{ "fault: RCA byte dropped 1 in 10, resync",     0, 0,      0,     0, 2, 10, 600000, HAL_HOST_ARCOM_FREE, 0,  0, 0 },
+	{ "fault: payload byte dropped 1 in 10, resync", 0, 0,      0,     0, 7, 10, 600000, HAL_HOST_ARCOM_FREE, 0,  0, 0 },
+	{ "fault: payload byte dropped 1 in 10",         0, 0,      0,     0, 7, 10,      0, HAL_HOST_ARCOM_FREE, 0,  0, 0 },
+	{ "fault: DSTROBE stuck high",                   0, 0,      0,     0, 0,  0,      0, HAL_HOST_ARCOM_STUCK_HIGH, 0,  0, 0 },
+	{ "fault: reply byte corrupted 1 in 10",         0, 0,      0,     0, 0,  0,      0, HAL_HOST_ARCOM_FREE, 7, 10, 0 },
+	{ "odd RCAs 150 us slower",                      2, 0,      0,     0, 0,  0,      0, HAL_HOST_ARCOM_FREE, 0,  0, 150000 }
+};
+
+static REQUEST requests[MAX_REQUESTS];
+static unsigned long long monitor_latency[MAX_REQUESTS];
+static unsigned long long control_latency[MAX_REQUESTS];
+static int num_monitor, num_control, num_lost, num_asked, num_empty, num_bad, num_refused;
+static int failures;
+
+static unsigned long long pending_arrival;	/* Arrival of the request in service */
+static int transmitted;						/* A monitor reply went out */
+static int serving;							/* The request is in the node */
+#ifdef SPLIT_MONITOR
+	/* Monitor requests served whose reply has not come yet, oldest first */
+	#define OPEN_SIZE	16
+	#define OPEN_TIMEOUT_NS	50000000ULL	/* Given up, so a later request for the RCA isn't matched */
+	static struct {
+		unsigned long long	arrival;
+		ulong				rca;
+	} open_requests[OPEN_SIZE];
+	static int num_open;
+#endif
+
+static ulong node_base;
+static int num_requests = 10000;
+static jmp_buf done;
+
+/* Small deterministic generator so runs can be compared */
+static ulong rnd_state = 12345;
+static ulong rnd(void){
+	rnd_state = rnd_state * 1103515245UL + 12345UL;
+	return (rnd_state >> 8) & 0xFFFFFF;
+}
+
+static void on_reply(unsigned long long arrival, ulong rca, ubyte len, ubyte *data){
+	monitor_latency[num_monitor++] = hal_host_clock_ns - arrival;
+	/* The simulated ARCOM answers an ordinary point with its RCA */
+	if (!len)
+		num_empty++;
+	else if (rca < 0x20000 && (len != 4 || data[0] != (ubyte) rca || data[1] != (ubyte) (rca >> 8) ||
+						  data[2] != (ubyte) (rca >> 16) || data[3] != (ubyte) (rca >> 24)))
+		num_bad++;
+}
+
+#ifdef SPLIT_MONITOR
+/* Forget the open requests the node has given up on */
+static void expire_open(void){
+	while (num_open && hal_host_clock_ns - open_requests[0].arrival > OPEN_TIMEOUT_NS)
+		memmove(&open_requests[0], &open_requests[1], --num_open * sizeof(open_requests[0]));
+}
+#endif
+
+static void on_transmit(ulong id, ubyte len, ubyte *data){
+	ulong rca = id - node_base;
+	#ifdef SPLIT_MONITOR
+		int i;
+
+		/* The reply of an earlier request, which the main loop sends */
+		expire_open();
+		for (i = 0; !serving && i < num_open; i++)
+			if (open_requests[i].rca == rca) {
+				on_reply(open_requests[i].arrival, rca, len, data);
+				for (num_open--; i < num_open; i++)
+					open_requests[i] = open_requests[i + 1];
+				return;
+			}
+	#endif
+	if (!transmitted && id != node_base) {
+		#ifdef SPLIT_MONITOR
+			/* An empty reply at once: no room in the link queue, the request
+			   is refused rather than held like an overwritten frame */
+			if (!len) {
+				num_refused++;
+				num_asked--;
+				transmitted = 1;
+				return;
+			}
+		#endif
+		on_reply(pending_arrival, rca, len, data);
+	}
+	transmitted = 1;
+}
+
+static int compare(const void *a, const void *b){
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, unsigned long long *samples, int count){
+	int i, misses;
+
+	if (!count) {
+		printf("  %-8s    none\n", what);
+		return;
+	}
+	qsort(samples, count, sizeof(samples[0]), compare);
+	for (i = 0, misses = 0; i < count; i++)
+		if (samples[i] > MONITOR_DEADLINE_NS)
+			misses++;
+	printf("  %-8s %6d  p50 %7.1f us  p99 %7.1f us  max %7.1f us  > 150 us: %d\n",
+		   what, count,
+		   samples[count / 2] / 1000.0,
+		   samples[(count * 99) / 100] / 1000.0,
+		   samples[count - 1] / 1000.0,
+		   misses);
+}
+
+static void run_mix(const MIX *mix){
+	int i, j, next;
+	int waiting[WAITING_SIZE], num_waiting;
+	unsigned long long t;
+	ubyte data[8] = { 0 };
+
+	/* Generate the arrivals */
+	t = hal_host_clock_ns;
+	for (i = 0; i < num_requests; i++) {
+		t += 1 + (unsigned long long) mix->mean_gap_ns * 2 * rnd() / 0x1000000;
+		requests[i].arrival = t;
+		requests[i].rca = mix->lowest_rca + rnd() % (mix->highest_rca - mix->lowest_rca + 1);
+		requests[i].len = (rnd() % 100 < mix->monitor_pct) ? 0 : 4;
+	}
+
+	num_monitor = num_control = num_lost = num_asked = num_empty = num_bad = num_refused = 0;
+	num_waiting = 0;
+	waiting[0] = 0;
+	for (i = 0; i < num_requests || num_waiting; ) {
+		#ifdef SPLIT_MONITOR
+			/* Nothing waiting: the main loop sends the replies meanwhile */
+			while (!num_waiting && hal_host_clock_ns < requests[i].arrival && num_open) {
+				hal_host_port_dstrobe();
+				backgroundTasks();
+				expire_open();
+			}
+		#endif
+
+		/* Nothing waiting: idle until the next arrival */
+		if (!num_waiting && hal_host_clock_ns < requests[i].arrival)
+			hal_host_clock_ns = requests[i].arrival;
+
+		/* Collect the requests which arrived while busy */
+		for (; i < num_requests && requests[i].arrival <= hal_host_clock_ns; i++) {
+			if (num_waiting < WAITING_SIZE) {
+				waiting[num_waiting++] = i;
+			} else {
+				num_lost++;
+				#if WAITING_SIZE == 1
+					/* A new frame overwrites object 15 */
+					waiting[0] = i;
+				#endif
+			}
+		}
+
+		/* Serve the oldest one */
+		next = waiting[0];
+		for (j = 1; j < num_waiting; j++)
+			waiting[j - 1] = waiting[j];
+		num_waiting--;
+
+		pending_arrival = requests[next].arrival;
+		transmitted = 0;
+		/* Control RCAs are the monitor RCAs + 0x10000, as on the FEMC */
+		if (requests[next].len)
+			requests[next].rca |= 0x10000;
+		else
+			num_asked++;
+		serving = 1;
+		hal_host_can_receive(node_base + requests[next].rca, requests[next].len, data);
+		amb_service();
+		serving = 0;
+		if (requests[next].len)
+			control_latency[num_control++] = hal_host_clock_ns - pending_arrival;
+
+		#ifdef SPLIT_MONITOR
+			/* Its reply comes later, the oldest request is given up to make room */
+			if (!requests[next].len && !transmitted) {
+				if (num_open == OPEN_SIZE)
+					memmove(&open_requests[0], &open_requests[1], --num_open * sizeof(open_requests[0]));
+				open_requests[num_open].arrival = requests[next].arrival;
+				open_requests[num_open].rca = requests[next].rca;
+				num_open++;
+			}
+			/* The main loop runs between two interrupts */
+			backgroundTasks();
+		#endif
+	}
+
+	#ifdef SPLIT_MONITOR
+		/* The replies of the last requests, given up after 10 ms */
+		for (t = hal_host_clock_ns + 10000000; num_open && hal_host_clock_ns < t; ) {
+			hal_host_port_dstrobe();
+			backgroundTasks();
+		}
+		num_open = 0;
+	#endif
+
+	printf("%s\n", mix->name);
+	report("monitor", monitor_latency, num_monitor);
+	report("control", control_latency, num_control);
+	printf("  lost     %6d  refused %d\n", num_lost, num_refused);
+	printf("  no reply %6d  error reply %d  bad reply %d\n", num_asked - num_monitor, num_empty, num_bad);
+}
+
+/* Count and print a failed check of the last run */
+static void expect(int ok, const char *what){
+	if (!ok) {
+		printf("  FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static void run_scenario(const SCENARIO *scenario){
+	HAL_HOST_ARCOM_TIMING timing = hal_host_arcom_timing;
+	ulong dropped = hal_host_arcom_dropped, aborted = hal_host_arcom_aborted;
+	ulong naks = hal_host_arcom_naks;
+
+	if (scenario->slow_phase)
+		hal_host_arcom_timing.phase_ns[scenario->slow_phase - 1] = scenario->slow_ns;
+	hal_host_arcom_timing.jitter_ns = scenario->jitter_ns;
+	hal_host_arcom_faults.drop_phase = scenario->drop_phase;
+	hal_host_arcom_faults.drop_every = scenario->drop_every;
+	hal_host_arcom_faults.resync_ns = scenario->resync_ns;
+	hal_host_arcom_faults.dstrobe = scenario->dstrobe;
+	hal_host_arcom_faults.corrupt_phase = scenario->corrupt_phase;
+	hal_host_arcom_faults.corrupt_every = scenario->corrupt_every;
+	hal_host_arcom_timing.odd_ns = scenario->odd_ns;
+
+	printf("%s, ", scenario->name);
+	run_mix(&mixes[scenario->mix]);
+	printf("  ARCOM dropped %lu bytes, %lu transactions aborted, %lu replies sent again\n",
+		   (unsigned long) (hal_host_arcom_dropped - dropped), (unsigned long) (hal_host_arcom_aborted - aborted),
+		   (unsigned long) (hal_host_arcom_naks - naks));
+	if (!scenario->drop_phase && scenario->dstrobe == HAL_HOST_ARCOM_FREE && !scenario->corrupt_phase)
+		expect(num_monitor == num_asked && num_empty == 0, "request not answered");
+	#ifdef LINK_CRC
+		expect(num_bad == 0, "bad reply");
+	#else
+		/* Without a check a byte lost or flipped reaches the reply */
+		expect(num_bad == 0 || scenario->drop_phase || scenario->corrupt_phase, "bad reply");
+	#endif
+
+	hal_host_arcom_timing = timing;
+	memset(&hal_host_arcom_faults, 0, sizeof(hal_host_arcom_faults));
+}
+
+/* Runs from the firmware main loop once the link is up */
+static void bench(void){
+	unsigned i;
+
+	printf("ARCOM byte %lu ns, reply %lu ns; AMBSI1 poll %lu ns, access %lu ns\n",
+		   hal_host_arcom_timing.byte_ns, hal_host_arcom_timing.reply_ns,
+		   hal_host_poll_ns, hal_host_access_ns);
+	printf("Link up after %.1f us, %lu transactions\n\n",
+		   hal_host_clock_ns / 1000.0, (unsigned long) hal_host_arcom_transactions);
+	for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+		run_mix(&mixes[i]);
+		expect(num_monitor == num_asked && num_empty == 0, "request not answered");
+		expect(num_bad == 0, "bad reply");
+	}
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+		run_scenario(&scenarios[i]);
+	printf("\n%s: %d failed checks\n", failures ? "FAIL" : "PASS", failures);
+	longjmp(done, 1);
+}
+
+int main(int argc, char **argv){
+	if (argc > 1)
+		hal_host_arcom_timing.byte_ns = strtoul(argv[1], 0, 0);
+	if (argc > 2)
+		hal_host_arcom_timing.reply_ns = strtoul(argv[2], 0, 0);
+	if (argc > 3)
+		num_requests = atoi(argv[3]);
+	if (num_requests < 1 || num_requests > MAX_REQUESTS)
+		num_requests = MAX_REQUESTS;
+
+	hal_host_node_address = 0;
+	node_base = ((ulong) (hal_host_node_address + 1)) * 262144;
+
+	hal_host_arcom_attach();
+#ifdef LINK_CRC
+	hal_host_arcom_crc = 1;
+#endif
+	hal_host_can_tx_hook = on_transmit;
+	hal_host_idle_hook = bench;
+
+	if (!setjmp(done))
+		ambsi_main();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+/*
+ ****************************************************************************
+ *  TEST_BUILTIN.C
+ *
+ *  Checks the dispatch of the monitor and control points common to all
+ *  slaves (0x30000 on, 0x31000 on) through the handler tables of the amb
+ *  library, on the host back end of the HAL.  Requests are fed to
+ *  amb_can_isr with hal_host_can_receive and the responses are caught with
+ *  hal_host_can_tx_hook.
+ *
+ *  Build and run, from the top of the repository:
+ *    gcc -std=c99 -DHOST_ARCH -Ilibraries/hal -o test_builtin
+ *        host/test_builtin.c libraries/amb/amb.c libraries/hal/hal_host.c
+ *    ./test_builtin
+ *
+ *  Prints every failed check and exits with 1 if there was any.
+ *
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+
+#include "hal.h"
+
+#define MAX_CALLBACKS	8
+
+static CALLBACK_STRUCT cb_memory[MAX_CALLBACKS];
+static ulong node_base;
+static int failures;
+
+/* Last response sent */
+static int responses;
+static ulong response_rca;
+static ubyte response_len;
+static ubyte response_data[8];
+
+/* Calls of the registered callback and of the reset */
+static int callbacks;
+static int resets;
+
+static void on_transmit(ulong id, ubyte len, ubyte *data){
+	ubyte i;
+
+	responses++;
+	response_rca = id - node_base;
+	response_len = len;
+	for (i = 0; i < len && i < 8; i++)
+		response_data[i] = data[i];
+}
+
+static void on_reset(void){
+	resets++;
+}
+
+static int answer(CAN_MSG_TYPE *message){
+	callbacks++;
+	if (message->dirn == CAN_MONITOR) {
+		message->len = 1;
+		message->data[0] = 0xA5;
+	}
+	return 0;
+}
+
+static void check(int ok, const char *what, ulong rca){
+	if (!ok) {
+		printf("FAIL: 0x%05lX %s\n", (unsigned long) rca, what);
+		failures++;
+	}
+}
+
+/* Send a monitor request, returns the length of the response or -1 for none */
+static int monitor(ulong rca){
+	int before = responses;
+
+	hal_host_can_receive(node_base + rca, 0, 0);
+	if (responses == before)
+		return -1;
+	check(responses == before + 1, "more than one response", rca);
+	check(response_rca == rca, "response on another RCA", rca);
+	return response_len;
+}
+
+/* The count in the last response to 0x30002 */
+static ulong transactions(void){
+	return ((ulong) response_data[0] << 24) | ((ulong) response_data[1] << 16) |
+		   ((ulong) response_data[2] << 8) | response_data[3];
+}
+
+static void control(ulong rca){
+	ubyte data[1] = { 1 };
+	int before = responses;
+
+	hal_host_can_receive(node_base + rca, 1, data);
+	check(responses == before, "response to a control request", rca);
+}
+
+int main(void){
+	ulong before;
+	int len;
+
+	hal_host_node_address = 0;
+	node_base = ((ulong) (hal_host_node_address + 1)) * 262144;
+	hal_host_can_tx_hook = on_transmit;
+	hal_host_reset_hook = on_reset;
+
+	if (amb_init_slave((void *) cb_memory, MAX_CALLBACKS) != 0) {
+		printf("FAIL: amb_init_slave\n");
+		return 1;
+	}
+	amb_start();
+
+	/* Every monitor handler answers with its own length */
+	check(monitor(0x30000) == 3, "protocol revision", 0x30000);
+	check(monitor(0x30001) == 4, "errors", 0x30001);
+	check(monitor(0x30004) == 3, "software revision", 0x30004);
+	check(monitor(0x30005) == 2, "hardware revision", 0x30005);
+	check(monitor(0x30006) == 8, "lookup cache", 0x30006);
+	check(monitor(0x30007) == 7 && response_data[2] == 8, "deferred ring", 0x30007);
+	check(monitor(0x30008) == 8 && response_data[7] == 0, "receive FIFO", 0x30008);
+	check(monitor(0x30009) == 7 && response_data[4] == 3, "transmit objects", 0x30009);
+
+	/* Each builtin request is a transaction */
+	len = monitor(0x30002);
+	before = transactions();
+	check(len == 4 && before == 8, "transactions", 0x30002);
+	monitor(0x30002);
+	check(transactions() == before + 1, "transactions counted", 0x30002);
+
+	/* The empty entry and the RCAs past the tables are left to the callbacks */
+	check(monitor(0x30003) == -1, "answered with no callback", 0x30003);
+	check(monitor(0x3000A) == -1, "answered with no callback", 0x3000A);
+	check(amb_register_function(0x30000, 0x3000A, answer) == 0, "registration", 0x30000);
+	callbacks = 0;
+	check(monitor(0x30003) == 1 && response_data[0] == 0xA5 && callbacks == 1, "not sent to the callback", 0x30003);
+	check(monitor(0x3000A) == 1 && callbacks == 2, "not sent to the callback", 0x3000A);
+
+	/* The builtin handlers keep precedence over a callback */
+	check(monitor(0x30000) == 3 && callbacks == 2, "taken by the callback", 0x30000);
+
+	/* A control request to a monitor point goes to the callback */
+	control(0x30000);
+	check(callbacks == 3, "control not sent to the callback", 0x30000);
+
+	/* Both reset controls reset, nothing else does */
+	resets = 0;
+	control(0x31000);
+	check(resets == 1, "no reset", 0x31000);
+	control(0x31001);
+	check(resets == 2, "no reset", 0x31001);
+	control(0x31002);
+	check(resets == 2, "reset", 0x31002);
+	check(monitor(0x31000) == -1 && resets == 2, "monitor request reset", 0x31000);
+
+	printf("%s: %d failed checks\n", failures ? "FAIL" : "PASS", failures);
+	return failures ? 1 : 0;
+}
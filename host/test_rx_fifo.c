@@ -0,0 +1,102 @@
+/*
+ ****************************************************************************
+ *  TEST_RX_FIFO.C
+ *
+ *  Checks the order in which the amb library takes the requests out of the
+ *  receive FIFO objects 4 to 11, on the host back end of the HAL.  Bits 2..0
+ *  of the RCA select the object, so a burst on consecutive RCAs fills
+ *  consecutive objects.  The bursts are fed with hal_host_can_receive while
+ *  the CAN interrupt is held off, then handled by one call of amb_can_isr.
+ *
+ *  Build and run, from the top of the repository:
+ *    gcc -std=c99 -DHOST_ARCH -Ilibraries/hal -o test_rx_fifo
+ *        host/test_rx_fifo.c libraries/amb/amb.c libraries/hal/hal_host.c
+ *    ./test_rx_fifo
+ *
+ *  Prints every failed check and exits with 1 if there was any.
+ *
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+
+#include "hal.h"
+
+#define MAX_CALLBACKS	4
+#define FIRST_RCA		0x00100L
+#define LAST_RCA		0x0011FL
+#define MAX_REQUESTS	8
+
+static CALLBACK_STRUCT cb_memory[MAX_CALLBACKS];
+static ulong node_base;
+static int failures;
+
+/* RCAs of the requests handled, in order */
+static ulong handled[MAX_REQUESTS];
+static int requests;
+
+static int answer(CAN_MSG_TYPE *message){
+	if (requests < MAX_REQUESTS)
+		handled[requests] = message->relative_address;
+	requests++;
+	return 0;
+}
+
+static void check(int ok, const char *what, ulong rca){
+	if (!ok) {
+		printf("FAIL: 0x%05lX %s\n", (unsigned long) rca, what);
+		failures++;
+	}
+}
+
+/* Send count control requests on consecutive RCAs from rca with the CAN
+   interrupt held off, then let it run and check they were handled in turn */
+static void burst(ulong rca, int count){
+	ubyte data[1] = { 1 };
+	int i;
+
+	requests = 0;
+	XP0IC &= ~0x0040;
+	for (i = 0; i < count; i++)
+		check(hal_host_can_receive(node_base + rca + i, 1, data) == 3 + (int) ((rca + i) & 7),
+			  "not received by its FIFO object", rca + i);
+	check(requests == 0, "handled with the interrupt held off", rca);
+	XP0IC |= 0x0040;
+	hal_host_can_deliver();
+
+	check(requests == count, "not all requests handled", rca);
+	for (i = 0; i < count && i < requests; i++)
+		check(handled[i] == rca + i, "handled out of order", rca + i);
+}
+
+int main(void){
+	ubyte data[1] = { 1 };
+
+	hal_host_node_address = 0;
+	node_base = ((ulong) (hal_host_node_address + 1)) * 262144;
+
+	if (amb_init_slave((void *) cb_memory, MAX_CALLBACKS) != 0) {
+		printf("FAIL: amb_init_slave\n");
+		return 1;
+	}
+	check(amb_register_function(FIRST_RCA, LAST_RCA, answer) == 0, "registration", FIRST_RCA);
+	check(amb_set_rx_fifo(1) == 0, "receive FIFO", FIRST_RCA);
+	amb_start();
+
+	/* A burst from the first object */
+	burst(FIRST_RCA, 4);
+
+	/* One request to object 5, so the next pass starts at object 6 */
+	requests = 0;
+	hal_host_can_receive(node_base + FIRST_RCA + 5, 1, data);
+	check(requests == 1 && handled[0] == FIRST_RCA + 5, "single request", FIRST_RCA + 5);
+
+	/* A burst wrapping the FIFO: objects 6, 7, 0 and 1 */
+	burst(FIRST_RCA + 6, 4);
+
+	/* A burst filling the whole FIFO from object 2 */
+	burst(FIRST_RCA + 0x0A, 8);
+
+	printf("%s: %d failed checks\n", failures ? "FAIL" : "PASS", failures);
+	return failures ? 1 : 0;
+}
@@ -26,14 +26,29 @@
 
 /* Version of SOFTWARE */
 #define SW_VERSION_MAJOR 1
-#define SW_VERSION_MINOR 2
-#define SW_VERSION_PATCH 3
+#define SW_VERSION_MINOR 3
+#define SW_VERSION_PATCH 0
 /* Version of HARDWARE */
 #define HW_VERSION_MAJOR 1
 #define HW_VERSION_MINOR 6
 
 /* REVISION HISTORY */
 /*
+ * Version 01.03.00 - Callback table is kept sorted and non-overlapping by
+ *                    amb_register_function. Ranges overlapping earlier
+ *                    registrations are split around them, so the earlier
+ *                    registration still wins. Dispatch uses a binary search.
+ *                    Two entry cache of the last matched callbacks in front of
+ *                    the lookup, with hit/miss counters at RCA 0x30006.
+ *                    Common monitor and control points are served from
+ *                    constant handler tables instead of a switch.
+ *                    Hardware accessed through the HAL in ../hal, which has a
+ *                    host back end emulating the 82527.
+ *                    Optional deferred mode: the ISR only queues requests in
+ *                    a ring drained by amb_service from the main loop.
+ *                    Optional receive FIFO in message objects 4 to 11.
+ *                    Monitor responses sent from objects 3, 13 and 14 in turn.
+ *                    Hit, error and latency counters of each registration.
  * Version 01.01.02 - Released as Ver_1_1_2
            01.02.03   Patch by Andrea Vaccari - NRAO NTC
 		   			  Changed code to assure that any RCA is not serviced more than once in
@@ -58,49 +73,14 @@
 
 
 
- /* Include C167 register definitions */
-
-	#include <reg167.h>
-	#include <intrins.h>
-
-
-
 #include "amb.h"
- /* Include Dallas Semiconductor support for C167 */
-
-#include "..\..\libraries\ds1820\ds1820.h"
-
 
+/* Include the hardware abstraction layer */
+#include "../hal/hal.h"
 
-/* Definitions of CAN controller structure */
+/* Include Dallas Semiconductor support for C167 */
+#include "../ds1820/ds1820.h"
 
- /* For Siemens C167CR */
-
-	/* Locations of CAN controller registers */
-	#define C1CSR   (*((uword volatile sdata *) 0xEF00)) /* Control/Status Register */
-	#define C1IR    (*((uword volatile sdata *) 0xEF02)) /* Interrupt Register */
-	#define C1BTR   (*((uword volatile sdata *) 0xEF04)) /* Bit Timing Register */
-	#define C1GMS   (*((uword volatile sdata *) 0xEF06)) /* Global Mask Short */
-	#define C1UGML  (*((uword volatile sdata *) 0xEF08)) /* Upper Global Mask Long */
-	#define C1LGML  (*((uword volatile sdata *) 0xEF0A)) /* Lower Global Mask Long */
-	#define C1UMLM  (*((uword volatile sdata *) 0xEF0C)) /* Upper Mask of Last Message */
-	#define C1LMLM  (*((uword volatile sdata *) 0xEF0E)) /* Lower Mask of Last Message */
-	/* 
-	 * Structure for a single 82527 CAN object
-	 * A total of 15 such object structures exists
-	 */
-
-	struct can_obj {
-	  uword  MCR;       /* Message Control Register */
-	  uword  UAR;       /* Upper Arbitration Register */
-	  uword  LAR;       /* Lower Arbitration Register */
-	  ubyte  MCFG;      /* Message Configuration Register */
-	  ubyte  Data[8];   /* Message Data 0 .. 7 */
-	  ubyte  Customer;  /* Reserved for application specific data */
-	} ;
-
-	/* Location of first CAN object */
-	#define CAN_OBJ ((struct can_obj volatile sdata *) 0xEF10)
 
 
 /*
@@ -115,8 +95,27 @@
 static ubyte 	amb_get_node_address();
 static int		amb_get_serial_number();
 static int		amb_setup_CAN_hw();
-static void		amb_handle_transaction();
-static void		amb_transmit_monitor();
+static void		amb_handle_transaction(struct can_obj volatile *frame);
+static void		amb_accept_request(struct can_obj volatile *frame);
+static void		amb_drain_rx_fifo();
+static void		amb_transmit_monitor(CAN_MSG_TYPE *msg);
+static int		amb_insert_callback(ubyte pos, ulong low_address, ulong high_address, read_or_write_func func, ubyte stats_index);
+static CALLBACK_STRUCT *amb_find_callback(ulong relative_address);
+static CALLBACK_STRUCT *amb_lookup_callback(ulong relative_address);
+static void		amb_flush_lookup_cache();
+static void		amb_mon_protocol_rev();
+static void		amb_mon_errors();
+static void		amb_mon_transactions();
+static void		amb_mon_sw_rev();
+static void		amb_mon_hw_rev();
+static void		amb_mon_lookup_cache();
+static void		amb_mon_rx_ring();
+static void		amb_mon_rx_fifo();
+static void		amb_mon_tx_queue();
+static void		amb_ctrl_reset();
+
+/* Handler of a monitor or control point common to all slaves */
+typedef void (*builtin_func)();
 
 /* All pertinent slave data */
 
@@ -135,10 +134,87 @@ static void		amb_transmit_monitor();
 
 	ubyte		identify_mode;		/* True when responding to identify broadcast */
 
-	ubyte		num_cbs;			/* No of callbacks registered */
+	ubyte		num_cbs;			/* No of entries in the callback table */
+	ubyte		max_cbs;			/* Elements in the callback memory */
+	ubyte		num_regs;			/* No of calls to amb_register_function */
+	ubyte		num_stats;			/* No of registrations with counters */
+	ubyte		stats_enabled;		/* Next registrations get counters */
 	CALLBACK_STRUCT	*cb_ops;		/* User supplied callbacks */
 } idata slave_node;
 
+/* Cache of the last matched callbacks.  Most of the traffic hits one or two
+   ranges, so these are tried before searching the callback table. */
+#define LOOKUP_CACHE_SIZE	2	/* Replacement toggles between the two entries */
+
+	static struct lookup_cache {
+
+	CALLBACK_STRUCT	entry[LOOKUP_CACHE_SIZE];	/* Copies of the last matched callbacks */
+	ubyte		victim;				/* Next entry to be replaced */
+	ulong		hits;				/* Lookups answered by the cache */
+	ulong		misses;				/* Lookups which went to the table */
+} idata lookup_cache;
+
+/* Requests waiting for amb_service in deferred mode.  The CAN ISR is the
+   only writer of head and the main loop the only writer of tail. */
+#define RX_RING_SIZE	8	/* Must be a power of two */
+
+	static struct rx_ring {
+
+	struct can_obj	frame[RX_RING_SIZE];	/* Copies of the received frames */
+	volatile ubyte	head;			/* Next slot written by the ISR */
+	volatile ubyte	tail;			/* Next slot read by amb_service */
+	ubyte		high_water;			/* Deepest the ring has been */
+	ubyte		deferred;			/* True when requests are queued here */
+	ulong		overflows;			/* Requests lost with the ring full */
+} rx_ring;
+
+/* Receive FIFO in the spare message objects.  Each object accepts the
+   requests whose RCA ends with its own 3 bit pattern, so that a burst on
+   consecutive RCAs is spread over the objects without help from the CPU.
+   Object 15 keeps its place as the last resort. */
+#define RX_FIFO_FIRST	3	/* Index of the first object (object 4) */
+#define RX_FIFO_OBJECTS	8	/* Objects 4 to 11, one per value of RCA bits 2..0 */
+
+	static struct rx_fifo {
+
+	ubyte		enabled;			/* True when the objects are receiving */
+	ubyte		next;				/* Object to look at first when draining */
+	ubyte		max_pending;		/* Most objects found holding a request at once */
+	uword		lost;				/* Requests overwritten in an object (MSGLST) */
+	ulong		received;			/* Requests taken from the objects */
+} idata rx_fifo;
+
+/* Message objects transmitting monitor responses (objects 3, 13 and 14),
+   in the order the 82527 sends them when several are pending: lowest
+   number first.  A response goes to the object after the last pending
+   one, so it is sent after the responses already waiting.  With the last
+   object pending it goes to any free one, and may then overtake them; it
+   rewrites a frame still waiting for arbitration, the oldest one, only
+   when all of them are. */
+#define TX_OBJECTS		3
+
+	static const ubyte tx_objects[TX_OBJECTS] = { 2, 12, 13 };
+
+/* Is transmit object I still waiting to be sent? */
+#define TX_PENDING(I)	((CAN_OBJ[tx_objects[I]].MCR & 0x3000) == 0x2000)    /* if TXRQ set */
+
+	static struct tx_queue {
+
+	ubyte		seq;				/* Number of the next response */
+	ubyte		order[TX_OBJECTS];	/* Number of the response in each object */
+	uword		busy;				/* Responses sent while the previous one was pending */
+	uword		overruns;			/* Responses which replaced a pending one */
+	uword		reordered;			/* Responses sent ahead of a pending one */
+} idata tx_queue;
+
+/* Longest wait of amb_send_monitor for a free object, 1 ms */
+#define SEND_TIMEOUT_TICKS	((uword) (1000000L / HAL_TIMER_NS_PER_TICK))
+
+/* Counters and latency histogram of the registrations which have them,
+   indexed by stats_index.  The latency is the time spent in amb_handle_transaction,
+   measured with the free running timer of the HAL. */
+	static AMB_RANGE_STATS range_stats[AMB_STATS_RANGES];
+
 /* Structure for sharing message data with callbacks */
 
 	static CAN_MSG_TYPE idata current_msg;
@@ -146,12 +222,42 @@ static void		amb_transmit_monitor();
 
 
 /* Initialise routine */
-int amb_init_slave(void *cb_ops_memory){
+int amb_init_slave(void *cb_ops_memory, ubyte cb_ops_size){
 /* Point to callback memory */
 	slave_node.cb_ops = (CALLBACK_STRUCT *) cb_ops_memory;
+	slave_node.max_cbs = cb_ops_size;
 
 /* Initially we have no registered callbacks */
 	slave_node.num_cbs = 0;
+	slave_node.num_regs = 0;
+	slave_node.num_stats = 0;
+	slave_node.stats_enabled = TRUE;
+	amb_flush_lookup_cache();
+	lookup_cache.hits = 0;
+	lookup_cache.misses = 0;
+
+/* Requests are handled in the ISR unless amb_set_deferred says otherwise */
+	rx_ring.head = 0;
+	rx_ring.tail = 0;
+	rx_ring.high_water = 0;
+	rx_ring.deferred = FALSE;
+	rx_ring.overflows = 0;
+
+/* All requests go to object 15 unless amb_set_rx_fifo says otherwise */
+	rx_fifo.enabled = FALSE;
+	rx_fifo.next = 0;
+	rx_fifo.max_pending = 0;
+	rx_fifo.lost = 0;
+	rx_fifo.received = 0;
+
+/* Monitor responses start in object 3 */
+	tx_queue.seq = 0;
+	tx_queue.busy = 0;
+	tx_queue.overruns = 0;
+	tx_queue.reordered = 0;
+
+/* Start the timer for the latency histograms */
+	HAL_TIMER_INIT();
 
 /* Get the address of this slave from the hardware */
 	slave_node.node_address = amb_get_node_address();
@@ -185,28 +291,144 @@ int amb_init_slave(void *cb_ops_memory){
 
 /* Register callback routine */
 int amb_register_function(ulong low_address, ulong high_address, read_or_write_func func){
+	ubyte i;
+	ulong next;
+	ubyte done;
+	ubyte pieces;
+	ubyte stats_index;
+	bit int_enabled;
+
+	if (low_address > high_address)
+		return -1;
+
+	HAL_CAN_INT_DISABLE(int_enabled);
+
+/* Count the holes first, so that a registration which does not fit leaves
+   the table as it was */
+	next = low_address;
+	done = FALSE;
+	pieces = 0;
+	for (i = 0; i < slave_node.num_cbs; i++) {
+		if (slave_node.cb_ops[i].high_address < next)
+			continue;
+		if (slave_node.cb_ops[i].low_address > high_address)
+			break;
+		if (slave_node.cb_ops[i].low_address > next)
+			pieces++;
+		if (slave_node.cb_ops[i].high_address >= high_address) {
+			done = TRUE;
+			break;
+		}
+		next = slave_node.cb_ops[i].high_address + 1;
+	}
+	if (!done)
+		pieces++;
+	if (pieces > slave_node.max_cbs - slave_node.num_cbs) {
+		HAL_CAN_INT_RESTORE(int_enabled);
+		return -1;
+	}
+
+/* Take the next counters, unless the range is hidden by earlier ones */
+	stats_index = AMB_NO_STATS;
+	if (slave_node.stats_enabled && pieces && slave_node.num_stats < AMB_STATS_RANGES)
+		stats_index = slave_node.num_stats;
+
+/* Walk the sorted table and fill every hole of [low_address, high_address]
+   which is not already owned by an earlier registration */
+	next = low_address;
+	done = FALSE;
+	for (i = 0; i < slave_node.num_cbs; i++) {
+		if (slave_node.cb_ops[i].high_address < next)
+			continue;
+		if (slave_node.cb_ops[i].low_address > high_address)
+			break;
+		if (slave_node.cb_ops[i].low_address > next) {
+			amb_insert_callback(i, next, slave_node.cb_ops[i].low_address - 1, func, stats_index);
+			i++;
+		}
+		if (slave_node.cb_ops[i].high_address >= high_address) {
+			done = TRUE;
+			break;
+		}
+		next = slave_node.cb_ops[i].high_address + 1;
+	}
+	if (!done)
+		amb_insert_callback(i, next, high_address, func, stats_index);
+
+/* Table entries have moved */
+	amb_flush_lookup_cache();
+
+/* Start the counters of this registration */
+	if (stats_index != AMB_NO_STATS) {
+		range_stats[stats_index].low_address = low_address;
+		range_stats[stats_index].high_address = high_address;
+		range_stats[stats_index].hits = 0;
+		range_stats[stats_index].errors = 0;
+		for (i = 0; i < AMB_STATS_BUCKETS; i++)
+			range_stats[stats_index].histogram[i] = 0;
+		slave_node.num_stats++;
+	}
+
+/* Increment the number of registrations */
+	slave_node.num_regs++;
+
+	HAL_CAN_INT_RESTORE(int_enabled);
+
+	return 0;
+}
+
+/* Insert one entry in the callback table at position pos */
+int amb_insert_callback(ubyte pos, ulong low_address, ulong high_address, read_or_write_func func, ubyte stats_index){
+	ubyte i;
+
+/* The callback memory is full */
+	if (slave_node.num_cbs >= slave_node.max_cbs)
+		return -1;
+
+/* Make room */
+	for (i = slave_node.num_cbs; i > pos; i--)
+		slave_node.cb_ops[i] = slave_node.cb_ops[i - 1];
+
 /* Store callback info */
-	slave_node.cb_ops[slave_node.num_cbs].low_address = low_address;
-	slave_node.cb_ops[slave_node.num_cbs].high_address = high_address;
-	slave_node.cb_ops[slave_node.num_cbs].cb_func = func;
+	slave_node.cb_ops[pos].low_address = low_address;
+	slave_node.cb_ops[pos].high_address = high_address;
+	slave_node.cb_ops[pos].cb_func = func;
+	slave_node.cb_ops[pos].reg_index = slave_node.num_regs;
+	slave_node.cb_ops[pos].stats_index = stats_index;
 
 /* Increment the number of callbacks */
 	slave_node.num_cbs++;
 
-/* Always succeeds */
 	return 0;
 }
 
 /* Unregister last registered callback routine */
 int amb_unregister_last_function(void){
+	ubyte i, j;
+	bit int_enabled;
 
 /* If no function is registered, nothing to be done. */
-	if(!slave_node.num_cbs){
+	if(!slave_node.num_regs){
 		return 0;
 	}
 
-/* Decrement the number of callbacks. */
-	slave_node.num_cbs--;
+/* Decrement the number of registrations. */
+	slave_node.num_regs--;
+
+	HAL_CAN_INT_DISABLE(int_enabled);
+
+/* Drop every table entry created by that registration, and its counters,
+   the last ones given out, if it had any. */
+	for (i = 0, j = 0; i < slave_node.num_cbs; i++) {
+		if (slave_node.cb_ops[i].reg_index != slave_node.num_regs)
+			slave_node.cb_ops[j++] = slave_node.cb_ops[i];
+		else if (slave_node.cb_ops[i].stats_index != AMB_NO_STATS)
+			slave_node.num_stats = slave_node.cb_ops[i].stats_index;
+	}
+	slave_node.num_cbs = j;
+	amb_flush_lookup_cache();
+
+	HAL_CAN_INT_RESTORE(int_enabled);
 
 	return 0;
 }
@@ -221,14 +443,7 @@ int amb_start(){
 
 /* Read the slave address */
 ubyte amb_get_node_address(){
-	#ifdef AMBSI  /* Standard i/f, DIP switch on Port 3.1 to 3.6 */
-		return (P3 & 0x7e) >> 1;
-	#endif /* AMBSI */
-
-	#ifdef SK167  /* Starter Kit test board, DIP switch on Port 7.1 to 7.6 */
-		return (P7 & 0x7e) >> 1;
-	#endif /* SK167 */
-
+	return HAL_NODE_ADDRESS();
 }
 
 /* Read the serial number from the Dallas Semiconductor device */
@@ -255,6 +470,7 @@ int amb_get_serial_number(){
 int amb_setup_CAN_hw(){
 
 		ulong LAR, UAR;
+		ubyte i;
 
 		/* Set up for the various arbitration registers */
 
@@ -292,7 +508,7 @@ int amb_setup_CAN_hw(){
   		 *  Message object 1 is valid
   		 *  enable receive interrupt
 		 */
-  		CAN_OBJ[0].MCR  = 0x5599;    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(0, 0x5599);    /* set Message Control Register */
 
 	  	/*
   	 	 * message direction is receive
@@ -310,7 +526,7 @@ int amb_setup_CAN_hw(){
   		 *  ------------------------------------------------------------------------
   		 *  Message object 2 is valid
 		 */
-  		CAN_OBJ[1].MCR  = 0x5695;    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(1, 0x5695);    /* set Message Control Register */
 
 	  	/* 
 		 * message direction is transmit
@@ -339,7 +555,7 @@ int amb_setup_CAN_hw(){
   		 *  ------------------------------------------------------------------------
   		 *  Message object 3 is valid
    		 */
-	  	CAN_OBJ[2].MCR  = 0x5695;    /* set Message Control Register */
+	  	HAL_CAN_MCR_WRITE(2, 0x5695);    /* set Message Control Register */
 
 	  	/* 
 		 * message direction is transmit
@@ -352,21 +568,34 @@ int amb_setup_CAN_hw(){
   		CAN_OBJ[2].LAR  = 0x0000;    /* set Lower Arbitration Register */
   		
 	  	/*  ------------------------------------------------------------------------
-  		 *  ----------------- Configure Message Objects 4 to 14 --------------------
-		 *  --- These objects are not used at present ------------------------------
+  		 *  ----------------- Configure Message Objects 4 to 12 --------------------
+		 *  --- These objects are not used unless amb_set_rx_fifo enables the ------
+		 *  --- receive FIFO in objects 4 to 11 ------------------------------------
   		 *  ------------------------------------------------------------------------
 		 */
-  	   	CAN_OBJ[3].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[4].MCR  = 0x5555;    /* set Message Control Register */
-	  	CAN_OBJ[5].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[6].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[7].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[8].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[9].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[10].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[11].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[12].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[13].MCR  = 0x5555;    /* set Message Control Register */
+  	   	HAL_CAN_MCR_WRITE(3, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(4, 0x5555);    /* set Message Control Register */
+	  	HAL_CAN_MCR_WRITE(5, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(6, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(7, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(8, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(9, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(10, 0x5555);    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(11, 0x5555);    /* set Message Control Register */
+
+	  	/*  ------------------------------------------------------------------------
+  		 *  ----------------- Configure Message Objects 13 and 14 ------------------
+		 *  --- These objects take turns with object 3 to transmit monitor data, ---
+		 *  --- so a response can be queued while the previous one is pending. ----
+  		 *  ------------------------------------------------------------------------
+  		 *  Message objects 13 and 14 are valid
+   		 */
+		for (i = 1; i < TX_OBJECTS; i++) {
+			HAL_CAN_MCR_WRITE(tx_objects[i], 0x5695);    /* set Message Control Register */
+			CAN_OBJ[tx_objects[i]].MCFG = 0x0C;      /* set Message Configuration Register */
+			CAN_OBJ[tx_objects[i]].UAR  = 0x0000;    /* set Upper Arbitration Register */
+			CAN_OBJ[tx_objects[i]].LAR  = 0x0000;    /* set Lower Arbitration Register */
+		}
 
 	  	/*  ------------------------------------------------------------------------
   		 *  ----------------- Configure Message Object 15 --------------------------
@@ -375,7 +604,7 @@ int amb_setup_CAN_hw(){
   		 *  Message object 15 is valid
   		 *  enable receive interrupt
    		 */
-  		CAN_OBJ[14].MCR  = 0x5599;    /* set Message Control Register */
+  		HAL_CAN_MCR_WRITE(14, 0x5599);    /* set Message Control Register */
 
 	  	/* 
 		 * message direction is receive
@@ -424,7 +653,7 @@ int amb_setup_CAN_hw(){
  ****************************************************************************
  */
 
-	void amb_can_isr(void) interrupt XP0INT{
+	void amb_can_isr(void) HAL_INTERRUPT(XP0INT){
   	uword uwIntID;
   	uword uwStatus;
 
@@ -561,7 +790,7 @@ int amb_setup_CAN_hw(){
    		     	    	 * message into object 15, while NEWDAT was still set,
         	    	 	 * ie. the previously stored message is lost.
 					 	 */
-           			 	CAN_OBJ[14].MCR = 0xf7ff;    /* reset MSGLST */
+           			 	HAL_CAN_MCR_WRITE(14, 0xf7ff);    /* reset MSGLST */
 
 						/* 
 						 * Messages in this object are probably M&C data, so 
@@ -571,7 +800,7 @@ int amb_setup_CAN_hw(){
 						slave_node.num_errors++;
 
 						if (slave_node.last_slave_error != DUP_SLAVE_ADDR_E) {
-							amb_handle_transaction();
+							amb_accept_request(&CAN_OBJ[14]);
 						}
     	     		} else {
         	       		/* 
@@ -581,13 +810,19 @@ int amb_setup_CAN_hw(){
 						 * do something wih them.
 						 */
 						if (slave_node.last_slave_error != DUP_SLAVE_ADDR_E) {
-							amb_handle_transaction();
+							amb_accept_request(&CAN_OBJ[14]);
 						}
             		}
-           			CAN_OBJ[14].MCR = 0x7dfd;      /* release buffer */
+           			HAL_CAN_MCR_WRITE(14, 0x7dfd);      /* release buffer */
             		break;
 
 				case 3: /* Message Object 1 Interrupt */
+					if (rx_fifo.enabled && (CAN_OBJ[0].UAR != 0 || (CAN_OBJ[0].LAR & 0xf8ff) != 0)) {
+						/* Not the identify broadcast, let through by the wider
+						   global mask of the receive FIFO */
+						HAL_CAN_MCR_WRITE(0, 0xf5fd);  /* reset MSGLST, NEWDAT, INTPND */
+						break;
+					}
         		 	if ((CAN_OBJ[0].MCR & 0x0300) == 0x0200) {    /* if NEWDAT set */
              		 	if ((CAN_OBJ[0].MCR & 0x0c00) == 0x0800) { /* if MSGLST set */
                				/* 
@@ -596,7 +831,7 @@ int amb_setup_CAN_hw(){
                				 * ie. the previously stored message is lost. 
 							 */
 
-			               	CAN_OBJ[0].MCR = 0xf7ff;  /* reset MSGLST */
+			               	HAL_CAN_MCR_WRITE(0, 0xf7ff);  /* reset MSGLST */
 
 							/* We are responding to the identify broadcast */
 							slave_node.identify_mode = TRUE;
@@ -606,7 +841,7 @@ int amb_setup_CAN_hw(){
 
 					  		/* Send the serial number in message object 2 */
 							slave_node.num_transactions++;
-							CAN_OBJ[1].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+							HAL_CAN_MCR_WRITE(1, 0xe7ff);  /* set TXRQ,reset CPUUPD */
 
 							/* This is an error, because we missed a message */
 							slave_node.num_errors++;
@@ -624,30 +859,349 @@ int amb_setup_CAN_hw(){
 
 							/* Send the serial number */
 							slave_node.num_transactions++;
-							CAN_OBJ[1].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+							HAL_CAN_MCR_WRITE(1, 0xe7ff);  /* set TXRQ,reset CPUUPD */
 		                }
 					
-						CAN_OBJ[0].MCR = 0xfdfd;  /* reset NEWDAT, INTPND */
+						HAL_CAN_MCR_WRITE(0, 0xfdfd);  /* reset NEWDAT, INTPND */
          			}
 	            	break;
 	     		default:
+					if (uwIntID >= RX_FIFO_FIRST + 3 &&
+						uwIntID < RX_FIFO_FIRST + 3 + RX_FIFO_OBJECTS) { /* Receive FIFO objects */
+						amb_drain_rx_fifo();
+					}
     		        break;
 			}
 		}
 	}
 
+/*
+ ****************************************************************************
+ *  Handlers for the monitor and control points common to all slaves.
+ *  Monitor handlers fill current_msg, which is then transmitted by the
+ *  caller.
+ ****************************************************************************
+ */
+
+/* 0x30000: Slave protocol revision level */
+void amb_mon_protocol_rev(){
+	current_msg.len = 3;
+	current_msg.data[0] = (ubyte) (slave_node.revision_level[0]);
+	current_msg.data[1] = (ubyte) (slave_node.revision_level[1]);
+	current_msg.data[2] = (ubyte) (slave_node.revision_level[2]);
+}
+
+/* 0x30001: Number of errors and last error */
+void amb_mon_errors(){
+	current_msg.len = 4;
+	current_msg.data[0] = (ubyte) (slave_node.num_errors>>8);
+	current_msg.data[1] = (ubyte) (slave_node.num_errors);
+	current_msg.data[2] = 0x0;
+	/* LEC from CAN controller */
+	current_msg.data[3] = C1CSR >> 8;
+}
+
+/* 0x30002: Number of transactions */
+void amb_mon_transactions(){
+	current_msg.len = 4;
+	current_msg.data[0] = (ubyte) (slave_node.num_transactions>>24);
+	current_msg.data[1] = (ubyte) (slave_node.num_transactions>>16);
+	current_msg.data[2] = (ubyte) (slave_node.num_transactions>>8);
+	current_msg.data[3] = (ubyte) (slave_node.num_transactions);
+}
+
+/* 0x30004: Slave software revision level */
+void amb_mon_sw_rev(){
+	current_msg.len = 3;
+	current_msg.data[0] = (ubyte) (slave_node.sw_revision_level[0]);
+	current_msg.data[1] = (ubyte) (slave_node.sw_revision_level[1]);
+	current_msg.data[2] = (ubyte) (slave_node.sw_revision_level[2]);
+}
+
+/* 0x30005: Slave hardware revision level */
+void amb_mon_hw_rev(){
+	current_msg.len = 2;
+	current_msg.data[0] = (ubyte) (slave_node.hw_revision_level[0]);
+	current_msg.data[1] = (ubyte) (slave_node.hw_revision_level[1]);
+}
+
+/* 0x30006: Callback lookup cache hits and misses */
+void amb_mon_lookup_cache(){
+	current_msg.len = 8;
+	current_msg.data[0] = (ubyte) (lookup_cache.hits>>24);
+	current_msg.data[1] = (ubyte) (lookup_cache.hits>>16);
+	current_msg.data[2] = (ubyte) (lookup_cache.hits>>8);
+	current_msg.data[3] = (ubyte) (lookup_cache.hits);
+	current_msg.data[4] = (ubyte) (lookup_cache.misses>>24);
+	current_msg.data[5] = (ubyte) (lookup_cache.misses>>16);
+	current_msg.data[6] = (ubyte) (lookup_cache.misses>>8);
+	current_msg.data[7] = (ubyte) (lookup_cache.misses);
+}
+
+/* 0x30007: Deferred request ring depth, high water mark, size and overflows */
+void amb_mon_rx_ring(){
+	current_msg.len = 7;
+	current_msg.data[0] = (ubyte) (rx_ring.head - rx_ring.tail);
+	current_msg.data[1] = rx_ring.high_water;
+	current_msg.data[2] = RX_RING_SIZE;
+	current_msg.data[3] = (ubyte) (rx_ring.overflows>>24);
+	current_msg.data[4] = (ubyte) (rx_ring.overflows>>16);
+	current_msg.data[5] = (ubyte) (rx_ring.overflows>>8);
+	current_msg.data[6] = (ubyte) (rx_ring.overflows);
+}
+
+/* 0x30008: Receive FIFO requests taken, requests lost, most pending at once */
+void amb_mon_rx_fifo(){
+	current_msg.len = 8;
+	current_msg.data[0] = (ubyte) (rx_fifo.received>>24);
+	current_msg.data[1] = (ubyte) (rx_fifo.received>>16);
+	current_msg.data[2] = (ubyte) (rx_fifo.received>>8);
+	current_msg.data[3] = (ubyte) (rx_fifo.received);
+	current_msg.data[4] = (ubyte) (rx_fifo.lost>>8);
+	current_msg.data[5] = (ubyte) (rx_fifo.lost);
+	current_msg.data[6] = rx_fifo.max_pending;
+	current_msg.data[7] = rx_fifo.enabled ? RX_FIFO_OBJECTS : 0;
+}
+
+/* 0x30009: Monitor responses sent while the previous one was pending,
+   responses which had to replace a pending one and responses sent ahead
+   of a pending one */
+void amb_mon_tx_queue(){
+	current_msg.len = 7;
+	current_msg.data[0] = (ubyte) (tx_queue.busy>>8);
+	current_msg.data[1] = (ubyte) (tx_queue.busy);
+	current_msg.data[2] = (ubyte) (tx_queue.overruns>>8);
+	current_msg.data[3] = (ubyte) (tx_queue.overruns);
+	current_msg.data[4] = TX_OBJECTS;
+	current_msg.data[5] = (ubyte) (tx_queue.reordered>>8);
+	current_msg.data[6] = (ubyte) (tx_queue.reordered);
+}
+
+/* 0x31000: Device or software reset, 0x31001: Software reset */
+void amb_ctrl_reset(){
+	HAL_RESET();
+}
+
+/* Monitor handlers indexed by (RCA - AMB_BUILTIN_MONITOR_BASE).
+   Empty entries are left to the registered callbacks (0x30003 is the
+   ambient temperature served by the application). */
+static const builtin_func builtin_monitor[] = {
+	amb_mon_protocol_rev,	/* 0x30000 */
+	amb_mon_errors,			/* 0x30001 */
+	amb_mon_transactions,	/* 0x30002 */
+	0,						/* 0x30003 */
+	amb_mon_sw_rev,			/* 0x30004 */
+	amb_mon_hw_rev,			/* 0x30005 */
+	amb_mon_lookup_cache,	/* 0x30006 */
+	amb_mon_rx_ring,		/* 0x30007 */
+	amb_mon_rx_fifo,		/* 0x30008 */
+	amb_mon_tx_queue		/* 0x30009 */
+};
+#define NUM_BUILTIN_MONITORS	(sizeof(builtin_monitor) / sizeof(builtin_monitor[0]))
+
+/* Control handlers indexed by (RCA - AMB_BUILTIN_CONTROL_BASE) */
+static const builtin_func builtin_control[] = {
+	amb_ctrl_reset,			/* 0x31000 */
+	amb_ctrl_reset			/* 0x31001 */
+};
+#define NUM_BUILTIN_CONTROLS	(sizeof(builtin_control) / sizeof(builtin_control[0]))
+
+/* Routine to handle a received request now or queue it for amb_service */
+void amb_accept_request(struct can_obj volatile *frame){
+	ubyte slot;
+
+	if (!rx_ring.deferred) {
+		amb_handle_transaction(frame);
+		return;
+	}
+
+	/* Ring full: the request is lost */
+	if ((ubyte) (rx_ring.head - rx_ring.tail) >= RX_RING_SIZE) {
+		rx_ring.overflows++;
+		slave_node.num_errors++;
+		return;
+	}
+
+	slot = rx_ring.head & (RX_RING_SIZE - 1);
+	rx_ring.frame[slot].UAR = frame->UAR;
+	rx_ring.frame[slot].LAR = frame->LAR;
+	rx_ring.frame[slot].MCFG = frame->MCFG;
+	rx_ring.frame[slot].Data[0] = frame->Data[0];
+	rx_ring.frame[slot].Data[1] = frame->Data[1];
+	rx_ring.frame[slot].Data[2] = frame->Data[2];
+	rx_ring.frame[slot].Data[3] = frame->Data[3];
+	rx_ring.frame[slot].Data[4] = frame->Data[4];
+	rx_ring.frame[slot].Data[5] = frame->Data[5];
+	rx_ring.frame[slot].Data[6] = frame->Data[6];
+	rx_ring.frame[slot].Data[7] = frame->Data[7];
+
+	/* Publish the frame only once it is complete */
+	rx_ring.head++;
+
+	slot = rx_ring.head - rx_ring.tail;
+	if (slot > rx_ring.high_water)
+		rx_ring.high_water = slot;
+}
+
+/* Routine to handle the requests queued in deferred mode */
+int amb_service(void){
+	int handled;
+
+	for (handled = 0; rx_ring.tail != rx_ring.head; handled++) {
+		amb_handle_transaction(&rx_ring.frame[rx_ring.tail & (RX_RING_SIZE - 1)]);
+
+		/* Give the slot back to the ISR */
+		rx_ring.tail++;
+	}
+
+	return handled;
+}
+
+/* Select deferred processing of the requests */
+int amb_set_deferred(ubyte enable){
+	rx_ring.deferred = enable;
+
+	/* Always succeeds */
+	return 0;
+}
+
+/* Routine to take the requests out of the receive FIFO objects.  The 82527
+   does not record which object was written first, so the requests waiting
+   together are taken round robin starting after the last object served:
+   that is their arrival order only for a burst on ascending consecutive
+   RCAs.  Requests to different RCAs arriving during the same transaction
+   may be handled out of order; a request is never handled before one
+   which was already waiting when it arrived. */
+void amb_drain_rx_fifo(){
+	struct can_obj frame;
+	ubyte obj, i, first, pending, waiting;
+
+	do {
+		/* Which requests are waiting?  Only these are taken in this pass:
+		   a request coming in meanwhile waits for the next one, so it is
+		   never handled before a request which was already waiting */
+		pending = 0;
+		waiting = 0;
+		for (i = 0; i < RX_FIFO_OBJECTS; i++) {
+			if ((CAN_OBJ[RX_FIFO_FIRST + i].MCR & 0x0300) == 0x0200) { /* if NEWDAT set */
+				waiting |= 1 << i;
+				pending++;
+			}
+		}
+		if (pending > rx_fifo.max_pending)
+			rx_fifo.max_pending = pending;
+
+		first = rx_fifo.next;
+		for (i = 0; i < RX_FIFO_OBJECTS; i++) {
+			obj = (first + i) & (RX_FIFO_OBJECTS - 1);
+			if (!(waiting & (1 << obj)))
+				continue;
+
+			/* The next pass starts after this object */
+			rx_fifo.next = (obj + 1) & (RX_FIFO_OBJECTS - 1);
+			obj += RX_FIFO_FIRST;
+
+			if ((CAN_OBJ[obj].MCR & 0x0c00) == 0x0800) { /* if MSGLST set */
+				/* A second request to this object came before the first was taken */
+				rx_fifo.lost++;
+				slave_node.num_errors++;
+			}
+
+			/* Copy the request and free the object straight away, copying
+			   again if a new request was stored meanwhile */
+			do {
+				HAL_CAN_MCR_WRITE(obj, 0xf5fd);  /* reset MSGLST, NEWDAT, INTPND */
+				frame.UAR = CAN_OBJ[obj].UAR;
+				frame.LAR = CAN_OBJ[obj].LAR;
+				frame.MCFG = CAN_OBJ[obj].MCFG;
+				frame.Data[0] = CAN_OBJ[obj].Data[0];
+				frame.Data[1] = CAN_OBJ[obj].Data[1];
+				frame.Data[2] = CAN_OBJ[obj].Data[2];
+				frame.Data[3] = CAN_OBJ[obj].Data[3];
+				frame.Data[4] = CAN_OBJ[obj].Data[4];
+				frame.Data[5] = CAN_OBJ[obj].Data[5];
+				frame.Data[6] = CAN_OBJ[obj].Data[6];
+				frame.Data[7] = CAN_OBJ[obj].Data[7];
+			} while ((CAN_OBJ[obj].MCR & 0x0300) == 0x0200);
+
+			rx_fifo.received++;
+			if (slave_node.last_slave_error != DUP_SLAVE_ADDR_E) {
+				amb_accept_request(&frame);
+			}
+		}
+	/* Requests may have come in while the others were handled */
+	} while (pending);
+}
+
+/* Enable or disable the receive FIFO in message objects 4 to 11 */
+int amb_set_rx_fifo(ubyte enable){
+	ulong LAR, UAR;
+	ubyte i;
+	bit int_enabled;
+
+	/* Arbitration registers for the base address of this slave */
+	LAR = 0x00000000;
+	LAR += (slave_node.base_address & 0x0000001f) << 11;  /* ID  4.. 0 */
+	LAR += (slave_node.base_address & 0x00001fe0) >>  5;  /* ID 12.. 5 */
+	UAR = 0x00000000;
+	UAR += (slave_node.base_address & 0x001fe000) >>  5;  /* ID 13..20 */
+	UAR += (slave_node.base_address & 0x1fe00000) >> 21;  /* ID 21..28 */
+
+	HAL_CAN_INT_DISABLE(int_enabled);
+
+	for (i = 0; i < RX_FIFO_OBJECTS; i++) {
+		HAL_CAN_MCR_WRITE(RX_FIFO_FIRST + i, 0x5555);  /* reset MSGVAL while changing it */
+		if (enable) {
+			/* 
+			 * message direction is receive
+			 * extended 29-bit identifier
+			 */
+			CAN_OBJ[RX_FIFO_FIRST + i].MCFG = 0x04;
+			CAN_OBJ[RX_FIFO_FIRST + i].UAR = UAR;
+			CAN_OBJ[RX_FIFO_FIRST + i].LAR = LAR + (i << 11);  /* ID 2..0 select the object */
+			HAL_CAN_MCR_WRITE(RX_FIFO_FIRST + i, 0x5599);  /* valid, enable receive interrupt */
+		}
+	}
+
+	if (enable) {
+		/* Compare the upper 11 bits, as object 15 does, and bits 2..0 */
+		C1UGML = 0xE0FF;  /* set Upper Global Mask Long Register */
+		C1LGML = 0x3800;  /* set Lower Global Mask Long Register */
+	} else {
+		C1UGML = 0xFFFF;  /* set Upper Global Mask Long Register */
+		C1LGML = 0xF8FF;  /* set Lower Global Mask Long Register */
+	}
+
+	rx_fifo.enabled = enable;
+	rx_fifo.next = 0;
+
+	HAL_CAN_INT_RESTORE(int_enabled);
+
+	/* Always succeeds */
+	return 0;
+}
+
 /* Routine to check if a callback should be run */
 
-void amb_handle_transaction(){
+void amb_handle_transaction(struct can_obj volatile *frame){
 	ulong incoming_ID;
+	ulong index;
 	ubyte i;
-	/* Get incoming ID from Object 15 */
+	bit int_enabled;
+	CALLBACK_STRUCT *cb;
+	uword start, elapsed;
+	ubyte stats_index;
+	int ret;
+
+	start = HAL_TIMER_READ();
+
+	/* Get incoming ID from the received frame */
 	incoming_ID = 0x0;
   
-	    incoming_ID += ((ulong) (CAN_OBJ[14].LAR & 0xf800)) >> 11;  /* ID  4.. 0 */
-   		incoming_ID += ((ulong) (CAN_OBJ[14].LAR & 0x00ff)) <<  5;  /* ID 12.. 5 */
-   		incoming_ID += ((ulong) (CAN_OBJ[14].UAR & 0xff00)) <<  5;  /* ID 13..20 */
-  		incoming_ID += ((ulong) (CAN_OBJ[14].UAR & 0x00ff)) << 21;  /* ID 21..28 */
+	    incoming_ID += ((ulong) (frame->LAR & 0xf800)) >> 11;  /* ID  4.. 0 */
+   		incoming_ID += ((ulong) (frame->LAR & 0x00ff)) <<  5;  /* ID 12.. 5 */
+   		incoming_ID += ((ulong) (frame->UAR & 0xff00)) <<  5;  /* ID 13..20 */
+  		incoming_ID += ((ulong) (frame->UAR & 0x00ff)) << 21;  /* ID 21..28 */
 
 	/* Calculate relative address from base address */
 	current_msg.relative_address = incoming_ID - slave_node.base_address;
@@ -658,147 +1212,263 @@ void amb_handle_transaction(){
  
 	/* Get the message length */
 
-		current_msg.len = (CAN_OBJ[14].MCFG & 0xf0) >> 4;
+		current_msg.len = (frame->MCFG & 0xf0) >> 4;
 	/* This is a monitor request if data length is zero */
 	if (current_msg.len != 0) {
 		current_msg.dirn = CAN_CONTROL;
 		/* Control message: get the data */
 		for (i=0; i<current_msg.len; i++)
-				current_msg.data[i] = CAN_OBJ[14].Data[i];
-		switch (current_msg.relative_address) {	
-			case 0x31000: /*Device or software reset */
-				_trap_ (0x00);
-				return;
-				break;
-			case 0x31001: /* Software reset */
-				_trap_ (0x00);
-				return;
-				break;
+				current_msg.data[i] = frame->Data[i];
+		/* Check for common control points */
+		index = current_msg.relative_address - AMB_BUILTIN_CONTROL_BASE;
+		if (index < NUM_BUILTIN_CONTROLS && builtin_control[index] != 0) {
+			(builtin_control[index])();
+			return;
 		}
 	} else {
-			current_msg.dirn = CAN_MONITOR;
-			/* Check for common monitor points */
-		switch (current_msg.relative_address ) {
-
- 			case 0x000: /* Slave hardware revision level */
-				/* In order to avoid confusion between the interrupts I use message 
-				   number 2 to respond to this request.
-				   Added JSK 10/06/2005 */
-				/* We are responding to the identify broadcast */
-				slave_node.identify_mode = TRUE;
-
-				/* Turn status interrupts on */
-				C1CSR = 0x000E;
-
-				/* Send the serial number */
-				slave_node.num_transactions++;
-				CAN_OBJ[1].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
-				return;
-				break;
-
-			case 0x30000: /* Slave protocol revision level */
-				current_msg.len = 3;
-				current_msg.data[0] = (ubyte) (slave_node.revision_level[0]);
-				current_msg.data[1] = (ubyte) (slave_node.revision_level[1]);
-				current_msg.data[2] = (ubyte) (slave_node.revision_level[2]);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-			case 0x30001: /* Number of errors and last error */
-				current_msg.len = 4;
-				current_msg.data[0] = (ubyte) (slave_node.num_errors>>8);
-				current_msg.data[1] = (ubyte) (slave_node.num_errors);
-				current_msg.data[2] = 0x0;
-			 	/* LEC from CAN controller */
- 				current_msg.data[3] = C1CSR >> 8;
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-			case 0x30002: /* Number of transactions */
-				current_msg.len = 4;
-				current_msg.data[0] = (ubyte) (slave_node.num_transactions>>24);
-				current_msg.data[1] = (ubyte) (slave_node.num_transactions>>16);
-				current_msg.data[2] = (ubyte) (slave_node.num_transactions>>8);
-				current_msg.data[3] = (ubyte) (slave_node.num_transactions);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-			case 0x30004: /* Slave software revision level */
-				current_msg.len = 3;
-				current_msg.data[0] = (ubyte) (slave_node.sw_revision_level[0]);
-				current_msg.data[1] = (ubyte) (slave_node.sw_revision_level[1]);
-				current_msg.data[2] = (ubyte) (slave_node.sw_revision_level[2]);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-			case 0x30005: /* Slave hardware revision level */
-				current_msg.len = 2;
-				current_msg.data[0] = (ubyte) (slave_node.hw_revision_level[0]);
-				current_msg.data[1] = (ubyte) (slave_node.hw_revision_level[1]);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-		}
-	}
+		current_msg.dirn = CAN_MONITOR;
+
+		if (current_msg.relative_address == 0x000) { /* Slave hardware revision level */
+			/* In order to avoid confusion between the interrupts I use message 
+			   number 2 to respond to this request.
+			   Added JSK 10/06/2005 */
+			/* The CAN ISR also uses these when not running this routine */
+			HAL_CAN_INT_DISABLE(int_enabled);
+
+			/* We are responding to the identify broadcast */
+			slave_node.identify_mode = TRUE;
 
-	/* For each registered callback, see if this message was in range */
-	for (i=0; i<slave_node.num_cbs; i++) {
-		if ((current_msg.relative_address >= slave_node.cb_ops[i].low_address) &&
-			(current_msg.relative_address <= slave_node.cb_ops[i].high_address)) {
+			/* Turn status interrupts on */
+			C1CSR = 0x000E;
 
-			/* Increment the transaction counter */
+			/* Send the serial number */
 			slave_node.num_transactions++;
-			(slave_node.cb_ops[i].cb_func)(&current_msg);
+			HAL_CAN_MCR_WRITE(1, 0xe7ff);  /* set TXRQ,reset CPUUPD */
 
-			if (current_msg.dirn == CAN_MONITOR)
-				amb_transmit_monitor();
+			HAL_CAN_INT_RESTORE(int_enabled);
+			return;
+		}
 
+		/* Check for common monitor points */
+		index = current_msg.relative_address - AMB_BUILTIN_MONITOR_BASE;
+		if (index < NUM_BUILTIN_MONITORS && builtin_monitor[index] != 0) {
+			(builtin_monitor[index])();
+			amb_transmit_monitor(&current_msg);
+			slave_node.num_transactions++;
 			return;
-		}	
+		}
+	}
+
+	/* Look up the callback owning this relative address */
+	cb = amb_lookup_callback(current_msg.relative_address);
+	if (cb == 0)
+		return;
+
+	/* Increment the transaction counter */
+	slave_node.num_transactions++;
+	/* The callback may change the table under cb */
+	stats_index = cb->stats_index;
+	ret = (cb->cb_func)(&current_msg);
+
+	if (current_msg.dirn == CAN_MONITOR)
+		amb_transmit_monitor(&current_msg);
+
+	/* Account for the time spent by the registration owning the RCA */
+	if (stats_index != AMB_NO_STATS) {
+		elapsed = (HAL_TIMER_READ() - start) >> AMB_STATS_SHIFT;
+		for (i = 0; elapsed && i < AMB_STATS_BUCKETS - 1; i++)
+			elapsed >>= 1;
+		range_stats[stats_index].histogram[i]++;
+		range_stats[stats_index].hits++;
+		if (ret != 0)
+			range_stats[stats_index].errors++;
 	}
 }
 
-/* Routine to send monitor data back to master using CAN object 3 */
-void amb_transmit_monitor(){
-  	ubyte i;
+/* Select whether the next registrations get counters */
+int amb_set_range_counters(ubyte enable){
+	slave_node.stats_enabled = enable;
+
+/* Always succeeds */
+	return 0;
+}
+
+/* Copy the counters of one registration */
+int amb_get_range_stats(ubyte range, AMB_RANGE_STATS *stats){
+	bit int_enabled;
+	ubyte num_ranges;
+
+	num_ranges = slave_node.num_stats;
+	if (range >= num_ranges)
+		return -1;
+
+	/* The CAN ISR updates them */
+	HAL_CAN_INT_DISABLE(int_enabled);
+	*stats = range_stats[range];
+	HAL_CAN_INT_RESTORE(int_enabled);
+
+	return num_ranges;
+}
+
+/* Callback of a monitor request, 0 for the common points and the RCAs of no callback */
+read_or_write_func amb_get_function(ulong relative_address){
+	bit int_enabled;
+	ulong index;
+	CALLBACK_STRUCT *cb;
+	read_or_write_func func;
+
+	/* Answered by the library */
+	index = relative_address - AMB_BUILTIN_MONITOR_BASE;
+	if (relative_address == 0x000 || (index < NUM_BUILTIN_MONITORS && builtin_monitor[index] != 0))
+		return 0;
+
+	/* The CAN ISR may register callbacks */
+	HAL_CAN_INT_DISABLE(int_enabled);
+	cb = amb_find_callback(relative_address);
+	func = (cb != 0) ? cb->cb_func : 0;
+	HAL_CAN_INT_RESTORE(int_enabled);
+
+	return func;
+}
+
+/* Try the last matched callbacks first, then search the table */
+CALLBACK_STRUCT *amb_lookup_callback(ulong relative_address){
+	ubyte i;
+	CALLBACK_STRUCT *cb;
+
+	for (i = 0; i < LOOKUP_CACHE_SIZE; i++) {
+		if (lookup_cache.entry[i].cb_func != 0 &&
+			relative_address >= lookup_cache.entry[i].low_address &&
+			relative_address <= lookup_cache.entry[i].high_address) {
+			lookup_cache.hits++;
+			/* The other entry is now the least recently used */
+			lookup_cache.victim = i ^ 1;
+			return &lookup_cache.entry[i];
+		}
+	}
+
+	lookup_cache.misses++;
+	cb = amb_find_callback(relative_address);
+	if (cb == 0)
+		return 0;
+
+	/* Replace the least recently used entry */
+	i = lookup_cache.victim;
+	lookup_cache.entry[i] = *cb;
+	lookup_cache.victim = i ^ 1;
+	return &lookup_cache.entry[i];
+}
+
+/* Forget the cached callbacks.  Must be called whenever the table changes */
+void amb_flush_lookup_cache(){
+	ubyte i;
+
+	for (i = 0; i < LOOKUP_CACHE_SIZE; i++)
+		lookup_cache.entry[i].cb_func = 0;
+	lookup_cache.victim = 0;
+}
+
+/* Binary search of the sorted callback table. Returns 0 if nobody owns the address */
+CALLBACK_STRUCT *amb_find_callback(ulong relative_address){
+	ubyte lo, hi, mid;
+
+	lo = 0;
+	hi = slave_node.num_cbs;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (relative_address < slave_node.cb_ops[mid].low_address)
+			hi = mid;
+		else if (relative_address > slave_node.cb_ops[mid].high_address)
+			lo = mid + 1;
+		else
+			return &slave_node.cb_ops[mid];
+	}
+	return 0;
+}
+
+/* Routine to send a monitor response outside of the callback answering the
+   request.  Unlike amb_transmit_monitor it waits for the last object to be
+   free, so the response is sent after the pending ones rather than
+   overtake or replace one of them. */
+int amb_send_monitor(CAN_MSG_TYPE *message){
+	bit int_enabled;
+	uword start;
+
+	start = HAL_TIMER_READ();
+	while (TX_PENDING(TX_OBJECTS - 1) && (uword) (HAL_TIMER_READ() - start) < SEND_TIMEOUT_TICKS)
+		;
+
+	if (TX_PENDING(TX_OBJECTS - 1))
+		return -1;
+
+	/* The CAN ISR also uses the objects */
+	HAL_CAN_INT_DISABLE(int_enabled);
+	amb_transmit_monitor(message);
+	HAL_CAN_INT_RESTORE(int_enabled);
+
+	return 0;
+}
+
+/* Routine to send monitor data back to master using CAN objects 3, 13 and 14 */
+void amb_transmit_monitor(CAN_MSG_TYPE *msg){
+  	ubyte i, n, obj;
   	ulong TX_ID;
 		ulong v;
-  		CAN_OBJ[2].MCR = 0xfb7f;     /* set CPUUPD, reset MSGVAL */
+
+	/* The object after the last pending one, sent after all of them */
+	for (n = TX_OBJECTS; n > 0 && !TX_PENDING(n - 1); n--)
+		;
+	if (n > 0)
+		tx_queue.busy++;
+	if (n == TX_OBJECTS) {
+		/* Any free one, sent ahead of the pending ones after it */
+		for (n = 0; n < TX_OBJECTS && TX_PENDING(n); n++)
+			;
+		if (n < TX_OBJECTS) {
+			tx_queue.reordered++;
+		} else {
+			/* All of them are waiting, replace the oldest one */
+			n = 0;
+			for (i = 1; i < TX_OBJECTS; i++)
+				if ((ubyte) (tx_queue.seq - tx_queue.order[i]) > (ubyte) (tx_queue.seq - tx_queue.order[n]))
+					n = i;
+			tx_queue.overruns++;
+		}
+	}
+	tx_queue.order[n] = tx_queue.seq++;
+	obj = tx_objects[n];
+
+  		HAL_CAN_MCR_WRITE(obj, 0xfb7f);     /* set CPUUPD, reset MSGVAL */
 
 	/* Recalculate CAN message from relative address */
-	TX_ID = slave_node.base_address + current_msg.relative_address;
+	TX_ID = slave_node.base_address + msg->relative_address;
 
 	/* Calculate the arbitration registers */
 
    		v = 0x00000000;
    		v += (TX_ID & 0x0000001f) << 11;  /* ID  4.. 0 */
    		v += (TX_ID & 0x00001fe0) >>  5;  /* ID 12.. 5 */
-   		CAN_OBJ[2].LAR  = v;
+   		CAN_OBJ[obj].LAR  = v;
 
 	   	v = 0x00000000;
    		v += (TX_ID & 0x001fe000) >>  5;  /* ID 13..20 */
    		v += (TX_ID & 0x1fe00000) >> 21;  /* ID 21..28 */
-   		CAN_OBJ[2].UAR  = v;
+   		CAN_OBJ[obj].UAR  = v;
 
 
 	/* set transmit direction and length */
 
-   		CAN_OBJ[2].MCFG = 0x0c | (current_msg.len << 4);
+   		CAN_OBJ[obj].MCFG = 0x0c | (msg->len << 4);
 
-	/* Copy data to CAN object 3 */
-   	for(i = 0; i < current_msg.len; i++) {
+	/* Copy data to the CAN object */
+   	for(i = 0; i < msg->len; i++) {
 
-      		CAN_OBJ[2].Data[i] = current_msg.data[i];
+      		CAN_OBJ[obj].Data[i] = msg->data[i];
 	}
-  		CAN_OBJ[2].MCR  = 0xf6bf;  /* set NEWDAT, reset CPUUPD, set MSGVAL */
+  		HAL_CAN_MCR_WRITE(obj, 0xf6bf);  /* set NEWDAT, reset CPUUPD, set MSGVAL */
 	
 		/* Transmit the object */
-  		CAN_OBJ[2].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+  		HAL_CAN_MCR_WRITE(obj, 0xe7ff);  /* set TXRQ,reset CPUUPD */
 }
 
 
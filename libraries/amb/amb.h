@@ -39,6 +39,12 @@
 		#define uword unsigned int
 		#define ubyte unsigned char
 
+	#elif HOST_ARCH
+
+		#define ulong unsigned int
+		#define uword unsigned short
+		#define ubyte unsigned char
+
 	#endif /* ARCHITECTURE SWITCH */
 
 	#ifndef TRUE
@@ -54,6 +60,16 @@
 	#define NO_SN_E				0x03	/* No serial number read */
 	#define ONEWIRE_CRC_E		0x04	/* CRC error on a 1-Wire bus transaction */
 
+	/* First relative addresses of the points served by the library */
+	#define AMB_BUILTIN_MONITOR_BASE	0x30000
+	#define AMB_BUILTIN_CONTROL_BASE	0x31000
+
+	/* Monitor points served by the library besides the standard ones */
+	#define AMB_GET_LOOKUP_CACHE_RCA	0x30006	/* Callback lookup cache hits and misses */
+	#define AMB_GET_RX_RING_RCA			0x30007	/* Deferred request ring depth and high water mark */
+	#define AMB_GET_RX_FIFO_RCA			0x30008	/* Receive FIFO requests taken and lost */
+	#define AMB_GET_TX_QUEUE_RCA		0x30009	/* Monitor responses queued behind, replacing or overtaking a pending one */
+
 	/* An enum for CAN message direction */
 	typedef enum {	CAN_MONITOR,
 					CAN_CONTROL
@@ -75,8 +91,28 @@
 		ulong				low_address;	/* First RA in range */
 		ulong				high_address;	/* Last RA in range */
 		read_or_write_func	cb_func;		/* Function to call when message in range */
+		ubyte				reg_index;		/* Registration this entry belongs to */
+		ubyte				stats_index;	/* Counters of that registration, AMB_NO_STATS for none */
 	} CALLBACK_STRUCT;
 
+	/* Instrumentation of the registered ranges */
+	#define AMB_STATS_RANGES	16	/* Registrations with their own counters */
+	#define AMB_STATS_BUCKETS	8	/* Bins of the latency histogram */
+	#define AMB_STATS_SHIFT		3	/* Bin 0 holds latencies below 1 << AMB_STATS_SHIFT timer ticks */
+	#define AMB_NO_STATS		0xFF	/* stats_index of a registration without counters */
+
+	/* Counters of one registration.  Bin n of the histogram holds the
+	   transactions which took less than 1 << (n + AMB_STATS_SHIFT) ticks of
+	   HAL_TIMER_READ, and more than half that; the last bin also holds all
+	   the longer ones. */
+	typedef struct {
+		ulong				low_address;	/* Range given to amb_register_function */
+		ulong				high_address;
+		ulong				hits;			/* Requests handled by the callback */
+		uword				errors;			/* Callback returned non zero */
+		uword				histogram[AMB_STATS_BUCKETS];
+	} AMB_RANGE_STATS;
+
 	/*
 	 ***************************************************************************
 	  Prototypes of global functions
@@ -87,10 +123,11 @@
 	 * Initialise slave node.  This routine must be called.  It reads the node
 	 * address and serial number and configures the CAN interface.  The user should
 	 * enable interrupts AFTER calling this routine.  The void * parameter should
-	 * contain the starting address of an array of CALLBACK_STRUCT.  This array
-	 * should contain enough elements for all of the functions to be registered.
+	 * contain the starting address of an array of CALLBACK_STRUCT and
+	 * cb_ops_size its number of elements.  amb_register_function fails once
+	 * the array is full.
 	 */
-	extern int amb_init_slave(void *cb_ops_memory);
+	extern int amb_init_slave(void *cb_ops_memory, ubyte cb_ops_size);
 
 	/**
 	 * Register a callback function to be called when a CAN message with a 
@@ -98,12 +135,19 @@
 	 * The callback is passed a pointer to a CAN_MSG_TYPE structure
 	 * Note that if the message is a monitor message, the called function
 	 * should set the message data length and data bytes before returning 
+	 * The callbacks are kept in a table sorted by address so that they can be
+	 * found with a binary search.  If the range overlaps ranges registered
+	 * earlier, only the uncovered parts are added (earlier registrations keep
+	 * precedence) and each part takes one element of the callback memory.
+	 * Returns -1 if low_address > high_address, or if the parts do not fit
+	 * in the callback memory, in which case nothing is registered.
 	 */
 	extern int amb_register_function(ulong low_address, ulong high_address, read_or_write_func func);
 
 	/**
 	 * Unregister last registered function if any. This allows to roll back
      * in case of error during the registration of the callback functions.
+     * All the table elements created by that registration are removed.
      */
 	extern int amb_unregister_last_function(void);
 
@@ -113,6 +157,66 @@
 	 */
 	extern int amb_start();
 
+	/**
+	 * Select deferred processing of the M&C requests.  When enabled, the CAN
+	 * interrupt only copies each request into a ring and amb_service, called
+	 * from the main loop, runs the callbacks.  Call before amb_start.
+	 */
+	extern int amb_set_deferred(ubyte enable);
+
+	/**
+	 * Enable the receive FIFO in the spare message objects 4 to 11.  Each
+	 * object takes the requests whose RCA bits 2..0 match its position, so
+	 * back to back requests on consecutive RCAs are not overwritten in
+	 * object 15.  The 82527 keeps no arrival order between objects: the
+	 * requests waiting together are drained round robin, which is their
+	 * arrival order for a burst on ascending RCAs only.  Requests to
+	 * different RCAs received during one transaction may be handled out of
+	 * order, so a master needing two control requests applied in order must
+	 * wait for the first to be handled.  A request never overtakes one which
+	 * was already waiting when it came in.  Call after amb_init_slave and
+	 * before amb_start.
+	 */
+	extern int amb_set_rx_fifo(ubyte enable);
+
+	/**
+	 * Select whether the registrations which follow get counters, as they do
+	 * by default.  Only AMB_STATS_RANGES registrations can have them, so an
+	 * application can leave out the points which only read back its own
+	 * state and keep the counters for the ranges carrying the traffic.
+	 */
+	extern int amb_set_range_counters(ubyte enable);
+
+	/**
+	 * Copy the counters of the registration number range, counting only the
+	 * registrations with counters (0 for the first one).  Returns the number
+	 * of registrations with counters, or -1 if range is not one of them.
+	 */
+	extern int amb_get_range_stats(ubyte range, AMB_RANGE_STATS *stats);
+
+	/**
+	 * Return the callback a monitor request to relative_address is passed
+	 * to, or 0 if the library answers it itself or no callback owns it.  An
+	 * application can check with it that a point read on its own behalf is
+	 * one of the points forwarded by a given callback.
+	 */
+	extern read_or_write_func amb_get_function(ulong relative_address);
+
+	/**
+	 * Send message as the monitor response of its relative address, outside
+	 * of the callback answering a request: for instance one more of several
+	 * points read at once.  Waits about 1 ms for the last transmit object to
+	 * be free, so the response is sent after the pending ones.  Returns -1
+	 * if it was not, and nothing is sent.
+	 */
+	extern int amb_send_monitor(CAN_MSG_TYPE *message);
+
+	/**
+	 * Run the requests queued by the CAN interrupt in deferred mode.
+	 * Returns the number of requests handled.
+	 */
+	extern int amb_service(void);
+
 	/**
 	 * Utility functions for accessing internal counters and information 
 	 */
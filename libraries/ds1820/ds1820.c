@@ -30,6 +30,15 @@
 /* Global */
 static ubyte ds1820Running=0;
 
+/* Called while waiting for the temperature conversion */
+static void (*ds1820Idle)(void)=0;
+
+/* Register a function to be called while waiting for the temperature conversion */
+void ds1820_set_idle(void (*idle)(void))
+{
+	ds1820Idle = idle;
+}
+
 /* Reset one wire bus and test for presence pulse */
 ubyte Reset_1W(void)
 {
@@ -296,7 +305,10 @@ short ds1820_get_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_
 	/* Wait for conversion to complete (signalled by all 1s) */
 	wait_count = 0;
 	while ((Read_1W() != 0xff) &&     /* Avoid lockup by quitting after 1000 */
-			 (wait_count++ < 1000)) ;   /* byte reads (~600 ms) */
+			 (wait_count++ < 1000)) {   /* byte reads (~600 ms) */
+		if (ds1820Idle)               /* Let the caller use the time between reads */
+			ds1820Idle();
+	}
 
 	if (wait_count > 999){ /* Error: wait for temperature conversion timed out */
 		ds1820Running = 0; // Function is done and can be called again
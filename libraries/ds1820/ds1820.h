@@ -27,8 +27,13 @@
  ****************************************************************************
  */
 
+#ifdef HOST_ARCH
+#define ulong unsigned int
+#define uword unsigned short
+#else
 #define ulong unsigned long
 #define uword unsigned int
+#endif
 #define ubyte unsigned char
 
 /**
@@ -39,6 +44,12 @@ short ds1820_init(void);
 short ds1820_get_sn(ubyte sn[8]);
 short ds1820_get_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C);
 
+/**
+ * The temperature conversion takes about 600 ms.  A function registered here
+ * is called between the 1-Wire reads while waiting for it.
+ */
+void  ds1820_set_idle(void (*idle)(void));
+
 /**
  * Generic 1 Wire primitive functions 
  */
@@ -0,0 +1,41 @@
+/*
+ ****************************************************************************
+ *  HAL.H
+ *
+ *  Hardware abstraction layer for the AMBSI1 firmware.  The amb library and
+ *  the CAN <-> ARCOM bridge in main.c reach the hardware only through the
+ *  definitions in this file and in the selected back end:
+ *
+ *    - C167_ARCH: the C167CR registers, built with Keil C166.
+ *    - HOST_ARCH: an emulated 82527 message object file and an emulated
+ *                 ARCOM parallel port, built with a host C compiler so the
+ *                 whole bridge can be run and profiled on a workstation.
+ *
+ *****************************************************************************
+ */
+
+#ifndef HAL_H
+	#define HAL_H
+
+	#include "../amb/amb.h"
+
+	/*
+	 * Structure for a single 82527 CAN object
+	 * A total of 15 such object structures exists
+	 */
+	struct can_obj {
+	  uword  MCR;       /* Message Control Register */
+	  uword  UAR;       /* Upper Arbitration Register */
+	  uword  LAR;       /* Lower Arbitration Register */
+	  ubyte  MCFG;      /* Message Configuration Register */
+	  ubyte  Data[8];   /* Message Data 0 .. 7 */
+	  ubyte  Customer;  /* Reserved for application specific data */
+	} ;
+
+	#ifdef HOST_ARCH
+		#include "hal_host.h"
+	#else
+		#include "hal_c167.h"
+	#endif /* BACK END SWITCH */
+
+#endif /* HAL_H */
@@ -0,0 +1,125 @@
+/*
+ ****************************************************************************
+ *  HAL_C167.H
+ *
+ *  C167CR back end of the hardware abstraction layer.  Everything in here
+ *  maps directly onto the registers and port pins of the AMBSI1.
+ *
+ *****************************************************************************
+ */
+
+#ifndef HAL_C167_H
+	#define HAL_C167_H
+
+	/* Include C167 register definitions */
+	#include <reg167.h>
+	#include <intrins.h>
+
+	/* Interrupt function qualifiers, the second one switching to a register
+	   bank of its own instead of saving the registers */
+	#define HAL_INTERRUPT(VECTOR)	interrupt VECTOR
+	#define HAL_INTERRUPT_BANK(VECTOR, BANK)	interrupt VECTOR using BANK
+
+	/* Reset the micro */
+	#define HAL_RESET()				_trap_ (0x00)
+
+	/* Read the slave address */
+	#ifdef AMBSI  /* Standard i/f, DIP switch on Port 3.1 to 3.6 */
+		#define HAL_NODE_ADDRESS()	((P3 & 0x7e) >> 1)
+	#endif /* AMBSI */
+
+	#ifdef SK167  /* Starter Kit test board, DIP switch on Port 7.1 to 7.6 */
+		#define HAL_NODE_ADDRESS()	((P7 & 0x7e) >> 1)
+	#endif /* SK167 */
+
+	/*
+	 ****************************************************************************
+	 * CAN controller (Siemens C167CR on-chip 82527)
+	 ****************************************************************************
+	 */
+
+	/* Locations of CAN controller registers */
+	#define C1CSR   (*((uword volatile sdata *) 0xEF00)) /* Control/Status Register */
+	#define C1IR    (*((uword volatile sdata *) 0xEF02)) /* Interrupt Register */
+	#define C1BTR   (*((uword volatile sdata *) 0xEF04)) /* Bit Timing Register */
+	#define C1GMS   (*((uword volatile sdata *) 0xEF06)) /* Global Mask Short */
+	#define C1UGML  (*((uword volatile sdata *) 0xEF08)) /* Upper Global Mask Long */
+	#define C1LGML  (*((uword volatile sdata *) 0xEF0A)) /* Lower Global Mask Long */
+	#define C1UMLM  (*((uword volatile sdata *) 0xEF0C)) /* Upper Mask of Last Message */
+	#define C1LMLM  (*((uword volatile sdata *) 0xEF0E)) /* Lower Mask of Last Message */
+
+	/* Location of first CAN object */
+	#define CAN_OBJ ((struct can_obj volatile sdata *) 0xEF10)
+
+	/* Write the Message Control Register of a CAN object */
+	#define HAL_CAN_MCR_WRITE(OBJ, VALUE)	CAN_OBJ[OBJ].MCR = (VALUE)
+
+	/* Keep the CAN ISR out while shared data is being modified.  Macros of
+	   more than one statement are wrapped in do { } while (0) so that they
+	   stay whole under an unbraced if or else. */
+	#define HAL_CAN_INT_DISABLE(SAVE)		do { SAVE = XP0IE; XP0IE = 0; } while (0)
+	#define HAL_CAN_INT_RESTORE(SAVE)		XP0IE = SAVE
+
+	/*
+	 ****************************************************************************
+	 * Free running timer
+	 ****************************************************************************
+	 */
+
+	/* T6 of GPT2 counts up at fCPU/8, 400 ns per tick with the 20 MHz clock,
+	   and wraps every 26.2 ms.  GPT1 is left to the ds1820 library. */
+	#define HAL_TIMER_NS_PER_TICK	400
+	#define HAL_TIMER_INIT()		do { T6CON = 0x0001; T6 = 0x0000; T6CON = 0x0041; HAL_SLOW_TIMER_INIT(); } while (0)
+	#define HAL_TIMER_READ()		((uword) T6)
+
+	/* T5 of GPT2 counts up at fCPU/512, 25.6 us per tick, and wraps every
+	   1.68 s, for intervals too long for T6 */
+	#define HAL_SLOW_TIMER_NS_PER_TICK	25600L
+	#define HAL_SLOW_TIMER_INIT()	do { T5CON = 0x0007; T5 = 0x0000; T5CON = 0x0047; } while (0)
+	#define HAL_SLOW_TIMER_READ()	((uword) T5)
+
+	/*
+	 ****************************************************************************
+	 * ARCOM parallel port
+	 ****************************************************************************
+	 */
+
+	/* External bus control signal buffer chip enable is on P4.7 */
+	sbit  DISABLE_EX_BUF	= P4^7;
+
+	/* Arcom Parallel port connection lines */
+	sbit  WRITE				= P2^2;
+	sbit  DSTROBE			= P2^3;
+	sbit  WAIT				= P2^8;
+	sbit  INT				= P2^7;
+	sbit  SELECT			= P2^10;
+	sbit  INIT				= P2^5;
+
+	/* Make sure that external bus control signal buffer is disabled */
+	#define HAL_DISABLE_EX_BUF()	do { DP4 |= 0x01; DISABLE_EX_BUF = 1; } while (0)
+
+	/* Initialize ports for communication */
+	#define HAL_ARCOM_PORT_INIT()	do { DP7 = 0x00; DP7 = 0xFF; P2 = 0x0000; SELECT = 1; INIT = 0; DP2 = 0x0580; } while (0)
+
+	/* Data lines on P7 */
+	#define HAL_ARCOM_WRITE(DATA)	P7 = (DATA)
+	#define HAL_ARCOM_READ()		((ubyte) P7)
+	#define HAL_ARCOM_DIR_IN()		DP7 = 0x00
+	#define HAL_ARCOM_DIR_OUT()		DP7 = 0xFF
+
+	/* Control lines on P2 */
+	#define HAL_ARCOM_DSTROBE()		DSTROBE
+	#define HAL_ARCOM_INIT()		INIT
+	#define HAL_ARCOM_WAIT(LEVEL)	WAIT = (LEVEL)
+	#define HAL_ARCOM_INT(LEVEL)	INT = (LEVEL)
+	#define HAL_ARCOM_SELECT(LEVEL)	SELECT = (LEVEL)
+
+	/* DSTROBE is also the CAPCOM1 input CC3IO: a capture on its falling edge
+	   raises CC3INT, the strobe interrupt (ILVL=15, GLVL=0, above the CAN) */
+	#define HAL_ARCOM_STROBE_VECTOR		0x13
+	#define HAL_ARCOM_STROBE_INT_INIT(ISR)	do { CCM0 = (CCM0 & 0x0FFF) | 0x2000; CC3IC = 0x003C; } while (0)
+	#define HAL_ARCOM_STROBE_INT_CLEAR()	CC3IR = 0
+	#define HAL_ARCOM_STROBE_INT_ENABLE()	CC3IE = 1
+	#define HAL_ARCOM_STROBE_INT_DISABLE()	CC3IE = 0
+
+#endif /* HAL_C167_H */
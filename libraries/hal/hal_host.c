@@ -0,0 +1,352 @@
+/*
+ ****************************************************************************
+ *  HAL_HOST.C
+ *
+ *  Host back end of the hardware abstraction layer: an in-memory 82527
+ *  message object file and ARCOM parallel port, plus stand-ins for the
+ *  board devices (DIP switch, DS1820).  See hal_host.h for how it is used.
+ *
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+
+#include "hal.h"
+#include "../ds1820/ds1820.h"
+
+/* The CAN interrupt service routine in the amb library */
+extern void amb_can_isr(void);
+
+/* Emulated CAN controller registers */
+volatile uword hal_host_C1CSR;
+volatile uword hal_host_C1BTR;
+volatile uword hal_host_C1GMS;
+volatile uword hal_host_C1UGML;
+volatile uword hal_host_C1LGML;
+volatile uword hal_host_C1UMLM;
+volatile uword hal_host_C1LMLM;
+struct can_obj volatile hal_host_can_obj[15];
+
+/* Emulated interrupt control */
+volatile uword hal_host_XP0IC;
+volatile bit hal_host_IEN;
+
+/* Hooks */
+void (*hal_host_can_tx_hook)(ulong id, ubyte len, ubyte *data);
+void (*hal_host_arcom_peer)(void);
+void (*hal_host_idle_hook)(void);
+void (*hal_host_reset_hook)(void);
+
+/* Emulated parallel port */
+HAL_HOST_PORT hal_host_port;
+
+/* Emulated strobe interrupt */
+void (*hal_host_strobe_isr)(void);
+ubyte hal_host_strobe_pending;
+static ubyte strobe_enabled;
+static ubyte in_strobe_isr;
+
+/* Emulated time */
+unsigned long long hal_host_clock_ns;
+unsigned long hal_host_poll_ns = 1060;
+unsigned long hal_host_access_ns = 100;
+
+/* Board */
+ubyte hal_host_node_address;
+ubyte hal_host_serial_number[8] = { 0x10, 0x48, 0x4d, 0x43, 0x00, 0x08, 0x00, 0x5a };
+
+/* Emulator state */
+static ubyte status_pending;	/* Status change interrupt pending */
+static ubyte in_isr;			/* amb_can_isr is running */
+
+/* Message Control Register fields */
+#define MCR_INTPND	0
+#define MCR_RXIE	2
+#define MCR_TXIE	4
+#define MCR_MSGVAL	6
+#define MCR_NEWDAT	8
+#define MCR_MSGLST	10	/* CPUUPD for transmit objects */
+#define MCR_TXRQ	12
+#define MCR_RMTPND	14
+
+/* Control/Status Register bits */
+#define CSR_IE		0x0002
+#define CSR_SIE		0x0004
+#define CSR_TXOK	0x0800
+#define CSR_RXOK	0x1000
+
+static ubyte mcr_is_set(ubyte obj, ubyte field){
+	return ((hal_host_can_obj[obj].MCR >> field) & 0x3) == 0x2;
+}
+
+static void mcr_set(ubyte obj, ubyte field, ubyte set){
+	uword mcr;
+
+	mcr = hal_host_can_obj[obj].MCR & ~(0x3 << field);
+	hal_host_can_obj[obj].MCR = mcr | ((set ? 0x2 : 0x1) << field);
+}
+
+static ulong arbitration_to_id(uword uar, uword lar){
+	ulong id;
+
+	id  = ((ulong) (lar & 0xf800)) >> 11;	/* ID  4.. 0 */
+	id += ((ulong) (lar & 0x00ff)) <<  5;	/* ID 12.. 5 */
+	id += ((ulong) (uar & 0xff00)) <<  5;	/* ID 13..20 */
+	id += ((ulong) (uar & 0x00ff)) << 21;	/* ID 21..28 */
+	return id;
+}
+
+/* Is any CAN interrupt request pending? */
+static ubyte can_pending(void){
+	ubyte obj;
+
+	if (status_pending)
+		return 1;
+	for (obj = 0; obj < 15; obj++)
+		if (mcr_is_set(obj, MCR_INTPND))
+			return 1;
+	return 0;
+}
+
+/* Run the CAN ISR if an interrupt is pending and it is allowed to */
+void hal_host_can_deliver(void){
+	if (in_isr || !hal_host_IEN || !(hal_host_XP0IC & 0x0040) || !(hal_host_C1CSR & CSR_IE))
+		return;
+
+	if (can_pending()) {
+		in_isr = 1;
+		amb_can_isr();
+		in_isr = 0;
+	}
+}
+
+/* Send the frame held by a transmit object */
+static void can_transmit(ubyte obj){
+	ubyte data[8];
+	ubyte len, i;
+
+	len = hal_host_can_obj[obj].MCFG >> 4;
+	for (i = 0; i < len && i < 8; i++)
+		data[i] = hal_host_can_obj[obj].Data[i];
+
+	if (hal_host_can_tx_hook)
+		hal_host_can_tx_hook(arbitration_to_id(hal_host_can_obj[obj].UAR, hal_host_can_obj[obj].LAR),
+							 len, data);
+
+	mcr_set(obj, MCR_TXRQ, 0);
+	mcr_set(obj, MCR_NEWDAT, 0);
+	if (mcr_is_set(obj, MCR_TXIE))
+		mcr_set(obj, MCR_INTPND, 1);
+
+	hal_host_C1CSR |= CSR_TXOK;
+	if (hal_host_C1CSR & CSR_SIE)
+		status_pending = 1;
+}
+
+uword hal_host_can_ir(void){
+	ubyte obj;
+
+	if (status_pending) {
+		/* Reading the interrupt identifier acknowledges the status interrupt */
+		status_pending = 0;
+		return 1;
+	}
+	if (mcr_is_set(14, MCR_INTPND))
+		return 2;
+	for (obj = 0; obj < 14; obj++)
+		if (mcr_is_set(obj, MCR_INTPND))
+			return obj + 3;
+	return 0;
+}
+
+void hal_host_can_mcr_write(ubyte obj, uword value){
+	ubyte field, pair;
+
+	for (field = 0; field < 16; field += 2) {
+		pair = (value >> field) & 0x3;
+		if (pair == 0x2)
+			mcr_set(obj, field, 1);
+		else if (pair == 0x1)
+			mcr_set(obj, field, 0);
+	}
+
+	/* A transmit object with TXRQ set goes out as soon as the CPU is done with it */
+	if (mcr_is_set(obj, MCR_MSGVAL) && mcr_is_set(obj, MCR_TXRQ) &&
+		!mcr_is_set(obj, MCR_MSGLST) && (hal_host_can_obj[obj].MCFG & 0x08))
+		can_transmit(obj);
+
+	hal_host_can_deliver();
+}
+
+int hal_host_can_receive(ulong id, ubyte len, ubyte *data){
+	uword uar, lar;
+	ubyte obj, i;
+
+	lar  = (uword) ((id & 0x0000001f) << 11);	/* ID  4.. 0 */
+	lar += (uword) ((id & 0x00001fe0) >>  5);	/* ID 12.. 5 */
+	uar  = (uword) ((id & 0x001fe000) >>  5);	/* ID 13..20 */
+	uar += (uword) ((id & 0x1fe00000) >> 21);	/* ID 21..28 */
+
+	/* Objects 1 to 14 use the global mask, object 15 its own */
+	for (obj = 0; obj < 15; obj++) {
+		if (!mcr_is_set(obj, MCR_MSGVAL) || (hal_host_can_obj[obj].MCFG & 0x08))
+			continue;
+		if (obj < 14) {
+			if (((uar ^ hal_host_can_obj[obj].UAR) & hal_host_C1UGML) == 0 &&
+				((lar ^ hal_host_can_obj[obj].LAR) & hal_host_C1LGML) == 0)
+				break;
+		} else {
+			if (((uar ^ hal_host_can_obj[obj].UAR) & hal_host_C1UMLM) == 0 &&
+				((lar ^ hal_host_can_obj[obj].LAR) & hal_host_C1LMLM) == 0)
+				break;
+		}
+	}
+	if (obj == 15)
+		return -1;
+
+	hal_host_can_obj[obj].UAR = uar;
+	hal_host_can_obj[obj].LAR = lar;
+	hal_host_can_obj[obj].MCFG = (hal_host_can_obj[obj].MCFG & 0x0f) | (len << 4);
+	for (i = 0; i < len && i < 8; i++)
+		hal_host_can_obj[obj].Data[i] = data[i];
+
+	if (mcr_is_set(obj, MCR_NEWDAT))
+		mcr_set(obj, MCR_MSGLST, 1);
+	mcr_set(obj, MCR_NEWDAT, 1);
+	if (mcr_is_set(obj, MCR_RXIE))
+		mcr_set(obj, MCR_INTPND, 1);
+
+	hal_host_C1CSR |= CSR_RXOK;
+	if (hal_host_C1CSR & CSR_SIE)
+		status_pending = 1;
+
+	hal_host_can_deliver();
+	return obj;
+}
+
+/*
+ ****************************************************************************
+ * ARCOM parallel port
+ ****************************************************************************
+ */
+
+/* Run the strobe ISR while an edge is latched and it is allowed to */
+static void strobe_deliver(void){
+	while (hal_host_strobe_pending && strobe_enabled && !in_strobe_isr && hal_host_strobe_isr) {
+		hal_host_strobe_pending = 0;
+		in_strobe_isr = 1;
+		hal_host_strobe_isr();
+		in_strobe_isr = 0;
+	}
+}
+
+void hal_host_strobe_enable(ubyte enable){
+	strobe_enabled = enable;
+	strobe_deliver();
+}
+
+static void port_peer(void){
+	ubyte dstrobe;
+
+	hal_host_clock_ns += hal_host_access_ns;
+	dstrobe = hal_host_port.dstrobe;
+	if (hal_host_arcom_peer)
+		hal_host_arcom_peer();
+
+	/* Latch a falling edge of DSTROBE */
+	if (dstrobe && !hal_host_port.dstrobe)
+		hal_host_strobe_pending = 1;
+	strobe_deliver();
+}
+
+void hal_host_port_init(void){
+	hal_host_port.dir_in = 0;
+	hal_host_port.dstrobe = 1;
+	hal_host_port.wait = 0;
+	hal_host_port.intr = 0;
+	hal_host_port.select = 1;
+	port_peer();
+}
+
+void hal_host_port_write(ubyte data){
+	hal_host_port.data_out = data;
+	port_peer();
+}
+
+ubyte hal_host_port_read(void){
+	port_peer();
+	return hal_host_port.data_in;
+}
+
+void hal_host_port_dir(ubyte dir_in){
+	hal_host_port.dir_in = dir_in;
+	port_peer();
+}
+
+ubyte hal_host_port_dstrobe(void){
+	hal_host_clock_ns += hal_host_poll_ns - hal_host_access_ns;
+	port_peer();
+	return hal_host_port.dstrobe;
+}
+
+ubyte hal_host_port_init_line(void){
+	port_peer();
+	return hal_host_port.init;
+}
+
+void hal_host_port_line(ubyte *line, ubyte level){
+	*line = level;
+	port_peer();
+}
+
+/*
+ ****************************************************************************
+ * Board
+ ****************************************************************************
+ */
+
+void hal_host_reset(void){
+	if (hal_host_reset_hook)
+		hal_host_reset_hook();
+	else
+		exit(0);
+}
+
+/* DS1820 stand-ins: the serial number comes from hal_host_serial_number
+   and the temperature reads a constant 25.0 C */
+static void (*ds1820_idle)(void);
+
+void ds1820_set_idle(void (*idle)(void)){
+	ds1820_idle = idle;
+}
+
+short ds1820_init(void){
+	return 0;
+}
+
+short ds1820_get_sn(ubyte sn[8]){
+	ubyte i;
+
+	for (i = 0; i < 8; i++)
+		sn[i] = hal_host_serial_number[i];
+	return 0;
+}
+
+short ds1820_get_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C){
+	/* This is the pass of the firmware main loop */
+	if (hal_host_idle_hook)
+		hal_host_idle_hook();
+
+	/* The ARCOM goes on with a transaction left to the strobe interrupt */
+	port_peer();
+
+	/* Part of the conversion time */
+	if (ds1820_idle)
+		ds1820_idle();
+
+	*MSB = 0x00;
+	*LSB = 0x32;
+	*count_remain = 0x0c;
+	*count_per_C = 0x10;
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ ****************************************************************************
+ *  HAL_HOST.H
+ *
+ *  Host back end of the hardware abstraction layer.  The 82527 message
+ *  object file and the ARCOM parallel port are emulated in memory so that
+ *  amb.c and main.c can be built and run on a workstation, e.g.
+ *
+ *    gcc -std=c99 -DHOST_ARCH -Dmain=ambsi_main -c src/main.c
+ *    gcc -std=c99 -DHOST_ARCH libraries/amb/amb.c libraries/hal/hal_host.c
+ *        main.o <driver>.c
+ *
+ *  main() in main.c never returns, so the driver renames it and calls it.
+ *  The firmware main loop calls hal_host_idle_hook on every pass; that is
+ *  where the driver injects CAN frames with hal_host_can_receive, which
+ *  runs amb_can_isr synchronously like the real interrupt would.  The
+ *  ARCOM side is provided by hal_host_arcom_peer, called whenever the
+ *  firmware touches the parallel port.
+ *
+ *****************************************************************************
+ */
+
+#ifndef HAL_HOST_H
+	#define HAL_HOST_H
+
+	/* Keil C166 extensions that have no meaning on the host */
+	#define idata
+	#define sdata
+	#define bit						unsigned char
+	#define HAL_INTERRUPT(VECTOR)
+	#define HAL_INTERRUPT_BANK(VECTOR, BANK)
+	#define _nop_()
+
+	/* Reset the micro */
+	#define HAL_RESET()				hal_host_reset()
+
+	/* Read the slave address */
+	#define HAL_NODE_ADDRESS()		(hal_host_node_address)
+
+	/*
+	 ****************************************************************************
+	 * CAN controller
+	 ****************************************************************************
+	 */
+
+	/* Emulated CAN controller registers */
+	extern volatile uword hal_host_C1CSR;
+	extern volatile uword hal_host_C1BTR;
+	extern volatile uword hal_host_C1GMS;
+	extern volatile uword hal_host_C1UGML;
+	extern volatile uword hal_host_C1LGML;
+	extern volatile uword hal_host_C1UMLM;
+	extern volatile uword hal_host_C1LMLM;
+	extern struct can_obj volatile hal_host_can_obj[15];
+
+	#define C1CSR   hal_host_C1CSR
+	#define C1IR    hal_host_can_ir()
+	#define C1BTR   hal_host_C1BTR
+	#define C1GMS   hal_host_C1GMS
+	#define C1UGML  hal_host_C1UGML
+	#define C1LGML  hal_host_C1LGML
+	#define C1UMLM  hal_host_C1UMLM
+	#define C1LMLM  hal_host_C1LMLM
+	#define CAN_OBJ hal_host_can_obj
+
+	/* Emulated interrupt control */
+	extern volatile uword hal_host_XP0IC;
+	extern volatile bit hal_host_IEN;
+
+	#define XP0IC   hal_host_XP0IC
+	#define IEN     hal_host_IEN
+
+	/* The Message Control Register pairs are set (10), reset (01) or left
+	   unchanged (11) by a write, so writes go through the emulator */
+	#define HAL_CAN_MCR_WRITE(OBJ, VALUE)	hal_host_can_mcr_write(OBJ, VALUE)
+
+	/* Keep the CAN ISR out while shared data is being modified */
+	#define HAL_CAN_INT_DISABLE(SAVE)		do { SAVE = (XP0IC & 0x0040) != 0; XP0IC &= ~0x0040; } while (0)
+	#define HAL_CAN_INT_RESTORE(SAVE)		do { if (SAVE) { XP0IC |= 0x0040; hal_host_can_deliver(); } } while (0)
+
+	extern uword hal_host_can_ir(void);
+	extern void  hal_host_can_mcr_write(ubyte obj, uword value);
+
+	/* Run amb_can_isr if an interrupt is pending and enabled */
+	extern void  hal_host_can_deliver(void);
+
+	/* Deliver a frame to the emulated controller.  Runs amb_can_isr if the
+	   frame is accepted and the CAN interrupt is enabled. Returns the index
+	   of the receiving object or -1 if no object accepted it. */
+	extern int   hal_host_can_receive(ulong id, ubyte len, ubyte *data);
+
+	/* Called for every frame sent by the emulated controller */
+	extern void  (*hal_host_can_tx_hook)(ulong id, ubyte len, ubyte *data);
+
+	/*
+	 ****************************************************************************
+	 * ARCOM parallel port
+	 ****************************************************************************
+	 */
+
+	/* State of the emulated parallel port lines */
+	typedef struct {
+		ubyte	data_out;	/* Last byte written by the AMBSI1 */
+		ubyte	data_in;	/* Byte presented by the ARCOM */
+		ubyte	dir_in;		/* Data lines set to receive */
+		ubyte	dstrobe;	/* Driven by the ARCOM, active low */
+		ubyte	init;		/* Driven by the ARCOM */
+		ubyte	wait;		/* Driven by the AMBSI1 */
+		ubyte	intr;		/* Driven by the AMBSI1 */
+		ubyte	select;		/* Driven by the AMBSI1 */
+	} HAL_HOST_PORT;
+
+	extern HAL_HOST_PORT hal_host_port;
+
+	/* Emulated time.  Every access to the parallel port advances it: the
+	   DSTROBE polls of the handshake loops by hal_host_poll_ns, any other
+	   access by hal_host_access_ns.  The poll cost follows the estimate
+	   of 530 us for the 500 polls of the former software handshake timeout
+	   on the AMBSI1. */
+	extern unsigned long long hal_host_clock_ns;
+	extern unsigned long hal_host_poll_ns;
+	extern unsigned long hal_host_access_ns;
+
+	/* ARCOM side of the link, called after every access to the port */
+	extern void  (*hal_host_arcom_peer)(void);
+
+	/* Free running timer, derived from the emulated time */
+	#define HAL_TIMER_NS_PER_TICK	400
+	#define HAL_TIMER_INIT()
+	#define HAL_TIMER_READ()		((uword) (hal_host_clock_ns / HAL_TIMER_NS_PER_TICK))
+	#define HAL_SLOW_TIMER_NS_PER_TICK	25600L
+	#define HAL_SLOW_TIMER_READ()	((uword) (hal_host_clock_ns / HAL_SLOW_TIMER_NS_PER_TICK))
+
+	#define HAL_DISABLE_EX_BUF()
+	#define HAL_ARCOM_PORT_INIT()	hal_host_port_init()
+
+	#define HAL_ARCOM_WRITE(DATA)	hal_host_port_write((ubyte) (DATA))
+	#define HAL_ARCOM_READ()		hal_host_port_read()
+	#define HAL_ARCOM_DIR_IN()		hal_host_port_dir(1)
+	#define HAL_ARCOM_DIR_OUT()		hal_host_port_dir(0)
+
+	#define HAL_ARCOM_DSTROBE()		hal_host_port_dstrobe()
+	#define HAL_ARCOM_INIT()		hal_host_port_init_line()
+	#define HAL_ARCOM_WAIT(LEVEL)	hal_host_port_line(&hal_host_port.wait, LEVEL)
+	#define HAL_ARCOM_INT(LEVEL)	hal_host_port_line(&hal_host_port.intr, LEVEL)
+	#define HAL_ARCOM_SELECT(LEVEL)	hal_host_port_line(&hal_host_port.select, LEVEL)
+
+	/* Strobe interrupt: the ISR runs after the port access in which the
+	   ARCOM pulled DSTROBE low, or when it is enabled with an edge latched */
+	#define HAL_ARCOM_STROBE_VECTOR		0x13
+	#define HAL_ARCOM_STROBE_INT_INIT(ISR)	hal_host_strobe_isr = (ISR)
+	#define HAL_ARCOM_STROBE_INT_CLEAR()	hal_host_strobe_pending = 0
+	#define HAL_ARCOM_STROBE_INT_ENABLE()	hal_host_strobe_enable(1)
+	#define HAL_ARCOM_STROBE_INT_DISABLE()	hal_host_strobe_enable(0)
+
+	extern void  (*hal_host_strobe_isr)(void);
+	extern ubyte hal_host_strobe_pending;	/* Falling edge latched, like CC3IR */
+	extern void  hal_host_strobe_enable(ubyte enable);
+
+	extern void  hal_host_port_init(void);
+	extern void  hal_host_port_write(ubyte data);
+	extern ubyte hal_host_port_read(void);
+	extern void  hal_host_port_dir(ubyte dir_in);
+	extern ubyte hal_host_port_dstrobe(void);
+	extern ubyte hal_host_port_init_line(void);
+	extern void  hal_host_port_line(ubyte *line, ubyte level);
+
+	/*
+	 ****************************************************************************
+	 * Board
+	 ****************************************************************************
+	 */
+
+	extern ubyte hal_host_node_address;		/* DIP switch setting */
+	extern ubyte hal_host_serial_number[8];	/* DS1820 serial number */
+
+	/* Called by the firmware main loop on every pass */
+	extern void  (*hal_host_idle_hook)(void);
+
+	/* Called on a reset request, the default exits the process */
+	extern void  (*hal_host_reset_hook)(void);
+
+	extern void  hal_host_reset(void);
+
+#endif /* HAL_HOST_H */
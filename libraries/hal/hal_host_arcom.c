@@ -0,0 +1,373 @@
+/*
+ ****************************************************************************
+ *  HAL_HOST_ARCOM.C
+ *
+ *  Simulated ARCOM Pegasus endpoint for the host back end.
+ *
+ *****************************************************************************
+ */
+
+#include "hal_host_arcom.h"
+
+#define ARCOM_HEADER_LEN	5	/* RCA (4 bytes) and payload length */
+#define ARCOM_MAX_PAYLOAD	8
+
+/* Status of a checked reply, sent back by the AMBSI1 (LINK_CRC of main.c) */
+#define ARCOM_ACK			0x06
+#define ARCOM_NAK			0x15	/* Also the reply length to a request failing its check */
+
+/* Payload length of a tagged monitor request (LINK_TAGS of main.c), then the tag */
+#define ARCOM_TAGGED		0x80
+#define ARCOM_FETCH_RCA		0x40008	/* GET_TAGGED_REPLY, private to the link */
+#define ARCOM_RANGES_RCA	0x40007	/* GET_ALL_RCA_RANGES, private to the link */
+#define ARCOM_JOBS			16		/* Tagged requests the ARCOM works on at once */
+
+HAL_HOST_ARCOM_TIMING hal_host_arcom_timing = { 2000, 20000, { 0, 0, 0, 0, 0, 0, 0 }, 0, 0, 0 };
+HAL_HOST_ARCOM_FAULTS hal_host_arcom_faults;
+ulong hal_host_arcom_seed = 1;
+void (*hal_host_arcom_script)(ulong transaction);
+ubyte hal_host_arcom_crc;
+ubyte hal_host_arcom_all_ranges = 1;
+
+ulong hal_host_arcom_ranges[4][2] = {
+	{ 0x20002, 0x20FFF },	/* Special monitor */
+	{ 0x21000, 0x21FFF },	/* Special control */
+	{ 0x00001, 0x0FFFF },	/* Monitor */
+	{ 0x10001, 0x1FFFF }	/* Control */
+};
+
+ulong hal_host_arcom_monitors;
+ulong hal_host_arcom_controls;
+ulong hal_host_arcom_transactions;
+ulong hal_host_arcom_dropped;
+ulong hal_host_arcom_aborted;
+ulong hal_host_arcom_corrupted;
+ulong hal_host_arcom_rejected;
+ulong hal_host_arcom_naks;
+ulong hal_host_arcom_tagged;
+ulong hal_host_arcom_fetched;
+
+/* Tagged requests being worked on */
+static struct {
+	ubyte	tag;			/* 0 -> free */
+	ulong	rca;
+	unsigned long long ready_at;	/* When the reply is ready to be fetched */
+} jobs[ARCOM_JOBS];
+
+/* Transaction state */
+static struct {
+	ubyte	last_intr;		/* INT level seen on the previous call */
+	ubyte	last_wait;		/* WAIT level seen on the previous call */
+	ubyte	index;			/* Bytes exchanged so far */
+	ubyte	total;			/* Bytes in the whole transaction */
+	ubyte	request_len;	/* Bytes of the request, header, payload and check */
+	ubyte	reply_len;		/* Bytes of the reply, length, reply and check */
+	ubyte	replies;		/* Replies still to send after this one */
+	ubyte	fetched;		/* Job in the reply, dropped once it is through */
+	ubyte	request[ARCOM_HEADER_LEN + ARCOM_MAX_PAYLOAD + 1];
+	ubyte	reply[1 + 1 + ARCOM_MAX_PAYLOAD + 1];
+	ubyte	drop;			/* A byte of this transaction is to be dropped */
+	ubyte	corrupt;		/* A byte of this transaction is to be corrupted */
+	ubyte	stalled;		/* A byte was dropped: nothing is strobed until the resync */
+	unsigned long long ready_at;	/* When the next DSTROBE may go low */
+} arcom;
+
+/* Small deterministic generator for the jitter */
+static ulong arcom_random(void){
+	hal_host_arcom_seed = hal_host_arcom_seed * 1103515245UL + 12345UL;
+	return (hal_host_arcom_seed >> 8) & 0xFFFFFF;
+}
+
+/* CRC-8, polynomial 0x07, of LEN bytes at DATA continuing from CRC */
+static ubyte arcom_crc8(ubyte crc, const ubyte *data, ubyte len){
+	ubyte i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (ubyte) ((crc << 1) ^ 0x07) : (ubyte) (crc << 1);
+	}
+	return crc;
+}
+
+/* Phase, 1 to HAL_HOST_ARCOM_PHASES, of the byte at INDEX */
+static ubyte arcom_phase(ubyte index){
+	if (index < ARCOM_HEADER_LEN)
+		return index + 1;
+	if (index < arcom.request_len)
+		return ARCOM_HEADER_LEN;
+	return index == arcom.request_len ? 6 : 7;
+}
+
+/* The next byte may be strobed NS from now, plus the delay of its phase
+   and the jitter */
+static void arcom_schedule(unsigned long ns){
+	arcom.ready_at = hal_host_clock_ns + ns +
+					 hal_host_arcom_timing.phase_ns[arcom_phase(arcom.index) - 1];
+	if (hal_host_arcom_timing.jitter_ns)
+		arcom.ready_at += arcom_random() % (hal_host_arcom_timing.jitter_ns + 1);
+}
+
+/* Wait for the header of a new request */
+static void arcom_start(void){
+	arcom.index = 0;
+	arcom.total = ARCOM_HEADER_LEN;
+	arcom.request_len = ARCOM_HEADER_LEN;
+	arcom.reply_len = 0;
+	arcom.fetched = ARCOM_JOBS;
+	arcom.stalled = 0;
+	arcom_schedule(hal_host_arcom_timing.byte_ns);
+}
+
+/* Time to produce the reply of RCA */
+static unsigned long arcom_reply_ns(ulong rca){
+	/* A fetched reply is ready */
+	if (rca == ARCOM_FETCH_RCA)
+		return 0;
+	return hal_host_arcom_timing.reply_ns + ((rca & 1) ? hal_host_arcom_timing.odd_ns : 0);
+}
+
+/* Reply to GET_TAGGED_REPLY: the tag and reply of the job ready first, or
+   an empty reply.  The job is kept until the reply is through, so a failed
+   fetch gets it again */
+static void arcom_fetch(void){
+	ubyte i, ready;
+
+	ready = ARCOM_JOBS;
+	for (i = 0; i < ARCOM_JOBS; i++)
+		if (jobs[i].tag && jobs[i].ready_at <= hal_host_clock_ns &&
+			(ready == ARCOM_JOBS || jobs[i].ready_at < jobs[ready].ready_at))
+			ready = i;
+
+	if (ready == ARCOM_JOBS) {
+		arcom.reply[0] = 0;
+	} else {
+		arcom.reply[0] = 5;
+		arcom.reply[1] = jobs[ready].tag;
+		for (i = 0; i < 4; i++)
+			arcom.reply[2 + i] = (ubyte) (jobs[ready].rca >> (8 * i));
+		arcom.fetched = ready;
+	}
+}
+
+/* Start work on a tagged request */
+static void arcom_tagged(ulong rca, ubyte tag){
+	ubyte i;
+
+	for (i = 0; i < ARCOM_JOBS && jobs[i].tag; i++) {}
+	if (i == ARCOM_JOBS)
+		return;
+	jobs[i].tag = tag;
+	jobs[i].rca = rca;
+	jobs[i].ready_at = hal_host_clock_ns + arcom_reply_ns(rca);
+	hal_host_arcom_tagged++;
+}
+
+/* Build the reply for a monitor request */
+static void arcom_monitor(ulong rca){
+	ubyte i;
+	ulong lowest, highest;
+
+	/* The four ranges in a row, from the reply to 0x20003 */
+	if (rca == ARCOM_RANGES_RCA && hal_host_arcom_all_ranges) {
+		rca = 0x20003;
+		arcom.replies = 3;
+	}
+	if (rca == ARCOM_FETCH_RCA) {
+		arcom_fetch();
+	} else if (rca >= 0x20003 && rca <= 0x20006) {
+		lowest = hal_host_arcom_ranges[rca - 0x20003][0];
+		highest = hal_host_arcom_ranges[rca - 0x20003][1];
+		arcom.reply[0] = 8;
+		for (i = 0; i < 4; i++) {
+			arcom.reply[1 + i] = (ubyte) (lowest >> (8 * i));
+			arcom.reply[5 + i] = (ubyte) (highest >> (8 * i));
+		}
+	} else {
+		/* Any other point reads back its own RCA */
+		arcom.reply[0] = 4;
+		for (i = 0; i < 4; i++)
+			arcom.reply[1 + i] = (ubyte) (rca >> (8 * i));
+	}
+	arcom.reply_len = 1 + arcom.reply[0];
+
+	/* The check covers the RCA asked for too */
+	if (hal_host_arcom_crc) {
+		arcom.reply[arcom.reply_len] = arcom_crc8(arcom_crc8(0, arcom.request, 4), arcom.reply, arcom.reply_len);
+		arcom.reply_len++;
+	}
+	hal_host_arcom_monitors++;
+}
+
+/* The whole request is in: check it and build the reply */
+static void arcom_request_done(void){
+	ulong rca;
+
+	if (hal_host_arcom_crc &&
+		arcom_crc8(0, arcom.request, arcom.request_len - 1) != arcom.request[arcom.request_len - 1]) {
+		hal_host_arcom_rejected++;
+		if (arcom.request[4] == 0) {
+			arcom.reply[0] = ARCOM_NAK;
+			arcom.reply_len = 1;
+			arcom.total = arcom.request_len + 1;
+		}
+		return;
+	}
+
+	rca = (ulong) arcom.request[0] | ((ulong) arcom.request[1] << 8) |
+		  ((ulong) arcom.request[2] << 16) | ((ulong) arcom.request[3] << 24);
+
+	/* A tagged request is answered when fetched */
+	if (arcom.request[4] == ARCOM_TAGGED) {
+		arcom_tagged(rca, arcom.request[ARCOM_HEADER_LEN]);
+		return;
+	}
+
+	if (arcom.request[4] != 0) {
+		hal_host_arcom_controls++;
+		return;
+	}
+
+	arcom.replies = 0;
+	arcom_monitor(rca);
+	/* With the check, the AMBSI1 answers the reply with its status */
+	arcom.total = arcom.request_len + arcom.reply_len + (hal_host_arcom_crc ? 1 : 0);
+}
+
+/* A byte has been acknowledged by WAIT going high */
+static void arcom_byte_done(void){
+	/* The request comes from the AMBSI1 */
+	if (arcom.index < arcom.request_len)
+		arcom.request[arcom.index] = hal_host_port.data_out;
+
+	if (arcom.index == ARCOM_HEADER_LEN - 1) {
+		if (arcom.request[4] == ARCOM_TAGGED)
+			arcom.request_len = ARCOM_HEADER_LEN + 1 + (hal_host_arcom_crc ? 1 : 0);
+		else {
+			if (arcom.request[4] > ARCOM_MAX_PAYLOAD)
+				arcom.request[4] = ARCOM_MAX_PAYLOAD;
+			arcom.request_len = ARCOM_HEADER_LEN + arcom.request[4] + (hal_host_arcom_crc ? 1 : 0);
+		}
+		arcom.total = arcom.request_len;
+	}
+
+	if (arcom.index == arcom.request_len - 1) {
+		arcom_request_done();
+	} else if (arcom.index == arcom.total - 1 && arcom.index >= arcom.request_len + arcom.reply_len) {
+		/* Status of a checked reply */
+		if (hal_host_port.data_out == ARCOM_NAK) {
+			/* Send the reply again */
+			hal_host_arcom_naks++;
+			arcom.index = arcom.request_len;
+			hal_host_port.dstrobe = 1;
+			arcom_schedule(hal_host_arcom_timing.byte_ns);
+			return;
+		} else if (hal_host_port.data_out != ARCOM_ACK) {
+			/* Given up: the AMBSI1 may retry with a new header */
+			hal_host_port.dstrobe = 1;
+			arcom_start();
+			return;
+		}
+	}
+
+	arcom.index++;
+	hal_host_port.dstrobe = 1;
+
+	/* A fetched reply is through */
+	if (arcom.index == arcom.total && arcom.fetched < ARCOM_JOBS) {
+		jobs[arcom.fetched].tag = 0;
+		arcom.fetched = ARCOM_JOBS;
+		hal_host_arcom_fetched++;
+	}
+
+	/* The next reply of GET_ALL_RCA_RANGES */
+	if (arcom.index == arcom.total && arcom.replies) {
+		arcom.replies--;
+		arcom_monitor(0x20006 - arcom.replies);
+		arcom.index = arcom.request_len;
+		arcom.total = arcom.request_len + arcom.reply_len + (hal_host_arcom_crc ? 1 : 0);
+	}
+
+	if (arcom.index == arcom.request_len && arcom.request[4] == 0)
+		arcom_schedule(hal_host_arcom_timing.byte_ns + arcom_reply_ns((ulong) arcom.request[0] | ((ulong) arcom.request[1] << 8) |
+																	  ((ulong) arcom.request[2] << 16) | ((ulong) arcom.request[3] << 24)));
+	else
+		arcom_schedule(hal_host_arcom_timing.byte_ns);
+}
+
+static void arcom_peer(void){
+	HAL_HOST_PORT *port = &hal_host_port;
+	HAL_HOST_ARCOM_FAULTS *faults = &hal_host_arcom_faults;
+
+	/* INIT is high until the ARCOM has booted */
+	port->init = faults->init == HAL_HOST_ARCOM_STUCK_HIGH ||
+				 (faults->init == HAL_HOST_ARCOM_FREE && hal_host_clock_ns < hal_host_arcom_timing.boot_ns);
+
+	if (!port->intr || port->select) {
+		/* No transaction in progress */
+		if (arcom.last_intr && arcom.index < arcom.total)
+			hal_host_arcom_aborted++;
+		arcom.index = 0;
+		arcom.total = ARCOM_HEADER_LEN;
+		arcom.request_len = ARCOM_HEADER_LEN;
+		arcom.stalled = 0;
+		port->dstrobe = 1;
+	} else if (!arcom.last_intr) {
+		/* INT went high: a new transaction */
+		if (hal_host_arcom_script)
+			hal_host_arcom_script(hal_host_arcom_transactions);
+		arcom.drop = faults->drop_phase && faults->drop_every &&
+					 hal_host_arcom_transactions % faults->drop_every == 0;
+		arcom.corrupt = faults->corrupt_phase && faults->corrupt_every &&
+						hal_host_arcom_transactions % faults->corrupt_every == 0;
+		hal_host_arcom_transactions++;
+		arcom_start();
+	} else if (faults->dstrobe != HAL_HOST_ARCOM_FREE) {
+		/* The ARCOM does not see the port */
+	} else if (arcom.stalled) {
+		/* Start over once the ARCOM gives up on the dropped byte */
+		if (faults->resync_ns && hal_host_clock_ns >= arcom.ready_at)
+			arcom_start();
+	} else if (port->wait && !arcom.last_wait) {
+		arcom_byte_done();
+	} else if (!port->wait && port->dstrobe && arcom.index < arcom.total &&
+			   hal_host_clock_ns >= arcom.ready_at) {
+		if (arcom.drop && arcom_phase(arcom.index) == faults->drop_phase) {
+			/* Drop the byte: no strobe */
+			arcom.drop = 0;
+			arcom.stalled = 1;
+			arcom.ready_at = hal_host_clock_ns + faults->resync_ns;
+			hal_host_arcom_dropped++;
+		} else {
+			/* Strobe the next byte */
+			if (arcom.index >= arcom.request_len && arcom.index < arcom.request_len + arcom.reply_len) {
+				port->data_in = arcom.reply[arcom.index - arcom.request_len];
+				if (arcom.corrupt && arcom_phase(arcom.index) == faults->corrupt_phase) {
+					/* Only the first time the reply is sent */
+					port->data_in ^= 0x01;
+					arcom.corrupt = 0;
+					hal_host_arcom_corrupted++;
+				}
+			}
+			port->dstrobe = 0;
+		}
+	}
+
+	if (faults->dstrobe != HAL_HOST_ARCOM_FREE) {
+		port->dstrobe = faults->dstrobe == HAL_HOST_ARCOM_STUCK_HIGH;
+		port->data_in = 0xFF;	/* Nobody drives the data lines */
+	}
+
+	arcom.last_intr = port->intr && !port->select;
+	arcom.last_wait = port->wait;
+}
+
+void hal_host_arcom_attach(void){
+	arcom.last_intr = 0;
+	arcom.last_wait = 0;
+	arcom.index = 0;
+	arcom.total = ARCOM_HEADER_LEN;
+	arcom.request_len = ARCOM_HEADER_LEN;
+	arcom.stalled = 0;
+	hal_host_arcom_peer = arcom_peer;
+}
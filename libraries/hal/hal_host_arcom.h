@@ -0,0 +1,112 @@
+/*
+ ****************************************************************************
+ *  HAL_HOST_ARCOM.H
+ *
+ *  Simulated ARCOM Pegasus endpoint for the host back end.  It answers the
+ *  DSTROBE/WAIT handshake of main.c on the emulated parallel port, in
+ *  emulated time (see hal_host_clock_ns).
+ *
+ *  The ARCOM holds INIT high until it has booted and only serves the port
+ *  while SELECT is low.  A transaction starts with INT going high.  The
+ *  AMBSI1 then sends the 4 RCA bytes, LSB first, and the payload length.  A
+ *  control request continues with the payload; a monitor request (length 0)
+ *  is answered with the reply length and the reply bytes.
+ *
+ *  With hal_host_arcom_crc set it speaks the checked frames of LINK_CRC in
+ *  main.c: each request and reply ends with a CRC-8, a monitor request
+ *  failing its check is answered with NAK as reply length, a control
+ *  request failing it is dropped, and the reply is sent again for a NAK.
+ *
+ *  It always knows the tagged monitor requests of LINK_TAGS: a payload
+ *  length of 0x80 followed by a tag.  The transaction ends there and the
+ *  reply, the tag then the reply bytes, is ready for GET_TAGGED_REPLY
+ *  (0x40008) once the reply time has elapsed.  The replies are fetched in
+ *  the order they become ready, and an empty reply is sent while none is.
+ *  A reply is only done with once a fetch has moved all of it.
+ *
+ *  Faults can be injected to exercise the timeouts and the retry of
+ *  implMonitorSingle: extra delays per phase, random jitter, stuck DSTROBE
+ *  or INIT lines, dropped and corrupted bytes.  hal_host_arcom_script is called at the
+ *  start of every transaction so that a test can change the timing and the
+ *  faults from one transaction to the next.
+ *
+ *****************************************************************************
+ */
+
+#ifndef HAL_HOST_ARCOM_H
+	#define HAL_HOST_ARCOM_H
+
+	#include "hal.h"
+
+	/* Phases of a transaction, numbered from 1 as the monTimer of main.c:
+	   4 RCA bytes, length, reply length, then every byte of the reply.  The
+	   payload and check of a request count as phase 5, the check and status
+	   of a reply as phase 7. */
+	#define HAL_HOST_ARCOM_PHASES	7
+
+	/* Timing of the simulated ARCOM */
+	typedef struct {
+		unsigned long	byte_ns;	/* Time to present or accept each byte */
+		unsigned long	reply_ns;	/* Time to produce a monitor reply */
+		unsigned long	phase_ns[HAL_HOST_ARCOM_PHASES];	/* Extra time before strobing a byte of phase 1..7 */
+		unsigned long	jitter_ns;	/* Random extra time, up to this, before every strobe */
+		unsigned long	boot_ns;	/* INIT stays high until then */
+		unsigned long	odd_ns;		/* Extra time to produce the reply of an odd RCA */
+	} HAL_HOST_ARCOM_TIMING;
+
+	extern HAL_HOST_ARCOM_TIMING hal_host_arcom_timing;
+
+	/* Level of a stuck line */
+	#define HAL_HOST_ARCOM_FREE			0	/* Not stuck */
+	#define HAL_HOST_ARCOM_STUCK_HIGH	1
+	#define HAL_HOST_ARCOM_STUCK_LOW	2
+
+	/* Faults of the simulated ARCOM */
+	typedef struct {
+		ubyte			dstrobe;		/* DSTROBE stuck: the ARCOM is not served */
+		ubyte			init;			/* HAL_HOST_ARCOM_STUCK_HIGH: the ARCOM never comes up */
+		ubyte			drop_phase;		/* Phase 1..7 whose byte is never strobed, 0 for none */
+		unsigned int	drop_every;		/* Drop in every nth transaction, 1 for all */
+		unsigned long	resync_ns;		/* After a drop the ARCOM starts over with a new
+										   header once this has elapsed, 0 to wait for INT */
+		ubyte			corrupt_phase;	/* Phase 6..7 whose first reply byte is flipped, 0 for none */
+		unsigned int	corrupt_every;	/* Corrupt in every nth transaction, 1 for all */
+	} HAL_HOST_ARCOM_FAULTS;
+
+	extern HAL_HOST_ARCOM_FAULTS hal_host_arcom_faults;
+
+	/* Seed of the jitter */
+	extern ulong hal_host_arcom_seed;
+
+	/* Called when INT goes high, with the number of the transaction starting
+	   counted from 0, before the faults are applied to it */
+	extern void (*hal_host_arcom_script)(ulong transaction);
+
+	/* Checked frames, as with LINK_CRC in main.c */
+	extern ubyte hal_host_arcom_crc;
+
+	/* RCA ranges returned for GET_SPECIAL_MONITOR_RCAS (0x20003) through
+	   GET_CONTROL_RCAS (0x20006): [0] lowest, [1] highest */
+	extern ulong hal_host_arcom_ranges[4][2];
+
+	/* GET_ALL_RCA_RANGES (0x40007) is answered with the four replies of
+	   0x20003 to 0x20006 in a row.  Clear to simulate older ARCOM firmware,
+	   which answers it as any other point. */
+	extern ubyte hal_host_arcom_all_ranges;
+
+	/* Counters */
+	extern ulong hal_host_arcom_monitors;		/* Monitor requests answered */
+	extern ulong hal_host_arcom_controls;		/* Control requests received */
+	extern ulong hal_host_arcom_transactions;	/* INT rising edges while selected */
+	extern ulong hal_host_arcom_dropped;		/* Bytes dropped */
+	extern ulong hal_host_arcom_aborted;		/* Transactions ended by INT before the last byte */
+	extern ulong hal_host_arcom_corrupted;		/* Bytes corrupted */
+	extern ulong hal_host_arcom_rejected;		/* Requests failing their check */
+	extern ulong hal_host_arcom_naks;			/* Replies sent again */
+	extern ulong hal_host_arcom_tagged;			/* Tagged monitor requests taken */
+	extern ulong hal_host_arcom_fetched;		/* Replies of tagged requests fetched */
+
+	/* Install the simulated ARCOM as hal_host_arcom_peer */
+	extern void hal_host_arcom_attach(void);
+
+#endif /* HAL_HOST_ARCOM_H */
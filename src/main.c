@@ -14,10 +14,176 @@
 #define FULL_HANDSHAKE
 
 //! Longest timeout allowed waiting for acknowledgement from ARCOM board
-/*! During each phase of monitoring, a count-down timer counts from \p MAX_TIMEOUT
-	down to zero unless an aknowledgment is received. */
-#define MAX_TIMEOUT 500    
-// about 530 microseconds based on 0xFFFF = 70 ms
+/*! During each phase of monitoring, the wait for the acknowledgment is timed
+	with the free running timer of the HAL and given up after \p MAX_TIMEOUT
+	microseconds.  Version 1.2.x and earlier counted a software loop down from
+	500, about 530 microseconds. */
+#define MAX_TIMEOUT 530
+
+//! \p MAX_TIMEOUT in ticks of the HAL timer
+#define MAX_TIMEOUT_TICKS	((unsigned int) (MAX_TIMEOUT * 1000L / HAL_TIMER_NS_PER_TICK))
+
+//! Convert a phase timer from HAL timer ticks to microseconds
+#define TICKS_TO_US(TICKS)	((unsigned int) (((unsigned long) (TICKS) * HAL_TIMER_NS_PER_TICK) / 1000))
+
+//! Adaptive handshake timeouts
+/*! If defined, the first try of a monitor transaction waits in each phase only
+	for the time learned from the previous answers of the ARCOM for the same
+	class of RCA (running mean plus four times the mean deviation plus
+	\p ADAPTIVE_TIMEOUT_MARGIN), and gives up at the first phase timing out.
+	The reply length phase keeps the full timeout, since the ARCOM takes as long
+	as the point needs to produce its reply.  Before the retry INT is dropped for
+	\p MAX_TIMEOUT, so an ARCOM left in the middle of the first try has ended it,
+	and the retry waits for \p MAX_TIMEOUT in every phase, so a slower ARCOM is
+	still served and the estimate follows it. */
+// #define ADAPTIVE_TIMEOUT
+
+//! Margin added to the adaptive timeout of each phase, in microseconds
+#define ADAPTIVE_TIMEOUT_MARGIN 20
+
+//! Monitor response cache
+/*! If defined, the replies of the ARCOM to monitor requests in up to \p CACHE_RANGES
+	ranges of RCAs, each with its own time to live, are kept in a cache of
+	\p CACHE_SIZE entries and repeated requests are answered from it without
+	a transaction.  The ranges are set with the control RCAs SET_CACHE_RANGE_RCA
+	and are all empty at power up.  A control request drops the cached reply of
+	its own RCA and of the monitor RCA at the same place in the monitor range. */
+// #define MONITOR_CACHE
+
+#define CACHE_SIZE		8		//!< Replies kept in the monitor cache
+#define CACHE_RANGES	4		//!< Ranges of RCAs with their own time to live
+#define MAX_CACHE_TTL	1600	//!< Longest time to live in ms, within the 1.68 s wrap of the slow timer
+
+//! Background prefetch of monitor points
+/*! If defined together with \p MONITOR_CACHE, the main loop reads the RCAs
+	uploaded with the control RCAs SET_PREFETCH_RCA from the ARCOM, each with its
+	own period, and keeps the replies in the monitor cache, so that CAN requests
+	for them are answered without a transaction.  The poller holds the link
+	for at most \p PREFETCH_DUTY percent of the time and one point at a time.
+	Needs STROBE_INT: the transaction of a point runs on the strobe interrupt
+	and the CAN interrupt is never held off while it does. */
+// #define PREFETCH
+
+#define PREFETCH_SIZE	8		//!< Points the poller can keep warm
+#define PREFETCH_DUTY	25		//!< Percentage of the time the poller may use the link
+
+#if defined(PREFETCH) && !defined(MONITOR_CACHE)
+	#error PREFETCH needs MONITOR_CACHE
+#endif
+#if defined(PREFETCH) && !defined(STROBE_INT)
+	#error PREFETCH needs STROBE_INT
+#endif
+
+//! Queued forwarding of control requests
+/*! If defined, controlMsg only puts the control request in a queue of
+	\p CONTROL_QUEUE_SIZE requests and the main loop forwards them to the ARCOM
+	in the order received, so a burst of control requests does not hold up
+	the monitor requests behind it.  A request arriving with the queue full is
+	dropped and counted.  In up to \p COALESCE_RANGES ranges of RCAs, set with
+	the control RCAs SET_COALESCE_RANGE_RCA, a request replaces the payload of
+	a request to the same RCA still in the queue, so only the newest value is
+	forwarded.  The ranges are all empty at power up. */
+// #define CONTROL_QUEUE
+
+#define CONTROL_QUEUE_SIZE	16		//!< Control requests waiting to be forwarded
+#define COALESCE_RANGES		4		//!< Ranges of RCAs whose queued requests are coalesced
+
+//! Batch monitor requests
+/*! If defined, a monitor request to RUN_BATCH_RCA has the main loop read the
+	up to \p BATCH_SIZE RCAs set with the control RCAs SET_BATCH_RCA from the
+	ARCOM, one RCA with a single try on each pass, and send each reply as the
+	monitor response of its own RCA, before the reply to RUN_BATCH_RCA.  One
+	CAN request then replaces up to \p BATCH_SIZE.  Only the RCAs forwarded
+	to the ARCOM, monitor points (monitorMsg) and control points read back
+	(controlMsg), are read, any other one counts as failed. */
+// #define BATCH_MONITOR
+
+#define BATCH_SIZE		8		//!< RCAs read by one batch request
+
+//! Parallel link driven by the strobe interrupt
+/*! If defined, control requests are sent to the ARCOM by the interrupt on
+	the falling edge of DSTROBE, one byte per edge, from a copy of the request
+	(see linkStart), and controlMsg returns as soon as the transaction is
+	started.  The CPU is free for the CAN interrupt and the main loop while
+	the ARCOM takes the bytes.  Monitor transactions first wait for the link to
+	be idle and then run in the blocking handshake as without this option. */
+// #define STROBE_INT
+
+//! Split monitor transactions
+/*! If defined, with STROBE_INT, monitor requests are also left to the strobe
+	interrupt once the link is up: the CAN interrupt queues the monitor and
+	control requests for the link and returns without a response, so it never
+	waits for the ARCOM.  The next request starts as soon as the link is done
+	with the last one, and the main loop sends the replies with
+	amb_send_monitor.  A failed transaction is tried once more, and a second
+	failure, or a monitor request finding the queue full, gets an empty
+	response.  The split transactions count in the link health like the
+	blocking ones. */
+// #define SPLIT_MONITOR
+
+#define LINK_QUEUE_SIZE	8		//!< Requests waiting for the link with SPLIT_MONITOR
+#define LINK_REPLIES	4		//!< Replies of split transactions waiting to be sent by the main loop
+
+#if defined(SPLIT_MONITOR) && !defined(STROBE_INT)
+	#error SPLIT_MONITOR needs STROBE_INT
+#endif
+
+//! Tagged monitor requests on the parallel link
+/*! If defined, with SPLIT_MONITOR, a monitor request carries a tag and the
+	transaction ends with the request: LINK_TAGGED in place of the payload
+	length, then the tag.  The ARCOM works out the reply meanwhile, and the
+	main loop fetches the replies with GET_TAGGED_REPLY, which the ARCOM
+	answers with the tag and the reply of a request it is done with, in any
+	order, or with no reply while none is ready.  Control requests and other
+	monitor requests go over the link while up to \p TAG_SLOTS replies are
+	outstanding, so a slow point no longer holds up the fast ones.  A reply
+	not fetched within \p TAG_TIMEOUT ms is given up, and with every slot
+	taken a request is an untagged split transaction.  The ARCOM firmware
+	must know the tagged requests.  GET_TAGGED_REPLY is private to the link,
+	so no request of a CAN master is taken for a fetch, and LINK_CRC is
+	needed, so a tag corrupted on the link never sends a reply to the
+	wrong request. */
+// #define LINK_TAGS
+
+#define TAG_SLOTS		4		//!< Tagged monitor requests outstanding at once
+#define TAG_TIMEOUT		20		//!< Time in ms to fetch the reply of a tagged request
+#define TAG_POLL_GAP	20		//!< Time in us between two fetches while no reply is ready
+
+#if defined(LINK_TAGS) && !defined(SPLIT_MONITOR)
+	#error LINK_TAGS needs SPLIT_MONITOR
+#endif
+
+#if defined(LINK_TAGS) && !defined(LINK_CRC)
+	#error LINK_TAGS needs LINK_CRC
+#endif
+
+//! Checked frames on the parallel link
+/*! If defined, every frame on the link ends with a CRC-8 (polynomial 0x07):
+	the request of the AMBSI1 over the RCA, the length and the payload, the
+	reply of the ARCOM to a monitor request over the RCA asked for, the reply
+	length and the reply.  The AMBSI1 answers each reply with LINK_ACK, or with
+	LINK_NAK to have the ARCOM send only the reply again, up to \p LINK_NAKS
+	times, and then gives up with LINK_ABORT.  The ARCOM answers a monitor
+	request failing its check with LINK_NAK in place of the reply length and
+	drops a control request failing it.  A monitor request left without a
+	checked reply gets an empty response on the CAN bus, never an unchecked one. */
+// #define LINK_CRC
+
+#define LINK_NAKS		2		//!< Times a reply failing its check is asked for again
+
+//! Circuit breaker on the parallel link
+/*! If defined, \p BREAKER_FAILURES monitor transactions failing in a row open
+	the breaker: for \p BREAKER_COOLDOWN ms requests for the ARCOM fail at once,
+	without waiting on the link: monitor requests get an empty response and
+	control requests are dropped.  After the
+	cool-down the breaker is half open and the next monitor transaction is a
+	probe with a single try: an answer closes the breaker, a failure opens it
+	again for another cool-down.  A dead or rebooting ARCOM then costs one
+	probe per cool-down instead of two full transactions per request. */
+// #define LINK_BREAKER
+
+#define BREAKER_FAILURES	3		//!< Monitor transactions failing in a row which open the breaker
+#define BREAKER_COOLDOWN	500		//!< Time the breaker stays open in ms, within the 1.68 s wrap of the slow timer
 
 //! Is the firmware using the 48 ms pulse?
 /*! Defines if the 48ms pulse is used to trigger the correponding interrupt.
@@ -28,8 +194,85 @@
 	 	  	xilinx chip to allow the incoming pulse to be passed throught. */
 // #define USE_48MS
 
+//! Deferred processing of CAN requests
+/*! If defined, the CAN interrupt only queues each request (see amb_set_deferred)
+	and the main loop runs the transactions with the ARCOM board through
+	amb_service. The interrupt is then short enough that back to back requests
+	are not overwritten in message object 15 while a transaction is running. */
+// #define DEFERRED_CAN
+
+//! Receive FIFO in the spare CAN message objects
+/*! If defined, message objects 4 to 11 receive the requests as a hardware FIFO
+	(see amb_set_rx_fifo), so a burst of up to eight requests on consecutive
+	RCAs is held by the 82527 while a transaction is running.  Requests to
+	different RCAs which arrive during the same transaction may then be
+	forwarded out of order, control requests included: leave it undefined
+	if the order of back to back writes to different RCAs matters. */
+// #define CAN_RX_FIFO
+
 #define MAX_CAN_MSG_PAYLOAD			8		// Max CAN message payload size. Used to determine if error occurred
 
+/* Registrations of the options defined, all of them in the special RCAs */
+#ifdef STROBE_INT
+	#define STROBE_INT_REGS		1	// GET_LINK_TIMERS_RCA
+#else
+	#define STROBE_INT_REGS		0
+#endif
+#ifdef SPLIT_MONITOR
+	#define SPLIT_MONITOR_REGS	1	// GET_LINK_SPLIT_RCA
+#else
+	#define SPLIT_MONITOR_REGS	0
+#endif
+#ifdef LINK_TAGS
+	#define LINK_TAGS_REGS		1	// GET_LINK_TAGS_RCA
+#else
+	#define LINK_TAGS_REGS		0
+#endif
+#ifdef LINK_CRC
+	#define LINK_CRC_REGS		1	// GET_LINK_CHECK_RCA
+#else
+	#define LINK_CRC_REGS		0
+#endif
+#ifdef LINK_BREAKER
+	#define LINK_BREAKER_REGS	1	// GET_LINK_BREAKER_RCA
+#else
+	#define LINK_BREAKER_REGS	0
+#endif
+#ifdef ADAPTIVE_TIMEOUT
+	#define ADAPTIVE_TIMEOUT_REGS	1	// GET_PHASE_TIMEOUTS_RCA on
+#else
+	#define ADAPTIVE_TIMEOUT_REGS	0
+#endif
+#ifdef MONITOR_CACHE
+	#define MONITOR_CACHE_REGS	2	// GET_CACHE_COUNTS_RCA on, SET_CACHE_RANGE_RCA on
+#else
+	#define MONITOR_CACHE_REGS	0
+#endif
+#ifdef CONTROL_QUEUE
+	#define CONTROL_QUEUE_REGS	2	// GET_CONTROL_QUEUE_RCA on, SET_COALESCE_RANGE_RCA on
+#else
+	#define CONTROL_QUEUE_REGS	0
+#endif
+#ifdef BATCH_MONITOR
+	#define BATCH_MONITOR_REGS	2	// GET_BATCH_RCA on, SET_BATCH_RCA on
+#else
+	#define BATCH_MONITOR_REGS	0
+#endif
+#define OPTION_REGS	(STROBE_INT_REGS + SPLIT_MONITOR_REGS + LINK_TAGS_REGS + LINK_CRC_REGS + LINK_BREAKER_REGS + ADAPTIVE_TIMEOUT_REGS + MONITOR_CACHE_REGS + CONTROL_QUEUE_REGS + BATCH_MONITOR_REGS)
+
+//! Number of elements set aside for the AMB library callback table
+/*! The RCA ranges received from the ARCOM are split around the RCAs served
+    locally by the AMBSI1 and each part takes one element of the table.  So
+    each registration in the special RCAs (7 of them, and those of the
+    options defined) takes its own element and may split one more part off
+    the ARCOM range it falls in.  The ambient temperature at 0x30003 and the
+    four ARCOM ranges take one element each.  With every option defined this
+    sets aside 43 elements, of which the ranges of the simulated ARCOM use
+    29.  Only the ambient temperature, the version, GET_SETUP_INFO, the batch
+    monitor request and the four ARCOM ranges have counters: at most 9 of
+    AMB_STATS_RANGES. */
+#define MAX_CALLBACKS (1 + 4 + 2 * (7 + OPTION_REGS))
+
 //! \b 0x20000 -> Base address for the special monitor RCAs
 /*! This is the starting relative %CAN address for the special monitor
     requests available in the firmware. */
@@ -46,47 +289,156 @@
 #define GET_LO_PA_LIMITS_TABLE_ESN  0x20010L    //!< 0x20010 through 0x20019 return the PA LIMITS table ESNs.
 #define GET_MON_TIMERS1_RCA         0x20020L    //!< Get monitor timing countdown registers 1-4.
 #define GET_MON_TIMERS2_RCA         0x20021L    //!< Get monitor timing countdown registers 5-8.
+#define GET_RANGE_STATS_INFO_RCA    0x20022L    //!< Get the number of ranges with counters and the histogram timer tick.
+#define GET_PHASE_TIMEOUTS_RCA      0x20024L    //!< 0x20024 through 0x20027 return the adaptive timeout of each phase.
+#define GET_PHASE_ESTIMATES_RCA     0x20028L    //!< 0x20028 through 0x2002F return the learned mean and deviation of each phase.
+#define GET_LINK_HEALTH_RCA         0x200A0L    //!< 0x200A0 through 0x200A3 return the cumulative outcome of the monitor transactions.
+#define GET_PHASE_HEALTH_RCA        0x200A4L    //!< 0x200A4 through 0x200AA return the cumulative wait of each phase.
+#define GET_CACHE_COUNTS_RCA        0x20070L    //!< Get the monitor cache hits and misses.
+#define GET_CACHE_EVICTS_RCA        0x20071L    //!< Get the monitor cache evictions and invalidations.
+#define GET_CACHE_USAGE_RCA         0x20072L    //!< Get the monitor cache entries in use and size.
+#define GET_PREFETCH_COUNTS_RCA     0x20073L    //!< Get the prefetch polls, failures and passes held back by the budget.
+#define GET_CACHE_RANGE_RCA         0x20074L    //!< 0x20074 through 0x20077 return cached range n and its time to live.
+#define GET_PREFETCH_RCA            0x20078L    //!< 0x20078 through 0x2007F return prefetched point n and its period.
+#define GET_CONTROL_QUEUE_RCA       0x20080L    //!< Get the control queue depth, drops and requests forwarded in the last second.
+#define GET_CONTROL_COUNTS_RCA      0x20081L    //!< Get the control requests forwarded from the queue and coalesced in it.
+#define GET_COALESCE_RANGE_RCA      0x20084L    //!< 0x20084 through 0x20087 return coalesced range n.
+#define GET_BATCH_RCA               0x20088L    //!< 0x20088 through 0x2008F return the RCA n of the batch.
+#define RUN_BATCH_RCA               0x20090L    //!< Read the RCAs of the batch and return how many were answered.
+#define GET_LINK_TIMERS_RCA         0x20091L    //!< Get the timing of the last transaction run by the strobe interrupt.
+#define GET_LINK_CHECK_RCA          0x20092L    //!< Get the replies asked for again, given up and the requests refused by the ARCOM.
+#define GET_LINK_BREAKER_RCA        0x20093L    //!< Get the state of the circuit breaker and its transitions.
+#define GET_LINK_SPLIT_RCA          0x20094L    //!< Get the split monitor transactions started, answered, tried again and failed.
+#define GET_LINK_TAGS_RCA           0x20095L    //!< Get the tagged monitor requests sent, answered, answered out of order and given up.
+#define SET_CACHE_RANGE_RCA         0x21074L    //!< 0x21074 through 0x21077 set cached range n and its time to live.
+#define SET_PREFETCH_RCA            0x21078L    //!< 0x21078 through 0x2107F set prefetched point n and its period.
+#define SET_COALESCE_RANGE_RCA      0x21084L    //!< 0x21084 through 0x21087 set coalesced range n.
+#define SET_BATCH_RCA               0x21088L    //!< 0x21088 through 0x2108F set the RCA n of the batch.
+#define GET_RANGE_LIMITS_RCA        0x20030L    //!< 0x20030 + n: first and last RCA of registered range n.
+#define GET_RANGE_COUNTS_RCA        0x20040L    //!< 0x20040 + n: hits and errors of registered range n.
+#define GET_RANGE_HISTO1_RCA        0x20050L    //!< 0x20050 + n: latency histogram bins 0-3 of registered range n.
+#define GET_RANGE_HISTO2_RCA        0x20060L    //!< 0x20060 + n: latency histogram bins 4-7 of registered range n.
+
+//! \b 0x40000 -> Base address for the RCAs private to the link
+/*! Relative addresses above 0x3FFFF cannot be reached from the CAN bus, so the
+    requests the AMBSI1 sends the ARCOM on its own behalf use them: they never
+    collide with a point of the ARCOM firmware nor come from a CAN master. */
+
+#define BASE_LINK_RCA               0x40000L
+#define GET_ALL_RCA_RANGES          0x40007L	//!< Get the four ranges of GET_SPECIAL_MONITOR_RCAS to GET_CONTROL_RCAS in one transaction, from ARCOM firmware which knows it.
+#define GET_TAGGED_REPLY            0x40008L	//!< Get the tag and reply of a tagged monitor request the ARCOM is done with (LINK_TAGS).
 
 /* Version Info */
 #define VERSION_MAJOR 01	//!< Major Version
-#define VERSION_MINOR 02	//!< Minor Revision
+#define VERSION_MINOR 03	//!< Minor Revision
 #define VERSION_PATCH 00	//!< Patch Level
 
-/* Uses serial port */
-#include <reg167.h>
-#include <intrins.h>
-
 /* include library interface */
-#include "..\libraries\amb\amb.h"
-#include "..\libraries\ds1820\ds1820.h"
+#include "../libraries/amb/amb.h"
+#include "../libraries/hal/hal.h"
+#include "../libraries/ds1820/ds1820.h"
 
 /* Set aside memory for the callbacks in the AMB library */
-static CALLBACK_STRUCT idata cb_memory[7];
+static CALLBACK_STRUCT idata cb_memory[MAX_CALLBACKS];
 
 /* CAN message callbacks */
 int ambient_msg(CAN_MSG_TYPE *message); 	//!< Called to get the board temperature temperature
 int controlMsg(CAN_MSG_TYPE *message);  	//!< Called to handle CAN control messages
+int forwardControl(CAN_MSG_TYPE *message);	//!< Forward a control message to the ARCOM
 int monitorMsg(CAN_MSG_TYPE *message);  	//!< Called to handle CAN monitor messages 
+int monitorTries(CAN_MSG_TYPE *message);	//!< Monitor transaction with its retry
+int implMonitorSingle(CAN_MSG_TYPE *message, const unsigned int *timeout); //!< One try of a monitor transaction
+int implMonitorChecked(CAN_MSG_TYPE *message, const unsigned int *timeout, unsigned char crc); //!< Reply of a monitor transaction, asked for again on a bad check
+int implMonitorReply(CAN_MSG_TYPE *message, const unsigned int *timeout, unsigned char crc); //!< Reply of a monitor transaction
 int getSetupInfo(CAN_MSG_TYPE *message);  	//!< Called to get the AMBSI1 <-> ARCOM link/setup information 
 int getVersionInfo(CAN_MSG_TYPE *message);	//!< Called to get firmware version informations 
 int getMonTimers1(CAN_MSG_TYPE *message);    //!< Retrieve last monitor message timers
 int getMonTimers2(CAN_MSG_TYPE *message);    //!< Retrieve last monitor message timers
+int getRangeStatsInfo(CAN_MSG_TYPE *message); //!< Retrieve the layout of the per range counters
+int getRangeStats(CAN_MSG_TYPE *message);    //!< Retrieve the counters of one registered range
+int getPhaseTimeouts(CAN_MSG_TYPE *message); //!< Retrieve the adaptive timeouts and their estimates
+int getLinkHealth(CAN_MSG_TYPE *message);    //!< Retrieve the cumulative link statistics
+void linkHealthTry(int ret, const unsigned int *timeout); //!< Account for one try of a monitor transaction
+void backgroundTasks(void);                 //!< Work done by the main loop besides reading the temperature
+
+#ifdef LINK_CRC
+	/* Status of a reply, sent back by the AMBSI1 */
+	#define LINK_ACK		0x06
+	#define LINK_NAK		0x15	// Also the reply length of a request failing its check
+	#define LINK_ABORT		0x18
+
+	/* Bytes added to a frame by its check */
+	#define LINK_CHECK_LEN	1
+
+	/* CRC-8 of an RCA, which the check of a reply starts from */
+	#define CRC_RCA(RCA)	crcRCA(RCA)
+
+	/* Fold BYTE into the CRC-8 in CRC */
+	#define CRC8(CRC, BYTE)	((CRC) = crc8Table[(unsigned char) ((CRC) ^ (BYTE))])
+
+	static const unsigned char crc8Table[256] = {
+	0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+	0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+	0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+	0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+	0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+	0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+	0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+	0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+	0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+	0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+	0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+	0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+	0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+	0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+	0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+	0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+	};
+
+	/* Replies asked for again and given up, requests refused by the ARCOM */
+	static unsigned int crcNaks, crcGiveUps, crcRejects;
+
+	unsigned char crcRCA(unsigned long rca);
+	unsigned char crcRequest(CAN_MSG_TYPE *message);
+	int sendReplyStatus(unsigned char status, unsigned int timeout);
+	int getLinkCheck(CAN_MSG_TYPE *message);
+#else
+	#define LINK_CHECK_LEN	0
+	#define CRC_RCA(RCA)	0
+#endif // LINK_CRC
+
+#ifdef LINK_BREAKER
+	/* States of the circuit breaker */
+	#define BREAKER_CLOSED		0
+	#define BREAKER_OPEN		1
+	#define BREAKER_HALF_OPEN	2
+
+	/* Is the next monitor transaction a probe of the half open breaker? */
+	#define BREAKER_PROBING	(breakerState == BREAKER_HALF_OPEN)
+
+	/* The cool-down in slow timer ticks */
+	#define BREAKER_COOLDOWN_TICKS	((uword) (BREAKER_COOLDOWN * 1000000L / HAL_SLOW_TIMER_NS_PER_TICK))
+
+	static unsigned char breakerState;
+	static unsigned char breakerFailures;	// Monitor transactions failed in a row
+	static uword breakerOpened;				// Slow timer when the breaker opened
+	static unsigned int breakerTrips;		// Times the breaker opened
+	static unsigned int breakerRecoveries;	// Times a probe closed it
+	static unsigned int breakerFastFails;	// Requests failed or dropped while it was open
+
+	unsigned char breakerAllows(void);
+	void breakerResult(int ret);
+	void breakerPoll(void);
+	int getLinkBreaker(CAN_MSG_TYPE *message);
+#else
+	#define BREAKER_PROBING	0
+#endif // LINK_BREAKER
 
 /* A global for the last read temperature */
 static ubyte idata ambient_temp_data[4];
 
-/* External bus control signal buffer chip enable is on P4.7 */
-sbit  DISABLE_EX_BUF	= P4^7;
-
-/* Arcom Parallel port connection lines */
-sbit  WRITE				= P2^2;
-sbit  DSTROBE			= P2^3;
-sbit  WAIT				= P2^8;
-sbit  INT				= P2^7;
-sbit  SELECT			= P2^10;
-sbit  INIT				= P2^5;
-
-/* Separate timers for each phase of monitor transaction */
+/* Separate timers for each phase of monitor transaction: HAL timer ticks
+   spent waiting for the data strobe, MAX_TIMEOUT_TICKS or more on timeout */
 static unsigned int monTimer1;
 static unsigned int monTimer2;
 static unsigned int monTimer3;
@@ -95,9 +447,325 @@ static unsigned int monTimer5;
 static unsigned int monTimer6;
 static unsigned int monTimer7;
 
+/* Start of the current handshake wait */
+static uword handshakeStart;
+
 /* Macro to implement FULL_HANDSHAKE */
-// Wait for Data Strobe to go low
-#define IMPL_HANDSHAKE(TIMER) for(TIMER = MAX_TIMEOUT; TIMER && DSTROBE; TIMER--) {}
+// Wait for Data Strobe to go low, leaving the ticks waited in TIMER
+#define IMPL_HANDSHAKE(TIMER) IMPL_HANDSHAKE_LIMIT(TIMER, MAX_TIMEOUT_TICKS)
+#define IMPL_HANDSHAKE_LIMIT(TIMER, LIMIT) for(handshakeStart = HAL_TIMER_READ(); (TIMER = (uword) (HAL_TIMER_READ() - handshakeStart)) < (LIMIT) && HAL_ARCOM_DSTROBE(); ) {}
+
+/* Did the handshake leaving TIMER give up waiting after LIMIT ticks? */
+#define HANDSHAKE_TIMED_OUT(TIMER, LIMIT) ((TIMER) >= (LIMIT))
+
+/* End the try of a monitor transaction at a timeout in the request phases.
+   Only with ADAPTIVE_TIMEOUT, which drops INT before the retry: otherwise the
+   request is sent out whole, as it always was. */
+#ifdef ADAPTIVE_TIMEOUT
+	#define GIVE_UP_IF_TIMED_OUT(TIMER, LIMIT) do { if (HANDSHAKE_TIMED_OUT(TIMER, LIMIT)) return -1; } while (0)
+#else
+	#define GIVE_UP_IF_TIMED_OUT(TIMER, LIMIT) do { } while (0)
+#endif
+
+/* Phases of a monitor transaction: 4 RCA bytes, length, reply length, payload */
+#define MONITOR_PHASES		7
+#define REPLY_LENGTH_PHASE	5	// Index of the reply length phase
+
+/* Cumulative health of the link since power up, for GET_LINK_HEALTH_RCA */
+static unsigned long healthTransactions;	// Monitor transactions
+static unsigned long healthFirstTry;		// Answered on the first try
+static unsigned long healthRetry;			// Answered on the retry
+static unsigned long healthFailed;			// Not answered
+static unsigned int healthLenRejects;		// Reply length above MAX_CAN_MSG_PAYLOAD
+static unsigned int healthTimeouts[MONITOR_PHASES];	// Tries given up in each phase
+
+/* Ticks waited in each phase of the answered tries.  Sum and samples are
+   halved when the samples reach 0xFFFF, so the mean follows the last
+   32768 to 65535 answers. */
+static unsigned int healthMin[MONITOR_PHASES];
+static unsigned int healthMax[MONITOR_PHASES];
+static unsigned long healthSum[MONITOR_PHASES];
+static unsigned int healthSamples[MONITOR_PHASES];
+
+/* Classes of RCA with their own estimates: standard and special */
+#define RCA_CLASSES			2
+#define RCA_CLASS(RCA)		((RCA) >= BASE_SPECIAL_MONITOR_RCA ? 1 : 0)
+
+#ifdef STROBE_INT
+	/* States of the transaction run by the strobe interrupt */
+	#define LINK_IDLE		0
+	#define LINK_BUSY		1
+	#define LINK_FAILED		2
+
+	/* RCA (4 bytes) and payload length */
+	#define LINK_HEADER_LEN	5
+
+	/* Start of the reply of a monitor request, after the header and its check */
+	#define LINK_REPLY		(LINK_HEADER_LEN + LINK_CHECK_LEN)
+
+	#ifdef LINK_TAGS
+		/* Payload length of a tagged monitor request, which the tag follows */
+		#define LINK_TAGGED		0x80
+
+		/* Bytes added to a reply by its tag: the tag of a fetched reply */
+		#define LINK_TAG_LEN	1
+	#else
+		#define LINK_TAG_LEN	0
+	#endif // LINK_TAGS
+
+	/* Register bank of the strobe interrupt */
+	#define LINK_BANK		LINK_REGS
+
+	/* Transaction run by the strobe interrupt.  Like a PEC channel, each edge
+	   moves the byte at ptr and counts down count; only at the end of a run of
+	   bytes in one direction does linkNextRun decide what comes next. */
+	typedef struct {
+		CAN_MSG_TYPE	msg;		// Copy of the request, and the reply of a monitor request
+		unsigned char	bytes[LINK_REPLY + 1 + LINK_TAG_LEN + MAX_CAN_MSG_PAYLOAD + 2 * LINK_CHECK_LEN];	// Header, then the payload or the reply length and reply, with LINK_CRC the checks and the status of the reply
+		unsigned char	*ptr;		// Next byte to move
+		unsigned char	count;		// Bytes left in this run
+		unsigned char	dirIn;		// Run read from the ARCOM
+		unsigned char	state;
+		unsigned char	naks;		// Times the reply was asked for again
+		unsigned char	tag;		// Tag of a tagged request, or of a fetched reply
+		uword			first;		// HAL timer at the start
+		uword			last;		// HAL timer at the start or the last byte
+		uword			busy;		// HAL timer ticks spent in linkStrobe
+		#ifdef SPLIT_MONITOR
+			uword		wait[MONITOR_PHASES];	// HAL timer ticks waited for the last byte of each phase
+		#endif
+	} LINK_TRANSACTION;
+
+	static LINK_TRANSACTION linkXfer;
+
+	/* Timing of the last transaction run by the strobe interrupt, in HAL timer ticks */
+	static uword linkSpan, linkBusy;
+	static unsigned char linkBytes;
+
+	void linkStrobe(void);
+	void linkStart(CAN_MSG_TYPE *message, unsigned char tag);
+	void linkNextRun(void);
+	void linkFinish(unsigned char state);
+	unsigned char linkReplyStatus(void);
+	int getLinkTimers(CAN_MSG_TYPE *message);
+	unsigned char linkPoll(void);
+	void linkWaitIdle(void);
+
+	#ifdef SPLIT_MONITOR
+		/* Phase of the byte at INDEX in linkXfer.bytes, as timed by the blocking handshake */
+		#define LINK_PHASE(INDEX)	((INDEX) < LINK_HEADER_LEN ? (INDEX) : (INDEX) < LINK_REPLY ? LINK_HEADER_LEN - 1 : (INDEX) == LINK_REPLY ? REPLY_LENGTH_PHASE : MONITOR_PHASES - 1)
+
+		/* Requests waiting for the link, queued by the CAN interrupt */
+		static CAN_MSG_TYPE linkQueue[LINK_QUEUE_SIZE];
+		static unsigned char linkQueueHead, linkQueueDepth;
+
+		/* Replies waiting to be sent by the main loop */
+		static CAN_MSG_TYPE linkReply[LINK_REPLIES];
+		static unsigned char linkReplyHead, linkReplyDepth;
+
+		/* The split monitor transaction in linkXfer */
+		static bit splitPending;		// Its result is still to be looked at
+		static bit splitRetried;		// It was tried again
+		#ifdef MONITOR_CACHE
+			static unsigned int splitTTL;	// Time to live of its reply
+		#endif
+		static unsigned int splitRequests, splitAnswered, splitRetries, splitFailed;
+
+		int linkSubmit(CAN_MSG_TYPE *message);
+		unsigned char linkNext(void);
+		unsigned char linkComplete(void);
+		unsigned char splitDone(void);
+		void linkHealthXfer(int ret);
+		void linkReplyPut(CAN_MSG_TYPE *message);
+		void linkSendReplies(void);
+		int getLinkSplit(CAN_MSG_TYPE *message);
+
+		/* Look at the transaction done, 1 if another one was started */
+		#define LINK_COMPLETE()		linkComplete()
+
+		/* Room for the reply of the transaction done */
+		#define LINK_MAKE_ROOM()	do { if (linkReplyDepth == LINK_REPLIES) linkSendReplies(); } while (0)
+	#else
+		#define LINK_COMPLETE()		0
+		#define LINK_MAKE_ROOM()
+	#endif // SPLIT_MONITOR
+
+	#ifdef LINK_TAGS
+		/* TAG_TIMEOUT and TAG_POLL_GAP in slow and HAL timer ticks */
+		#define TAG_TIMEOUT_TICKS	((uword) (TAG_TIMEOUT * 1000000L / HAL_SLOW_TIMER_NS_PER_TICK))
+		#define TAG_POLL_TICKS		((uword) (TAG_POLL_GAP * 1000L / HAL_TIMER_NS_PER_TICK))
+
+		/* One tagged monitor request waiting for its reply */
+		typedef struct {
+			unsigned long	rca;
+			unsigned int	seq;		// Order in which the requests were sent
+			uword			sent;		// Slow timer when it was sent
+			#ifdef MONITOR_CACHE
+				unsigned int	ttl;	// Time to live of its reply
+			#endif
+			unsigned char	tag;		// 0 -> slot free
+		} LINK_TAG;
+
+		static LINK_TAG linkTag[TAG_SLOTS];
+		static unsigned char tagNext;		// Last tag given out
+		static unsigned int tagSeq;			// Requests tagged so far
+		static unsigned char tagOutstanding;	// Slots in use
+		static bit tagPending;				// The tagged request or fetch in linkXfer is still to be looked at
+		static uword tagPolled;				// HAL timer at the last fetch
+		static unsigned int tagRequests, tagAnswered, tagOutOfOrder, tagGivenUp;
+
+		unsigned char tagStart(CAN_MSG_TYPE *message);
+		unsigned char tagDone(void);
+		void tagExpire(void);
+		void tagRelease(LINK_TAG *slot);
+		int getLinkTags(CAN_MSG_TYPE *message);
+	#endif // LINK_TAGS
+
+	/* A blocking transaction must not start in the middle of one run by the interrupt */
+	#define LINK_WAIT_IDLE()	linkWaitIdle()
+#else
+	#define LINK_WAIT_IDLE()
+#endif // STROBE_INT
+
+/* Timeouts of the retry, and of the first try without ADAPTIVE_TIMEOUT */
+static const unsigned int fullTimeouts[MONITOR_PHASES] = {
+	MAX_TIMEOUT_TICKS, MAX_TIMEOUT_TICKS, MAX_TIMEOUT_TICKS, MAX_TIMEOUT_TICKS,
+	MAX_TIMEOUT_TICKS, MAX_TIMEOUT_TICKS, MAX_TIMEOUT_TICKS
+};
+
+#ifdef ADAPTIVE_TIMEOUT
+	/* Learned ARCOM response time of one phase, in HAL timer ticks */
+	typedef struct {
+		unsigned int	mean8;		// Running mean, times 8
+		unsigned int	dev4;		// Running mean deviation, times 4
+		unsigned char	samples;	// Answers learned from, up to 255
+	} PHASE_ESTIMATE;
+
+	static PHASE_ESTIMATE phaseEstimate[RCA_CLASSES][MONITOR_PHASES];
+	static unsigned int phaseTimeout[RCA_CLASSES][MONITOR_PHASES];
+
+	void learnTimeouts(unsigned char rcaClass, unsigned char phases);
+#endif // ADAPTIVE_TIMEOUT
+
+#ifdef MONITOR_CACHE
+	/* One cached reply of the ARCOM */
+	typedef struct {
+		unsigned long	rca;
+		unsigned int	stamp;		// Slow timer when stored
+		unsigned int	ttl;		// Slow timer ticks it stays valid
+		unsigned char	valid;
+		unsigned char	len;
+		unsigned char	data[MAX_CAN_MSG_PAYLOAD];
+	} CACHE_ENTRY;
+
+	/* One range of RCAs whose replies are cached */
+	typedef struct {
+		unsigned long	lowest;
+		unsigned long	highest;
+		unsigned int	ttl;		// Milliseconds, 0 -> range not used
+	} CACHE_RANGE;
+
+	static CACHE_ENTRY cacheEntry[CACHE_SIZE];
+	static CACHE_RANGE cacheRange[CACHE_RANGES];
+	static unsigned long cacheHits, cacheMisses, cacheEvictions, cacheInvalidations;
+
+	int getCacheInfo(CAN_MSG_TYPE *message);
+	int setCacheRange(CAN_MSG_TYPE *message);
+	unsigned int cacheTTL(unsigned long rca);
+	int cacheLookup(CAN_MSG_TYPE *message);
+	void cacheStore(CAN_MSG_TYPE *message, unsigned int ttl);
+	void cacheInvalidate(unsigned long rca);
+	void cacheExpire(void);
+#endif // MONITOR_CACHE
+
+#ifdef PREFETCH
+	/* One point kept warm by the poller */
+	typedef struct {
+		unsigned long	rca;
+		unsigned int	periodMs;	// 0 -> entry not used
+		unsigned int	period;		// Slow timer ticks between polls
+		unsigned int	last;		// Slow timer at the last poll
+	} PREFETCH_ENTRY;
+
+	static PREFETCH_ENTRY prefetchEntry[PREFETCH_SIZE];
+	static CAN_MSG_TYPE prefetchMsg;
+	static unsigned char prefetchNext;		// Entry to look at first
+	static unsigned char prefetchPoint;		// Entry of the poll in linkXfer
+	static bit prefetchPending;				// The poll in linkXfer is still to be looked at
+	static uword prefetchIdleFrom;			// HAL timer at the end of the last poll
+	static uword prefetchGap;				// HAL timer ticks to stay off the link after it
+	static unsigned long prefetchPolls;
+	static unsigned int prefetchFailures, prefetchHeld;
+
+	int setPrefetch(CAN_MSG_TYPE *message);
+	void prefetchPoll(void);
+	void prefetchDone(void);
+
+	/* Store the reply of a poll before the link is used again */
+	#define PREFETCH_DONE()		prefetchDone()
+#else
+	#define PREFETCH_DONE()
+#endif // PREFETCH
+
+#ifdef CONTROL_QUEUE
+	/* One second in slow timer ticks, to measure the drain rate */
+	#define CONTROL_RATE_TICKS	((uword) (1000000000L / HAL_SLOW_TIMER_NS_PER_TICK))
+
+	static CAN_MSG_TYPE controlQueue[CONTROL_QUEUE_SIZE];
+	static unsigned char controlHead;		// Oldest request in the queue
+	static unsigned char controlDepth;		// Requests in the queue
+	static unsigned char controlMaxDepth;	// Most requests ever in the queue
+	static unsigned int controlDrops;
+	static unsigned long controlForwarded;
+	static unsigned long controlRateBase;	// controlForwarded at controlRateStamp
+	static uword controlRateStamp;			// Slow timer at the start of the second
+	static unsigned int controlRate;		// Requests forwarded in the last second
+	static unsigned long controlCoalesced;
+
+	/* One range of RCAs whose queued requests are coalesced */
+	typedef struct {
+		unsigned long	lowest;
+		unsigned long	highest;		// 0 -> range not used
+	} COALESCE_RANGE;
+
+	static COALESCE_RANGE coalesceRange[COALESCE_RANGES];
+
+	int getControlQueue(CAN_MSG_TYPE *message);
+	int setCoalesceRange(CAN_MSG_TYPE *message);
+	CAN_MSG_TYPE *controlPending(unsigned long rca);
+	void controlDrain(void);
+#endif // CONTROL_QUEUE
+
+#ifdef BATCH_MONITOR
+	static unsigned long batchRCA[BATCH_SIZE];	// 0 -> entry not used
+	static CAN_MSG_TYPE batchMsg;
+	static bit batchRunning;				// A request to RUN_BATCH_RCA is still to be answered
+	static unsigned char batchNext;			// Entry to read next
+	static unsigned char batchAnswered, batchFailed;
+	static uword batchStart;				// Slow HAL timer at the request
+
+	int getBatch(CAN_MSG_TYPE *message);
+	int setBatch(CAN_MSG_TYPE *message);
+	void batchRun(void);
+
+	#ifdef STROBE_INT
+		/* Result of the transaction of a batched RCA, looked at by batchDone */
+		#define BATCH_REPLIED	1		// Its reply is in batchMsg
+		#define BATCH_FAILED	2
+
+		static bit batchPending;				// The transaction in linkXfer is still to be looked at
+		static unsigned char batchResult;		// 0 -> none to be counted by batchRun
+
+		void batchDone(void);
+
+		/* Keep the reply of a batched RCA before the link is used again */
+		#define BATCH_DONE()	batchDone()
+	#endif // STROBE_INT
+#endif // BATCH_MONITOR
+
+#if !defined(BATCH_MONITOR) || !defined(STROBE_INT)
+	#define BATCH_DONE()
+#endif
 
 /* RCAs address ranges */
 static unsigned long idata lowestMonitorRCA,highestMonitorRCA,
@@ -108,6 +776,16 @@ static unsigned long idata lowestMonitorRCA,highestMonitorRCA,
 /* A global to fake CAN messages */
 static CAN_MSG_TYPE idata myCANMessage;
 
+/* RCA ranges received from the ARCOM: special monitor, special control, monitor and control */
+#define ARCOM_RANGES	4
+
+/* Set once the ARCOM answered GET_ALL_RCA_RANGES with anything but the ranges */
+static bit idata allRangesUnsupported;
+
+int getRanges(unsigned long ranges[][2]);
+int getAllRanges(unsigned long ranges[][2]);
+void decodeRange(unsigned long *range, unsigned char *data);
+
 /* Globals to check for initialization of RCA */
 static bit idata ready;			// is the communication between the ARCOM and AMBSI ready?
 static bit idata initialized;	// have the RCAs been initialized?
@@ -116,7 +794,7 @@ static bit idata initialized;	// have the RCAs been initialized?
 /*! Takes care of initializing the AMBSI1, the CAN subrutine and globally enables interrupts.
     version 1.2.0: also performs AMBSI1 to ARCOM link setup. */ 
 void main(void) {
-    unsigned long timer;
+	unsigned long timer;
 
 	#ifdef USE_48MS
 	  // Setup the CAPCOM2 unit to receive the 48ms pulse from the Xilinx
@@ -128,11 +806,10 @@ void main(void) {
 	#endif // USE_48MS
 
 	/* Make sure that external bus control signal buffer is disabled */
-	DP4 |= 0x01;
-	DISABLE_EX_BUF = 1;
+	HAL_DISABLE_EX_BUF();
 
 	/* Initialise the slave library */
-	if (amb_init_slave((void *) cb_memory) != 0) 
+	if (amb_init_slave((void *) cb_memory, MAX_CALLBACKS) != 0) 
 		return;
 
 	/* Register callbacks for CAN events */
@@ -143,54 +820,218 @@ void main(void) {
 	if (amb_register_function(GET_AMBSI1_VERSION_INFO, GET_AMBSI1_VERSION_INFO, getVersionInfo) != 0)
 		return;
 
-	/* Initialize ports for communication */
-	DP7=0x00;
-	DP7=0xFF;
-	P2=0x0000;
-	SELECT=1;
-	INIT=0;
-	DP2=0x0580; 
-
 	/* Register callbacks for CAN events (RCA -> 0x20001) */
 	if (amb_register_function(GET_SETUP_INFO, GET_SETUP_INFO, getSetupInfo) != 0)
 		return;
 
-    /* Register callbacks for monitor timers (RCA -> 0x20010, 0x20011) */
-    if (amb_register_function(GET_MON_TIMERS1_RCA, GET_MON_TIMERS1_RCA, getMonTimers1) != 0)
-        return;
+	/* The points reading back the state of this firmware go without counters,
+	   which are kept for the ranges carrying the M&C traffic */
+	amb_set_range_counters(FALSE);
 
-    if (amb_register_function(GET_MON_TIMERS2_RCA, GET_MON_TIMERS2_RCA, getMonTimers2) != 0)
-        return;
+	/* Initialize ports for communication */
+	HAL_ARCOM_PORT_INIT();
+
+	#ifdef STROBE_INT
+		/* The strobe interrupt stays off until a transaction is started */
+		HAL_ARCOM_STROBE_INT_INIT(linkStrobe);
+
+		/* Register callbacks for the strobe interrupt timing (RCA -> 0x20091) */
+		if (amb_register_function(GET_LINK_TIMERS_RCA, GET_LINK_TIMERS_RCA, getLinkTimers) != 0)
+			return;
+
+		#ifdef SPLIT_MONITOR
+			/* Register callbacks for the split monitor transactions (RCA -> 0x20094) */
+			if (amb_register_function(GET_LINK_SPLIT_RCA, GET_LINK_SPLIT_RCA, getLinkSplit) != 0)
+				return;
+		#endif // SPLIT_MONITOR
+
+		#ifdef LINK_TAGS
+			/* Register callbacks for the tagged monitor requests (RCA -> 0x20095) */
+			if (amb_register_function(GET_LINK_TAGS_RCA, GET_LINK_TAGS_RCA, getLinkTags) != 0)
+				return;
+		#endif // LINK_TAGS
+	#endif // STROBE_INT
+
+	#ifdef LINK_CRC
+		/* Register callbacks for the counters of the checked link (RCA -> 0x20092) */
+		if (amb_register_function(GET_LINK_CHECK_RCA, GET_LINK_CHECK_RCA, getLinkCheck) != 0)
+			return;
+	#endif // LINK_CRC
+
+	#ifdef LINK_BREAKER
+		/* Register callbacks for the circuit breaker (RCA -> 0x20093) */
+		if (amb_register_function(GET_LINK_BREAKER_RCA, GET_LINK_BREAKER_RCA, getLinkBreaker) != 0)
+			return;
+	#endif // LINK_BREAKER
+
+	/* Register callbacks for monitor timers (RCA -> 0x20010, 0x20011) */
+	if (amb_register_function(GET_MON_TIMERS1_RCA, GET_MON_TIMERS1_RCA, getMonTimers1) != 0)
+		return;
+
+	if (amb_register_function(GET_MON_TIMERS2_RCA, GET_MON_TIMERS2_RCA, getMonTimers2) != 0)
+		return;
+
+	/* Register callbacks for the per range counters (RCA -> 0x20022, 0x20030 to 0x2006F) */
+	if (amb_register_function(GET_RANGE_STATS_INFO_RCA, GET_RANGE_STATS_INFO_RCA, getRangeStatsInfo) != 0)
+		return;
+
+	if (amb_register_function(GET_RANGE_LIMITS_RCA, GET_RANGE_HISTO2_RCA + AMB_STATS_RANGES - 1, getRangeStats) != 0)
+		return;
+
+	/* Register callbacks for the cumulative link statistics (RCA -> 0x200A0 to 0x200AA) */
+	if (amb_register_function(GET_LINK_HEALTH_RCA, GET_PHASE_HEALTH_RCA + MONITOR_PHASES - 1, getLinkHealth) != 0)
+		return;
+
+	#ifdef ADAPTIVE_TIMEOUT
+		/* Start from the full timeout until the ARCOM has answered */
+		for (timer = 0; timer < RCA_CLASSES * MONITOR_PHASES; timer++)
+			phaseTimeout[timer / MONITOR_PHASES][timer % MONITOR_PHASES] = MAX_TIMEOUT_TICKS;
+
+		/* Register callbacks for the adaptive timeouts (RCA -> 0x20024 to 0x2002F) */
+		if (amb_register_function(GET_PHASE_TIMEOUTS_RCA, GET_PHASE_ESTIMATES_RCA + 4 * RCA_CLASSES - 1, getPhaseTimeouts) != 0)
+			return;
+	#endif // ADAPTIVE_TIMEOUT
+
+	#ifdef MONITOR_CACHE
+		/* Register callbacks for the monitor cache (RCA -> 0x20070 to 0x20077, 0x21074 to 0x21077)
+		   With PREFETCH the same functions handle the prefetched points (RCA -> 0x20078 to 0x2007F, 0x21078 to 0x2107F) */
+		#ifdef PREFETCH
+			if (amb_register_function(GET_CACHE_COUNTS_RCA, GET_PREFETCH_RCA + PREFETCH_SIZE - 1, getCacheInfo) != 0)
+				return;
+		#else
+			if (amb_register_function(GET_CACHE_COUNTS_RCA, GET_CACHE_RANGE_RCA + CACHE_RANGES - 1, getCacheInfo) != 0)
+				return;
+		#endif
+
+		#ifdef PREFETCH
+			if (amb_register_function(SET_CACHE_RANGE_RCA, SET_PREFETCH_RCA + PREFETCH_SIZE - 1, setCacheRange) != 0)
+				return;
+		#else
+			if (amb_register_function(SET_CACHE_RANGE_RCA, SET_CACHE_RANGE_RCA + CACHE_RANGES - 1, setCacheRange) != 0)
+				return;
+		#endif
+	#endif // MONITOR_CACHE
+
+	#ifdef CONTROL_QUEUE
+		/* Register callbacks for the control queue (RCA -> 0x20080 to 0x20087, 0x21084 to 0x21087) */
+		if (amb_register_function(GET_CONTROL_QUEUE_RCA, GET_COALESCE_RANGE_RCA + COALESCE_RANGES - 1, getControlQueue) != 0)
+			return;
+
+		if (amb_register_function(SET_COALESCE_RANGE_RCA, SET_COALESCE_RANGE_RCA + COALESCE_RANGES - 1, setCoalesceRange) != 0)
+			return;
+	#endif // CONTROL_QUEUE
+
+	/* The batch monitor request and the ARCOM ranges, registered by getSetupInfo, get counters */
+	amb_set_range_counters(TRUE);
+
+	#ifdef BATCH_MONITOR
+		/* Register callbacks for the batch monitor request (RCA -> 0x20088 to 0x20090, 0x21088 to 0x2108F) */
+		if (amb_register_function(GET_BATCH_RCA, RUN_BATCH_RCA, getBatch) != 0)
+			return;
+
+		if (amb_register_function(SET_BATCH_RCA, SET_BATCH_RCA + BATCH_SIZE - 1, setBatch) != 0)
+			return;
+	#endif // BATCH_MONITOR
+
+	#ifdef CAN_RX_FIFO
+		/* Spread the incoming requests over message objects 4 to 11 */
+		amb_set_rx_fifo(TRUE);
+	#endif // CAN_RX_FIFO
+
+	#ifdef DEFERRED_CAN
+		/* Requests are handled by the main loop and while the DS1820 converts */
+		amb_set_deferred(TRUE);
+	#endif // DEFERRED_CAN
+
+	#if defined(DEFERRED_CAN) || defined(MONITOR_CACHE) || defined(CONTROL_QUEUE) || defined(STROBE_INT)
+		ds1820_set_idle(backgroundTasks);
+	#endif
 
 	/* globally enable interrupts */
-  	amb_start();
+	amb_start();
 
 	/* Handshake readiness status with ARCOM board */
 	ready=0;
-	SELECT = 0; // Select line to 0
-	while(INIT){ // Wait of init line to go to 0. In the mean time read the temperature
+	HAL_ARCOM_SELECT(0); // Select line to 0
+	while(HAL_ARCOM_INIT()){ // Wait of init line to go to 0. In the mean time read the temperature
 		ds1820_get_temp(&ambient_temp_data[1], &ambient_temp_data[0], &ambient_temp_data[2], &ambient_temp_data[3]);
 	}
-    ready=1;
-
-    /* Loop until the AMBSI1 to ARCOM link is established */
-    while(!initialized) {
-        /* Process a fake GET_SETUP_INFO request */
-        myCANMessage.dirn=CAN_MONITOR;
-        myCANMessage.len=0;
-        myCANMessage.relative_address=GET_SETUP_INFO;
-        if(getSetupInfo(&myCANMessage)) {
-            // if timed out, sleep a bit:
-            for(timer = 100000L; timer; timer--) {}   // about 0.1 second
-        }
-    }
+	ready=1;
+
+	/* Loop until the AMBSI1 to ARCOM link is established */
+	while(!initialized) {
+		/* Process a fake GET_SETUP_INFO request */
+		myCANMessage.dirn=CAN_MONITOR;
+		myCANMessage.len=0;
+		myCANMessage.relative_address=GET_SETUP_INFO;
+		if(getSetupInfo(&myCANMessage)) {
+			// if timed out, sleep a bit:
+			for(timer = 100000L; timer; timer--) {}   // about 0.1 second
+		}
+		backgroundTasks();
+	}
 
 	/* Never return */
 	while (1) {
+		backgroundTasks();
 		ds1820_get_temp(&ambient_temp_data[1], &ambient_temp_data[0], &ambient_temp_data[2], &ambient_temp_data[3]);
 	}
 }
 
+/*! Work done by the main loop besides reading the temperature.
+	Also called while the DS1820 converts, so it is never held up for long. */
+void backgroundTasks(void) {
+	#ifdef LINK_BREAKER
+		/* End the cool-down before the slow timer wraps over it */
+		breakerPoll();
+	#endif // LINK_BREAKER
+
+	#ifdef STROBE_INT
+		/* Give up a transaction the ARCOM stopped answering */
+		linkPoll();
+	#endif // STROBE_INT
+
+	#ifdef SPLIT_MONITOR
+		/* Look at the transaction done and start the next one */
+		linkComplete();
+	#endif // SPLIT_MONITOR
+
+	#ifdef LINK_TAGS
+		/* Give up the replies of the tagged monitor requests not fetched in time */
+		tagExpire();
+	#endif // LINK_TAGS
+
+	#ifdef SPLIT_MONITOR
+		/* Send the replies of the split monitor transactions */
+		linkSendReplies();
+	#endif // SPLIT_MONITOR
+
+	#ifdef DEFERRED_CAN
+		/* Run the CAN requests queued by the interrupt */
+		amb_service();
+	#endif // DEFERRED_CAN
+
+	#ifdef CONTROL_QUEUE
+		/* Forward the queued control requests */
+		controlDrain();
+	#endif // CONTROL_QUEUE
+
+	#ifdef BATCH_MONITOR
+		/* Read the RCAs of a batch request */
+		batchRun();
+	#endif // BATCH_MONITOR
+
+	#ifdef MONITOR_CACHE
+		/* Drop the expired replies before the slow timer wraps over them */
+		cacheExpire();
+	#endif // MONITOR_CACHE
+
+	#ifdef PREFETCH
+		/* Refresh one prefetched point if it is due */
+		prefetchPoll();
+	#endif // PREFETCH
+}
+
 
 
 /*! This function will return the firmware version for the AMBSI1 board.
@@ -205,35 +1046,1654 @@ int getVersionInfo(CAN_MSG_TYPE *message){
 }
 
 
-/*! return the timers for phases 1 through 4 of the last monitor request handled. */
+/*! return the timers for phases 1 through 4 of the last monitor request handled,
+    in microseconds spent waiting for the ARCOM. */
 int getMonTimers1(CAN_MSG_TYPE *message) {
-    message->data[1] = (unsigned char) (monTimer1);
-    message->data[0] = (unsigned char) (monTimer1 >> 8);
-    message->data[3] = (unsigned char) (monTimer2);
-    message->data[2] = (unsigned char) (monTimer2 >> 8);
-    message->data[5] = (unsigned char) (monTimer3);
-    message->data[4] = (unsigned char) (monTimer3 >> 8);
-    message->data[7] = (unsigned char) (monTimer4);
-    message->data[6] = (unsigned char) (monTimer4 >> 8);
+    unsigned int us;
+
+    us = TICKS_TO_US(monTimer1);
+    message->data[1] = (unsigned char) (us);
+    message->data[0] = (unsigned char) (us >> 8);
+    us = TICKS_TO_US(monTimer2);
+    message->data[3] = (unsigned char) (us);
+    message->data[2] = (unsigned char) (us >> 8);
+    us = TICKS_TO_US(monTimer3);
+    message->data[5] = (unsigned char) (us);
+    message->data[4] = (unsigned char) (us >> 8);
+    us = TICKS_TO_US(monTimer4);
+    message->data[7] = (unsigned char) (us);
+    message->data[6] = (unsigned char) (us >> 8);
     message->len=8;
     return 0;
 }
 
-/*! return the timers for phases 5, 6, 7 of the last monitor request handled.
-    the fourth byte is the starting countdown value MAX_TIMEOUT */
+/*! return the timers for phases 5, 6, 7 of the last monitor request handled,
+    in microseconds spent waiting for the ARCOM.
+    the fourth value is the timeout MAX_TIMEOUT in microseconds */
 int getMonTimers2(CAN_MSG_TYPE *message) {
-    message->data[1] = (unsigned char) (monTimer5);
-    message->data[0] = (unsigned char) (monTimer5 >> 8);
-    message->data[3] = (unsigned char) (monTimer6);
-    message->data[2] = (unsigned char) (monTimer6 >> 8);
-    message->data[5] = (unsigned char) (monTimer7);
-    message->data[4] = (unsigned char) (monTimer7 >> 8);
+    unsigned int us;
+
+    us = TICKS_TO_US(monTimer5);
+    message->data[1] = (unsigned char) (us);
+    message->data[0] = (unsigned char) (us >> 8);
+    us = TICKS_TO_US(monTimer6);
+    message->data[3] = (unsigned char) (us);
+    message->data[2] = (unsigned char) (us >> 8);
+    us = TICKS_TO_US(monTimer7);
+    message->data[5] = (unsigned char) (us);
+    message->data[4] = (unsigned char) (us >> 8);
     message->data[7] = (unsigned char) (MAX_TIMEOUT);
     message->data[6] = (unsigned char) (MAX_TIMEOUT >> 8);
     message->len=8;
     return 0;
 }
 
+/*! return the layout of the per range counters kept by the amb library:
+    the number of registered ranges with counters, the number of histogram
+    bins, the timer tick in ns and the width in ticks of the first bin.
+    Range n is the n-th registration with counters, counting from 0: the
+    ambient temperature, the version, GET_SETUP_INFO, the batch monitor
+    request with BATCH_MONITOR, then the four ARCOM ranges.  The points
+    reading back the state of this firmware have none. */
+int getRangeStatsInfo(CAN_MSG_TYPE *message) {
+    AMB_RANGE_STATS stats;
+    int ranges;
+
+    ranges = amb_get_range_stats(0, &stats);
+    message->data[0] = (unsigned char) (ranges < 0 ? 0 : ranges);
+    message->data[1] = AMB_STATS_BUCKETS;
+    message->data[3] = (unsigned char) (HAL_TIMER_NS_PER_TICK);
+    message->data[2] = (unsigned char) (HAL_TIMER_NS_PER_TICK >> 8);
+    message->data[4] = 1 << AMB_STATS_SHIFT;
+    message->len=5;
+    return 0;
+}
+
+/*! return the counters of the registered range given by the low 4 bits of the RCA:
+    - 0x2003n: first and last RCA of the range
+    - 0x2004n: requests handled (4 bytes) and callback errors (2 bytes)
+    - 0x2005n: latency histogram bins 0-3, 2 bytes each
+    - 0x2006n: latency histogram bins 4-7, 2 bytes each
+    Bin b counts the requests handled in less than (1 << b) times the first bin width. */
+int getRangeStats(CAN_MSG_TYPE *message) {
+    AMB_RANGE_STATS stats;
+    unsigned char i, first;
+
+    if (amb_get_range_stats((unsigned char) (message->relative_address & 0x0F), &stats) < 0) {
+        message->len=0;
+        return -1;
+    }
+
+    switch (message->relative_address & 0xFFFF0L) {
+        case GET_RANGE_LIMITS_RCA:
+            for (i = 0; i < 4; i++) {
+                message->data[3 - i] = (unsigned char) (stats.low_address >> (8 * i));
+                message->data[7 - i] = (unsigned char) (stats.high_address >> (8 * i));
+            }
+            message->len=8;
+            break;
+        case GET_RANGE_COUNTS_RCA:
+            message->data[3] = (unsigned char) (stats.hits);
+            message->data[2] = (unsigned char) (stats.hits >> 8);
+            message->data[1] = (unsigned char) (stats.hits >> 16);
+            message->data[0] = (unsigned char) (stats.hits >> 24);
+            message->data[5] = (unsigned char) (stats.errors);
+            message->data[4] = (unsigned char) (stats.errors >> 8);
+            message->len=6;
+            break;
+        default:
+            first = ((message->relative_address & 0xFFFF0L) == GET_RANGE_HISTO1_RCA) ? 0 : 4;
+            for (i = 0; i < 4; i++) {
+                message->data[2 * i + 1] = (unsigned char) (stats.histogram[first + i]);
+                message->data[2 * i] = (unsigned char) (stats.histogram[first + i] >> 8);
+            }
+            message->len=8;
+            break;
+    }
+    return 0;
+}
+
+/*! return the cumulative health of the link since power up:
+    - 0x200A0: monitor transactions and those answered on the first try (4 bytes each)
+    - 0x200A1: transactions answered on the retry and not answered (4 bytes each)
+    - 0x200A2: replies with a length above MAX_CAN_MSG_PAYLOAD, tries given up in phases 1 to 3
+    - 0x200A3: tries given up in phases 4 to 7
+    - 0x200A4 + n: least, mean and most microseconds waited in phase n + 1 by
+      the answered tries, and the answers the mean is taken over
+    All counts are 2 bytes unless stated. */
+int getLinkHealth(CAN_MSG_TYPE *message) {
+    unsigned char n, i;
+    unsigned long counts[2];
+    unsigned int values[4];
+
+    n = (unsigned char) (message->relative_address - GET_LINK_HEALTH_RCA);
+    if (n < 2) {
+        counts[0] = n ? healthRetry : healthTransactions;
+        counts[1] = n ? healthFailed : healthFirstTry;
+        for (i = 0; i < 4; i++) {
+            message->data[3 - i] = (unsigned char) (counts[0] >> (8 * i));
+            message->data[7 - i] = (unsigned char) (counts[1] >> (8 * i));
+        }
+        message->len=8;
+        return 0;
+    }
+
+    if (n == 2) {
+        values[0] = healthLenRejects;
+        for (i = 1; i < 4; i++)
+            values[i] = healthTimeouts[i - 1];
+    } else if (n == 3) {
+        for (i = 0; i < 4; i++)
+            values[i] = healthTimeouts[3 + i];
+    } else {
+        n -= 4;
+        values[0] = TICKS_TO_US(healthMin[n]);
+        values[1] = healthSamples[n] ? TICKS_TO_US(healthSum[n] / healthSamples[n]) : 0;
+        values[2] = TICKS_TO_US(healthMax[n]);
+        values[3] = healthSamples[n];
+    }
+    for (i = 0; i < 4; i++) {
+        message->data[2 * i + 1] = (unsigned char) (values[i]);
+        message->data[2 * i] = (unsigned char) (values[i] >> 8);
+    }
+    message->len=8;
+    return 0;
+}
+
+#ifdef ADAPTIVE_TIMEOUT
+/*! return the adaptive timeouts or the estimates they come from, in microseconds.
+    - 0x20024 + 2 * class: timeouts of phases 1 to 4
+    - 0x20025 + 2 * class: timeouts of phases 5 to 7, then MAX_TIMEOUT
+    - 0x20028 + 4 * class + n: mean and deviation of phases 2n+1 and 2n+2
+    Class 0 holds the standard RCAs, class 1 the special ones. */
+int getPhaseTimeouts(CAN_MSG_TYPE *message) {
+    unsigned char rcaClass, phase, i;
+    unsigned int us;
+
+    if (message->relative_address < GET_PHASE_ESTIMATES_RCA) {
+        rcaClass = (unsigned char) ((message->relative_address - GET_PHASE_TIMEOUTS_RCA) >> 1);
+        phase = (unsigned char) ((message->relative_address - GET_PHASE_TIMEOUTS_RCA) & 1) * 4;
+        for (i = 0; i < 4; i++, phase++) {
+            us = (phase < MONITOR_PHASES) ? TICKS_TO_US(phaseTimeout[rcaClass][phase]) : MAX_TIMEOUT;
+            message->data[2 * i + 1] = (unsigned char) (us);
+            message->data[2 * i] = (unsigned char) (us >> 8);
+        }
+        message->len=8;
+    } else {
+        rcaClass = (unsigned char) ((message->relative_address - GET_PHASE_ESTIMATES_RCA) >> 2);
+        phase = (unsigned char) ((message->relative_address - GET_PHASE_ESTIMATES_RCA) & 3) * 2;
+        message->len=0;
+        for (i = 0; i < 2 && phase < MONITOR_PHASES; i++, phase++) {
+            us = TICKS_TO_US(phaseEstimate[rcaClass][phase].mean8 >> 3);
+            message->data[4 * i + 1] = (unsigned char) (us);
+            message->data[4 * i] = (unsigned char) (us >> 8);
+            us = TICKS_TO_US(phaseEstimate[rcaClass][phase].dev4 >> 2);
+            message->data[4 * i + 3] = (unsigned char) (us);
+            message->data[4 * i + 2] = (unsigned char) (us >> 8);
+            message->len+=4;
+        }
+    }
+    return 0;
+}
+
+/*! Fold the ticks waited in the first \p phases phases of a successful monitor
+    transaction into the estimates of \p rcaClass and set the new timeouts:
+    mean + 4 * deviation + ADAPTIVE_TIMEOUT_MARGIN, at most MAX_TIMEOUT.  The
+    reply length phase always gets MAX_TIMEOUT: giving up while the ARCOM is
+    still producing the reply would only leave it behind the retry. */
+void learnTimeouts(unsigned char rcaClass, unsigned char phases) {
+    unsigned int sample[MONITOR_PHASES];
+    PHASE_ESTIMATE *est;
+    unsigned char phase;
+    unsigned long timeout;
+    int err;
+
+    sample[0] = monTimer1;
+    sample[1] = monTimer2;
+    sample[2] = monTimer3;
+    sample[3] = monTimer4;
+    sample[4] = monTimer5;
+    sample[5] = monTimer6;
+    sample[6] = monTimer7;
+
+    for (phase = 0; phase < phases; phase++) {
+        est = &phaseEstimate[rcaClass][phase];
+        if (!est->samples) {
+            // First answer: mean is the sample, deviation half of it
+            est->mean8 = sample[phase] << 3;
+            est->dev4 = sample[phase] << 1;
+        } else {
+            // mean += (sample - mean) / 8, dev += (|sample - mean| - dev) / 4
+            err = (int) sample[phase] - (int) (est->mean8 >> 3);
+            est->mean8 += err;
+            if (err < 0)
+                err = -err;
+            est->dev4 += err - (int) (est->dev4 >> 2);
+        }
+        if (est->samples < 255)
+            est->samples++;
+
+        timeout = (est->mean8 >> 3) + (unsigned long) est->dev4 + ADAPTIVE_TIMEOUT_MARGIN * 1000L / HAL_TIMER_NS_PER_TICK;
+        // The reply length comes when the ARCOM has the reply, however long it takes:
+        if (timeout > MAX_TIMEOUT_TICKS || phase == REPLY_LENGTH_PHASE)
+            timeout = MAX_TIMEOUT_TICKS;
+        phaseTimeout[rcaClass][phase] = (unsigned int) timeout;
+    }
+}
+#endif // ADAPTIVE_TIMEOUT
+
+#ifdef MONITOR_CACHE
+/*! return the state of the monitor cache.
+    - 0x20070: hits and misses, 4 bytes each
+    - 0x20071: evictions of live replies and invalidations by control requests, 4 bytes each
+    - 0x20072: entries in use, CACHE_SIZE
+    - 0x20073: prefetch polls (4 bytes), failed polls and passes held back by the budget (2 bytes each)
+    - 0x20074 + n: first and last RCA (3 bytes each) and time to live in ms of range n
+    - 0x20078 + n: RCA (3 bytes) and period in ms of prefetched point n */
+int getCacheInfo(CAN_MSG_TYPE *message) {
+    unsigned long first, second;
+    unsigned char i, n;
+
+    switch (message->relative_address) {
+        case GET_CACHE_COUNTS_RCA:
+            first = cacheHits;
+            second = cacheMisses;
+            break;
+        case GET_CACHE_EVICTS_RCA:
+            first = cacheEvictions;
+            second = cacheInvalidations;
+            break;
+        case GET_CACHE_USAGE_RCA:
+            for (i = 0, n = 0; i < CACHE_SIZE; i++)
+                if (cacheEntry[i].valid)
+                    n++;
+            message->data[0] = n;
+            message->data[1] = CACHE_SIZE;
+            message->len=2;
+            return 0;
+        #ifdef PREFETCH
+        case GET_PREFETCH_COUNTS_RCA:
+            first = prefetchPolls;
+            second = ((unsigned long) prefetchFailures << 16) + prefetchHeld;
+            break;
+        #endif // PREFETCH
+        default:
+            if (message->relative_address < GET_CACHE_RANGE_RCA) {
+                message->len=0;
+                return -1;
+            }
+            #ifdef PREFETCH
+                if (message->relative_address >= GET_PREFETCH_RCA) {
+                    n = (unsigned char) (message->relative_address - GET_PREFETCH_RCA);
+                    for (i = 0; i < 3; i++)
+                        message->data[2 - i] = (unsigned char) (prefetchEntry[n].rca >> (8 * i));
+                    message->data[4] = (unsigned char) (prefetchEntry[n].periodMs);
+                    message->data[3] = (unsigned char) (prefetchEntry[n].periodMs >> 8);
+                    message->len=5;
+                    return 0;
+                }
+            #endif // PREFETCH
+            n = (unsigned char) (message->relative_address - GET_CACHE_RANGE_RCA);
+            for (i = 0; i < 3; i++) {
+                message->data[2 - i] = (unsigned char) (cacheRange[n].lowest >> (8 * i));
+                message->data[5 - i] = (unsigned char) (cacheRange[n].highest >> (8 * i));
+            }
+            message->data[7] = (unsigned char) (cacheRange[n].ttl);
+            message->data[6] = (unsigned char) (cacheRange[n].ttl >> 8);
+            message->len=8;
+            return 0;
+    }
+
+    for (i = 0; i < 4; i++) {
+        message->data[3 - i] = (unsigned char) (first >> (8 * i));
+        message->data[7 - i] = (unsigned char) (second >> (8 * i));
+    }
+    message->len=8;
+    return 0;
+}
+
+/*! set range n of the monitor cache from a control request to 0x21074 + n:
+    first and last RCA (3 bytes each) and time to live in ms (0 to stop caching
+    the range, at most MAX_CACHE_TTL).  The whole cache is emptied.
+    With PREFETCH, requests to 0x21078 + n go to setPrefetch. */
+int setCacheRange(CAN_MSG_TYPE *message) {
+    unsigned char i, n;
+    unsigned int ttl;
+
+    #ifdef PREFETCH
+        if (message->relative_address >= SET_PREFETCH_RCA)
+            return setPrefetch(message);
+    #endif // PREFETCH
+
+    if (message->dirn != CAN_CONTROL || message->len != 8)
+        return -1;
+
+    ttl = ((unsigned int) message->data[6] << 8) + message->data[7];
+    if (ttl > MAX_CACHE_TTL)
+        ttl = MAX_CACHE_TTL;
+
+    n = (unsigned char) (message->relative_address - SET_CACHE_RANGE_RCA);
+    cacheRange[n].lowest = 0;
+    cacheRange[n].highest = 0;
+    for (i = 0; i < 3; i++) {
+        cacheRange[n].lowest = (cacheRange[n].lowest << 8) + message->data[i];
+        cacheRange[n].highest = (cacheRange[n].highest << 8) + message->data[3 + i];
+    }
+    cacheRange[n].ttl = ttl;
+
+    for (i = 0; i < CACHE_SIZE; i++)
+        cacheEntry[i].valid = 0;
+    return 0;
+}
+
+/*! return the time to live of the replies of \p rca in slow timer ticks, 0 if not cached */
+unsigned int cacheTTL(unsigned long rca) {
+    unsigned char n;
+
+    for (n = 0; n < CACHE_RANGES; n++)
+        if (cacheRange[n].ttl && rca >= cacheRange[n].lowest && rca <= cacheRange[n].highest)
+            return (unsigned int) (cacheRange[n].ttl * 1000000L / HAL_SLOW_TIMER_NS_PER_TICK);
+    return 0;
+}
+
+/*! answer \p message from the cache.
+    \return 0 on a hit, -1 if there is no live reply for its RCA (the caller counts the miss) */
+int cacheLookup(CAN_MSG_TYPE *message) {
+    unsigned char i, j;
+
+    for (i = 0; i < CACHE_SIZE; i++) {
+        if (!cacheEntry[i].valid || cacheEntry[i].rca != message->relative_address)
+            continue;
+        if ((uword) (HAL_SLOW_TIMER_READ() - cacheEntry[i].stamp) >= cacheEntry[i].ttl) {
+            cacheEntry[i].valid = 0;
+            break;
+        }
+        message->len = cacheEntry[i].len;
+        for (j = 0; j < cacheEntry[i].len; j++)
+            message->data[j] = cacheEntry[i].data[j];
+        cacheHits++;
+        return 0;
+    }
+    return -1;
+}
+
+/*! keep the reply in \p message for \p ttl slow timer ticks, in place of an
+    older reply of the same RCA, or in a free or expired entry if there is one,
+    otherwise in place of the oldest reply */
+void cacheStore(CAN_MSG_TYPE *message, unsigned int ttl) {
+    unsigned char i, slot;
+    uword now, age, oldest;
+
+    now = HAL_SLOW_TIMER_READ();
+    slot = 0;
+    oldest = 0;
+    for (i = 0; i < CACHE_SIZE; i++) {
+        if (cacheEntry[i].valid && cacheEntry[i].rca == message->relative_address) {
+            cacheEntry[i].valid = 0;
+            slot = i;
+            break;
+        }
+    }
+    for (i = 0; i < CACHE_SIZE && cacheEntry[slot].valid; i++) {
+        if (!cacheEntry[i].valid) {
+            slot = i;
+            break;
+        }
+        age = (uword) (now - cacheEntry[i].stamp);
+        if (age >= cacheEntry[i].ttl) {
+            cacheEntry[i].valid = 0;
+            slot = i;
+            break;
+        }
+        if (age >= oldest) {
+            oldest = age;
+            slot = i;
+        }
+    }
+    if (cacheEntry[slot].valid)
+        cacheEvictions++;
+
+    cacheEntry[slot].rca = message->relative_address;
+    cacheEntry[slot].stamp = now;
+    cacheEntry[slot].ttl = ttl;
+    cacheEntry[slot].len = message->len;
+    for (i = 0; i < message->len; i++)
+        cacheEntry[slot].data[i] = message->data[i];
+    cacheEntry[slot].valid = 1;
+}
+
+/*! drop the cached replies of \p rca, written by a control request, and of
+    the monitor RCA at the same place in the monitor range */
+void cacheInvalidate(unsigned long rca) {
+    unsigned long monitorRca;
+    unsigned char i;
+
+    monitorRca = rca;
+    if (rca >= lowestControlRCA && rca <= highestControlRCA)
+        monitorRca = rca - lowestControlRCA + lowestMonitorRCA;
+    else if (rca >= lowestSpecialControlRCA && rca <= highestSpecialControlRCA)
+        monitorRca = rca - lowestSpecialControlRCA + lowestSpecialMonitorRCA;
+
+    for (i = 0; i < CACHE_SIZE; i++) {
+        if (cacheEntry[i].valid && (cacheEntry[i].rca == rca || cacheEntry[i].rca == monitorRca)) {
+            cacheEntry[i].valid = 0;
+            cacheInvalidations++;
+        }
+    }
+}
+
+/*! drop the expired replies.  Called from the main loop, so that no reply
+    outlives the 1.68 s wrap of the slow timer and looks fresh again. */
+void cacheExpire(void) {
+    unsigned char i;
+    bit int_enabled;
+
+    /* The CAN ISR uses the cache too */
+    HAL_CAN_INT_DISABLE(int_enabled);
+    for (i = 0; i < CACHE_SIZE; i++)
+        if (cacheEntry[i].valid && (uword) (HAL_SLOW_TIMER_READ() - cacheEntry[i].stamp) >= cacheEntry[i].ttl)
+            cacheEntry[i].valid = 0;
+    HAL_CAN_INT_RESTORE(int_enabled);
+}
+#endif // MONITOR_CACHE
+
+#ifdef PREFETCH
+/*! set prefetched point n from a control request to 0x21078 + n: RCA (3 bytes)
+    and period in ms (2 bytes, 0 to stop polling it, at most MAX_CACHE_TTL).
+    The replies stay in the cache for one and a half periods. */
+int setPrefetch(CAN_MSG_TYPE *message) {
+    unsigned char i, n;
+    unsigned int periodMs;
+
+    if (message->dirn != CAN_CONTROL || message->len != 5)
+        return -1;
+
+    periodMs = ((unsigned int) message->data[3] << 8) + message->data[4];
+    if (periodMs > MAX_CACHE_TTL)
+        periodMs = MAX_CACHE_TTL;
+
+    n = (unsigned char) (message->relative_address - SET_PREFETCH_RCA);
+    prefetchEntry[n].rca = 0;
+    for (i = 0; i < 3; i++)
+        prefetchEntry[n].rca = (prefetchEntry[n].rca << 8) + message->data[i];
+    prefetchEntry[n].periodMs = periodMs;
+    prefetchEntry[n].period = (unsigned int) (periodMs * 1000000L / HAL_SLOW_TIMER_NS_PER_TICK);
+    /* Due at once */
+    prefetchEntry[n].last = HAL_SLOW_TIMER_READ() - prefetchEntry[n].period;
+    return 0;
+}
+
+/*! start the transaction of the next due prefetched point on the strobe
+    interrupt.  Called from the main loop: at most one point at a time, only
+    on an idle link, and only once the link has been left alone for long
+    enough to keep within PREFETCH_DUTY.  The reply goes to the monitor
+    cache in prefetchDone. */
+void prefetchPoll(void) {
+    unsigned char i, n, idle;
+    bit int_enabled;
+
+    if (!initialized)
+        return;
+
+    /* The last point first */
+    prefetchDone();
+    if (prefetchPending)
+        return;
+
+    /* Find the next point due */
+    for (i = 0; i < PREFETCH_SIZE; i++) {
+        n = (prefetchNext + i) % PREFETCH_SIZE;
+        if (prefetchEntry[n].periodMs &&
+            (uword) (HAL_SLOW_TIMER_READ() - prefetchEntry[n].last) >= prefetchEntry[n].period)
+            break;
+    }
+    if (i == PREFETCH_SIZE)
+        return;
+
+    #ifdef LINK_BREAKER
+        /* Nothing to refresh from an ARCOM which is not answering */
+        if (breakerState == BREAKER_OPEN)
+            return;
+    #endif // LINK_BREAKER
+
+    /* Stay within the budget */
+    if ((uword) (HAL_TIMER_READ() - prefetchIdleFrom) < prefetchGap) {
+        prefetchHeld++;
+        return;
+    }
+
+    /* The CAN ISR must not start a transaction of its own meanwhile */
+    HAL_CAN_INT_DISABLE(int_enabled);
+    /* The link must be idle, with no other transaction still to be looked at */
+    idle = linkPoll() != LINK_BUSY;
+    #ifdef SPLIT_MONITOR
+        /* The queued requests go first */
+        if (splitPending || linkQueueDepth)
+            idle = 0;
+    #endif // SPLIT_MONITOR
+    #ifdef LINK_TAGS
+        if (tagPending)
+            idle = 0;
+    #endif // LINK_TAGS
+    #ifdef BATCH_MONITOR
+        if (batchPending)
+            idle = 0;
+    #endif // BATCH_MONITOR
+    if (idle) {
+        prefetchNext = (n + 1) % PREFETCH_SIZE;
+        prefetchPoint = n;
+        prefetchPending = 1;
+        prefetchMsg.dirn = CAN_MONITOR;
+        prefetchMsg.len = 0;
+        prefetchMsg.relative_address = prefetchEntry[n].rca;
+        linkStart(&prefetchMsg, 0);
+    }
+    HAL_CAN_INT_RESTORE(int_enabled);
+}
+
+/*! store the reply of the prefetched point in the monitor cache once the
+    strobe interrupt is done with its transaction.  Called from the main loop
+    and by linkWaitIdle, before the link is used for anything else. */
+void prefetchDone(void) {
+    unsigned char n;
+    unsigned long ttl;
+    bit int_enabled;
+
+    if (!prefetchPending || linkPoll() == LINK_BUSY)
+        return;
+
+    HAL_CAN_INT_DISABLE(int_enabled);
+    if (prefetchPending) {
+        prefetchPending = 0;
+        n = prefetchPoint;
+        prefetchEntry[n].last = HAL_SLOW_TIMER_READ();
+        prefetchPolls++;
+        if (linkXfer.state == LINK_IDLE) {
+            ttl = prefetchEntry[n].period + (prefetchEntry[n].period >> 1);
+            if (ttl > MAX_CACHE_TTL * 1000000L / HAL_SLOW_TIMER_NS_PER_TICK)
+                ttl = MAX_CACHE_TTL * 1000000L / HAL_SLOW_TIMER_NS_PER_TICK;
+            cacheStore(&linkXfer.msg, (unsigned int) ttl);
+        } else {
+            prefetchFailures++;
+        }
+        #ifdef LINK_BREAKER
+            breakerResult(linkXfer.state == LINK_IDLE ? 0 : -1);
+        #endif // LINK_BREAKER
+
+        /* Time off the link in proportion to the time on it */
+        prefetchIdleFrom = HAL_TIMER_READ();
+        prefetchGap = (uword) ((unsigned long) linkSpan * (100 - PREFETCH_DUTY) / PREFETCH_DUTY);
+    }
+    HAL_CAN_INT_RESTORE(int_enabled);
+}
+#endif // PREFETCH
+
+#ifdef CONTROL_QUEUE
+/*! return the state of the control queue.
+    - 0x20080: requests in the queue, most ever in the queue, CONTROL_QUEUE_SIZE,
+               requests dropped with the queue full (2 bytes), requests forwarded in the last second (2 bytes)
+    - 0x20081: requests forwarded and requests coalesced with a queued one, 4 bytes each
+    - 0x20084 + n: first and last RCA (3 bytes each) of coalesced range n */
+int getControlQueue(CAN_MSG_TYPE *message) {
+    unsigned char i, n;
+
+    if (message->relative_address >= GET_COALESCE_RANGE_RCA) {
+        n = (unsigned char) (message->relative_address - GET_COALESCE_RANGE_RCA);
+        for (i = 0; i < 3; i++) {
+            message->data[2 - i] = (unsigned char) (coalesceRange[n].lowest >> (8 * i));
+            message->data[5 - i] = (unsigned char) (coalesceRange[n].highest >> (8 * i));
+        }
+        message->len=6;
+        return 0;
+    }
+
+    if (message->relative_address == GET_CONTROL_QUEUE_RCA) {
+        message->data[0] = controlDepth;
+        message->data[1] = controlMaxDepth;
+        message->data[2] = CONTROL_QUEUE_SIZE;
+        message->data[4] = (unsigned char) (controlDrops);
+        message->data[3] = (unsigned char) (controlDrops >> 8);
+        message->data[6] = (unsigned char) (controlRate);
+        message->data[5] = (unsigned char) (controlRate >> 8);
+        message->len=7;
+        return 0;
+    }
+
+    if (message->relative_address != GET_CONTROL_COUNTS_RCA) {
+        message->len=0;
+        return -1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        message->data[3 - i] = (unsigned char) (controlForwarded >> (8 * i));
+        message->data[7 - i] = (unsigned char) (controlCoalesced >> (8 * i));
+    }
+    message->len=8;
+    return 0;
+}
+
+/*! set range n of the coalesced control RCAs from a control request to
+    0x21084 + n: first and last RCA (3 bytes each, last 0 to stop coalescing
+    the range).  Leave out the RCAs that must see every write. */
+int setCoalesceRange(CAN_MSG_TYPE *message) {
+    unsigned char i, n;
+
+    if (message->dirn != CAN_CONTROL || message->len != 6)
+        return -1;
+
+    n = (unsigned char) (message->relative_address - SET_COALESCE_RANGE_RCA);
+    coalesceRange[n].lowest = 0;
+    coalesceRange[n].highest = 0;
+    for (i = 0; i < 3; i++) {
+        coalesceRange[n].lowest = (coalesceRange[n].lowest << 8) + message->data[i];
+        coalesceRange[n].highest = (coalesceRange[n].highest << 8) + message->data[3 + i];
+    }
+    return 0;
+}
+
+/*! return the request to \p rca waiting in the queue, if \p rca is in a
+    coalesced range, otherwise 0.  The main loop forwards a request with
+    the CAN interrupt held off, so a request found here is not on the link. */
+CAN_MSG_TYPE *controlPending(unsigned long rca) {
+    unsigned char i, n;
+
+    for (n = 0; n < COALESCE_RANGES; n++)
+        if (coalesceRange[n].highest && rca >= coalesceRange[n].lowest && rca <= coalesceRange[n].highest)
+            break;
+    if (n == COALESCE_RANGES)
+        return 0;
+
+    for (i = 0; i < controlDepth; i++)
+        if (controlQueue[(controlHead + i) % CONTROL_QUEUE_SIZE].relative_address == rca)
+            return &controlQueue[(controlHead + i) % CONTROL_QUEUE_SIZE];
+    return 0;
+}
+
+/*! forward the queued control requests to the ARCOM, oldest first.
+    Called from the main loop.  The CAN interrupt is held off for one
+    request at a time, so monitor requests are served in between. */
+void controlDrain(void) {
+    bit int_enabled;
+
+    while (controlDepth) {
+        #if defined(STROBE_INT) && !defined(SPLIT_MONITOR)
+            /* Try again on the next pass rather than wait for the link */
+            if (linkPoll() == LINK_BUSY)
+                break;
+        #endif
+
+        /* The CAN ISR must not start a transaction of its own meanwhile */
+        HAL_CAN_INT_DISABLE(int_enabled);
+        if (forwardControl(&controlQueue[controlHead]) != 0) {
+            /* No room in the link queue: try again on the next pass */
+            HAL_CAN_INT_RESTORE(int_enabled);
+            break;
+        }
+        #ifdef MONITOR_CACHE
+            /* A reply read while the request was queued is stale now */
+            cacheInvalidate(controlQueue[controlHead].relative_address);
+        #endif // MONITOR_CACHE
+        controlHead = (controlHead + 1) % CONTROL_QUEUE_SIZE;
+        controlDepth--;
+        controlForwarded++;
+        HAL_CAN_INT_RESTORE(int_enabled);
+    }
+
+    if ((uword) (HAL_SLOW_TIMER_READ() - controlRateStamp) >= CONTROL_RATE_TICKS) {
+        controlRate = (unsigned int) (controlForwarded - controlRateBase);
+        controlRateBase = controlForwarded;
+        controlRateStamp = HAL_SLOW_TIMER_READ();
+    }
+}
+#endif // CONTROL_QUEUE
+
+#ifdef BATCH_MONITOR
+/*! return RCA n of the batch (3 bytes) for a monitor request to 0x20088 + n,
+    or start the batch for a monitor request to RUN_BATCH_RCA.  The batch is
+    run by batchRun, which sends the reply; a request while it runs gets the
+    same reply. */
+int getBatch(CAN_MSG_TYPE *message) {
+    unsigned char i;
+
+    if (message->relative_address < RUN_BATCH_RCA) {
+        i = (unsigned char) (message->relative_address - GET_BATCH_RCA);
+        message->data[2] = (unsigned char) (batchRCA[i]);
+        message->data[1] = (unsigned char) (batchRCA[i] >> 8);
+        message->data[0] = (unsigned char) (batchRCA[i] >> 16);
+        message->len=3;
+        return 0;
+    }
+
+    if (!initialized) {
+        message->len=0;
+        return -1;
+    }
+
+    if (!batchRunning) {
+        batchRunning = 1;
+        batchNext = 0;
+        batchAnswered = 0;
+        batchFailed = 0;
+        batchStart = HAL_SLOW_TIMER_READ();
+    }
+
+    // No response now, as for a split transaction: tell the caller it's a control msg
+    message->dirn = CAN_CONTROL;
+    message->len = 0;
+    return 0;
+}
+
+/*! read the RCAs of the batch from the ARCOM in order, one transaction each,
+    and send each reply as the monitor response of its own RCA.  Called from
+    the main loop, which reads at most one RCA on each pass, with a single
+    try: with STROBE_INT its transaction runs on the strobe interrupt, as a
+    prefetched point, and its reply is sent on a later pass; otherwise it is
+    run there and then with the CAN interrupt held off.  A dead ARCOM then
+    holds off the CAN interrupt for the phase timeouts of one try at most.
+
+    Then the reply to RUN_BATCH_RCA is sent: RCAs answered, RCAs which failed,
+    were not forwarded to the ARCOM or whose response found no free transmit
+    object, and the time the batch took in microseconds (2 bytes).  The time
+    is taken with the slow timer, 25.6 us per tick, as a batch of slow or
+    retried RCAs may outlast the 26 ms of the fast one, and is held at
+    0xFFFF past 65 ms. */
+void batchRun(void) {
+    bit int_enabled;
+    read_or_write_func function;
+    unsigned long us;
+    #ifdef STROBE_INT
+        unsigned char idle;
+    #else
+        int ret;
+    #endif
+
+    if (!batchRunning)
+        return;
+
+    #ifdef STROBE_INT
+        /* The RCA on the link first */
+        batchDone();
+        if (batchPending)
+            return;
+        if (batchResult) {
+            if (batchResult == BATCH_REPLIED && amb_send_monitor(&batchMsg) == 0)
+                batchAnswered++;
+            else
+                batchFailed++;
+            batchResult = 0;
+        }
+    #endif // STROBE_INT
+
+    /* Only the points of the ARCOM, not the local ones in or out of its
+       ranges.  controlMsg passes monitor requests on to monitorMsg. */
+    while (batchNext < BATCH_SIZE) {
+        if (batchRCA[batchNext]) {
+            function = amb_get_function(batchRCA[batchNext]);
+            if (function == monitorMsg || function == controlMsg)
+                break;
+            batchFailed++;
+        }
+        batchNext++;
+    }
+
+    if (batchNext < BATCH_SIZE) {
+        batchMsg.dirn = CAN_MONITOR;
+        batchMsg.len = 0;
+        batchMsg.relative_address = batchRCA[batchNext];
+
+        /* The CAN ISR must not start a transaction of its own meanwhile */
+        HAL_CAN_INT_DISABLE(int_enabled);
+        #ifdef STROBE_INT
+            /* The link must be idle, with no other transaction still to be looked at */
+            idle = linkPoll() != LINK_BUSY;
+            #ifdef PREFETCH
+                if (prefetchPending)
+                    idle = 0;
+            #endif // PREFETCH
+            #ifdef SPLIT_MONITOR
+                /* The queued requests go first */
+                if (splitPending || linkQueueDepth)
+                    idle = 0;
+            #endif // SPLIT_MONITOR
+            #ifdef LINK_TAGS
+                if (tagPending)
+                    idle = 0;
+            #endif // LINK_TAGS
+            #ifdef LINK_BREAKER
+                if (idle && !breakerAllows()) {
+                    batchFailed++;
+                    batchNext++;
+                    idle = 0;
+                }
+            #endif // LINK_BREAKER
+            if (idle) {
+                batchNext++;
+                batchPending = 1;
+                linkStart(&batchMsg, 0);
+            }
+            HAL_CAN_INT_RESTORE(int_enabled);
+        #else
+            batchNext++;
+            #ifdef LINK_BREAKER
+                if (!breakerAllows()) {
+                    HAL_CAN_INT_RESTORE(int_enabled);
+                    batchFailed++;
+                    return;
+                }
+            #endif // LINK_BREAKER
+            /* The ARCOM takes one transaction per rising edge of the interrupt */
+            HAL_ARCOM_INT(1);
+            ret = implMonitorSingle(&batchMsg, fullTimeouts);
+            HAL_ARCOM_INT(0);
+            linkHealthTry(ret, fullTimeouts);
+            healthTransactions++;
+            if (ret == 0)
+                healthFirstTry++;
+            else
+                healthFailed++;
+            #ifdef LINK_BREAKER
+                breakerResult(ret);
+            #endif // LINK_BREAKER
+            HAL_CAN_INT_RESTORE(int_enabled);
+
+            if (ret == 0 && amb_send_monitor(&batchMsg) == 0)
+                batchAnswered++;
+            else
+                batchFailed++;
+        #endif // STROBE_INT
+        return;
+    }
+
+    us = (unsigned long) (uword) (HAL_SLOW_TIMER_READ() - batchStart) * HAL_SLOW_TIMER_NS_PER_TICK / 1000;
+    if (us > 0xFFFF)
+        us = 0xFFFF;
+    batchMsg.relative_address = RUN_BATCH_RCA;
+    batchMsg.data[0] = batchAnswered;
+    batchMsg.data[1] = batchFailed;
+    batchMsg.data[3] = (unsigned char) (us);
+    batchMsg.data[2] = (unsigned char) (us >> 8);
+    batchMsg.len=4;
+    amb_send_monitor(&batchMsg);
+    batchRunning = 0;
+}
+
+#ifdef STROBE_INT
+/*! look at the transaction of the batched RCA once the strobe interrupt is
+    done with it, keeping its reply in batchMsg for batchRun.  Called from
+    the main loop and by linkWaitIdle, before the link is used for anything
+    else. */
+void batchDone(void) {
+    bit int_enabled;
+
+    if (!batchPending || linkPoll() == LINK_BUSY)
+        return;
+
+    HAL_CAN_INT_DISABLE(int_enabled);
+    if (batchPending) {
+        batchPending = 0;
+        if (linkXfer.state == LINK_IDLE) {
+            batchMsg = linkXfer.msg;
+            batchResult = BATCH_REPLIED;
+        } else {
+            batchResult = BATCH_FAILED;
+        }
+        #ifdef LINK_BREAKER
+            breakerResult(linkXfer.state == LINK_IDLE ? 0 : -1);
+        #endif // LINK_BREAKER
+    }
+    HAL_CAN_INT_RESTORE(int_enabled);
+}
+#endif // STROBE_INT
+
+/*! set RCA n of the batch from a control request to 0x21088 + n: RCA (3 bytes,
+    0 to leave the entry out).  batchRun checks that the ARCOM owns the RCA. */
+int setBatch(CAN_MSG_TYPE *message) {
+    unsigned char n;
+
+    if (message->dirn != CAN_CONTROL || message->len != 3)
+        return -1;
+
+    n = (unsigned char) (message->relative_address - SET_BATCH_RCA);
+    batchRCA[n] = ((unsigned long) message->data[0] << 16) + ((unsigned int) message->data[1] << 8) + message->data[2];
+    return 0;
+}
+#endif // BATCH_MONITOR
+
+#ifdef STROBE_INT
+/*! Strobe interrupt: the ARCOM pulled DSTROBE low for the next byte of the
+    transaction in linkXfer.  The byte is put on or read from the port and
+    acknowledged with WAIT as in the blocking handshake.  The interrupt has
+    a register bank of its own, so no registers are saved on entry. */
+void linkStrobe(void) HAL_INTERRUPT_BANK(HAL_ARCOM_STROBE_VECTOR, LINK_BANK) {
+    uword entry;
+
+    entry = HAL_TIMER_READ();
+    if (!linkXfer.count)
+        return;
+
+    #ifdef SPLIT_MONITOR
+        /* The wait for the byte, as in the timers of the blocking handshake */
+        linkXfer.wait[LINK_PHASE(linkXfer.ptr - linkXfer.bytes)] = (uword) (entry - linkXfer.last);
+    #endif // SPLIT_MONITOR
+
+    if (linkXfer.dirIn)
+        *linkXfer.ptr++ = HAL_ARCOM_READ();
+    else
+        HAL_ARCOM_WRITE(*linkXfer.ptr++);
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   // Wait down as quick as possible for next message
+
+    /* Counted before linkNextRun, as linkFinish takes the total */
+    linkXfer.last = HAL_TIMER_READ();
+    linkXfer.busy += (uword) (linkXfer.last - entry);
+    if (!--linkXfer.count)
+        linkNextRun();
+}
+
+/*! Start the transaction of \p message, copied to linkXfer, on the strobe
+    interrupt.  With LINK_TAGS a monitor request with a \p tag other than 0
+    is sent as a tagged request, else \p tag is 0.  The link must be idle
+    (see linkWaitIdle). */
+void linkStart(CAN_MSG_TYPE *message, unsigned char tag) {
+    unsigned char i;
+    #ifdef LINK_CRC
+        unsigned char crc;
+    #endif
+
+    linkXfer.msg = *message;
+    for (i = 0; i < LINK_HEADER_LEN - 1; i++)
+        linkXfer.bytes[i] = (unsigned char) (message->relative_address >> (8 * i));    // RCA, LSB first
+    linkXfer.bytes[LINK_HEADER_LEN - 1] = (message->dirn == CAN_CONTROL) ? message->len : 0;    // Payload size (0 -> monitor message)
+    for (i = 0; message->dirn == CAN_CONTROL && i < message->len; i++)
+        linkXfer.bytes[LINK_HEADER_LEN + i] = message->data[i];
+
+    linkXfer.ptr = linkXfer.bytes;
+    linkXfer.count = LINK_HEADER_LEN + linkXfer.bytes[LINK_HEADER_LEN - 1];
+    #ifdef LINK_TAGS
+        if (tag) {
+            linkXfer.bytes[LINK_HEADER_LEN - 1] = LINK_TAGGED;
+            linkXfer.bytes[linkXfer.count++] = tag;
+        }
+    #endif // LINK_TAGS
+    #ifdef LINK_CRC
+        /* Over the whole request, as crcRequest */
+        crc = 0;
+        for (i = 0; i < linkXfer.count; i++)
+            CRC8(crc, linkXfer.bytes[i]);
+        linkXfer.bytes[linkXfer.count++] = crc;
+    #endif // LINK_CRC
+    #ifdef SPLIT_MONITOR
+        for (i = 0; i < MONITOR_PHASES; i++)
+            linkXfer.wait[i] = 0;
+    #endif // SPLIT_MONITOR
+    linkXfer.tag = tag;
+    linkXfer.naks = 0;
+    linkXfer.dirIn = 0;
+    linkXfer.busy = 0;
+    linkXfer.first = HAL_TIMER_READ();
+    linkXfer.last = linkXfer.first;
+    linkXfer.state = LINK_BUSY;
+
+    /* Only the edges of this transaction */
+    HAL_ARCOM_STROBE_INT_CLEAR();
+    HAL_ARCOM_STROBE_INT_ENABLE();
+
+    /* Trigger interrupt */
+    HAL_ARCOM_INT(1);
+}
+
+/*! Set up the next run of bytes of the transaction in linkXfer, or end it */
+void linkNextRun(void) {
+    unsigned char len;
+
+    if (linkXfer.msg.dirn == CAN_CONTROL || linkXfer.tag) {
+        /* A control request, or a tagged one whose reply is fetched later */
+        linkFinish(LINK_IDLE);
+    } else if (!linkXfer.dirIn) {
+        #ifdef LINK_CRC
+            /* The status of the reply went out: done, unless it asked for the reply again */
+            if (linkXfer.ptr != &linkXfer.bytes[LINK_REPLY]) {
+                if (linkXfer.ptr[-1] != LINK_NAK) {
+                    linkFinish(linkXfer.ptr[-1] == LINK_ACK ? LINK_IDLE : LINK_FAILED);
+                    return;
+                }
+                linkXfer.ptr = &linkXfer.bytes[LINK_REPLY];
+            }
+        #endif // LINK_CRC
+        /* Set port to receive the monitor payload size */
+        HAL_ARCOM_DIR_IN();
+        linkXfer.dirIn = 1;
+        linkXfer.count = 1;
+    } else if (linkXfer.ptr == &linkXfer.bytes[LINK_REPLY + 1]) {
+        len = linkXfer.bytes[LINK_REPLY];
+        if (len > MAX_CAN_MSG_PAYLOAD + (linkXfer.msg.relative_address == GET_TAGGED_REPLY ? LINK_TAG_LEN : 0)) {
+            #ifdef LINK_CRC
+                if (len == LINK_NAK)
+                    crcRejects++;
+            #endif // LINK_CRC
+            linkFinish(LINK_FAILED);
+        }
+        #ifndef LINK_CRC
+        else if (!len)
+            linkFinish(LINK_IDLE);
+        #endif // LINK_CRC
+        else
+            linkXfer.count = len + LINK_CHECK_LEN;    // The reply, then its check with LINK_CRC
+    } else {
+        #ifdef LINK_CRC
+            /* Set port to transmit the status of the reply */
+            HAL_ARCOM_DIR_OUT();
+            linkXfer.dirIn = 0;
+            linkXfer.count = 1;
+            *linkXfer.ptr = linkReplyStatus();
+        #else
+            linkFinish(LINK_IDLE);
+        #endif // LINK_CRC
+    }
+}
+
+#ifdef LINK_CRC
+/*! return the status of the reply just read into linkXfer, counting the NAKs */
+unsigned char linkReplyStatus(void) {
+    unsigned char crc, i;
+
+    crc = crcRCA(linkXfer.msg.relative_address);
+    for (i = 0; i < 1 + linkXfer.bytes[LINK_REPLY]; i++)
+        CRC8(crc, linkXfer.bytes[LINK_REPLY + i]);
+    if (crc == linkXfer.ptr[-1])
+        return LINK_ACK;
+    if (linkXfer.naks < LINK_NAKS) {
+        linkXfer.naks++;
+        crcNaks++;
+        return LINK_NAK;
+    }
+    crcGiveUps++;
+    return LINK_ABORT;
+}
+#endif // LINK_CRC
+
+/*! End the transaction in linkXfer, leaving it in \p state */
+void linkFinish(unsigned char state) {
+    unsigned char i, *reply;
+
+    HAL_ARCOM_STROBE_INT_DISABLE();
+    linkXfer.count = 0;
+    if (linkXfer.dirIn)
+        HAL_ARCOM_DIR_OUT();
+
+    /* Untrigger interrupt */
+    HAL_ARCOM_INT(0);
+
+    /* The reply of a monitor request */
+    if (linkXfer.msg.dirn == CAN_MONITOR && state == LINK_IDLE && !linkXfer.tag) {
+        reply = &linkXfer.bytes[LINK_REPLY + 1];
+        linkXfer.msg.len = linkXfer.bytes[LINK_REPLY];
+        #ifdef LINK_TAGS
+            /* A fetched reply starts with its tag */
+            if (linkXfer.msg.relative_address == GET_TAGGED_REPLY && linkXfer.msg.len) {
+                linkXfer.msg.len--;
+                linkXfer.tag = *reply++;
+            }
+        #endif // LINK_TAGS
+        for (i = 0; i < linkXfer.msg.len; i++)
+            linkXfer.msg.data[i] = reply[i];
+    }
+
+    linkSpan = (uword) (linkXfer.last - linkXfer.first);
+    linkBusy = linkXfer.busy;
+    linkBytes = (unsigned char) (linkXfer.ptr - linkXfer.bytes);
+    linkXfer.state = state;
+}
+
+/*! return the timing of the last transaction run by the strobe interrupt:
+    microseconds from the start to the last byte (2 bytes), microseconds
+    spent in the interrupt (2 bytes), nanoseconds in the interrupt per byte
+    (2 bytes) and the bytes moved. */
+int getLinkTimers(CAN_MSG_TYPE *message) {
+    unsigned int us;
+    unsigned long ns;
+
+    us = TICKS_TO_US(linkSpan);
+    message->data[1] = (unsigned char) (us);
+    message->data[0] = (unsigned char) (us >> 8);
+    us = TICKS_TO_US(linkBusy);
+    message->data[3] = (unsigned char) (us);
+    message->data[2] = (unsigned char) (us >> 8);
+    ns = linkBytes ? (unsigned long) linkBusy * HAL_TIMER_NS_PER_TICK / linkBytes : 0;
+    if (ns > 0xFFFF)
+        ns = 0xFFFF;
+    message->data[5] = (unsigned char) (ns);
+    message->data[4] = (unsigned char) (ns >> 8);
+    message->data[6] = linkBytes;
+    message->len=7;
+    return 0;
+}
+
+/*! Give up the transaction in linkXfer if the ARCOM has not strobed the
+    next byte within MAX_TIMEOUT.
+    \return the state of the link */
+unsigned char linkPoll(void) {
+    bit int_enabled;
+
+    if (linkXfer.state != LINK_BUSY)
+        return linkXfer.state;
+
+    /* Neither the strobe interrupt nor the CAN ISR may finish it meanwhile */
+    HAL_CAN_INT_DISABLE(int_enabled);
+    HAL_ARCOM_STROBE_INT_DISABLE();
+    if (linkXfer.state == LINK_BUSY) {
+        if ((uword) (HAL_TIMER_READ() - linkXfer.last) >= MAX_TIMEOUT_TICKS) {
+            #ifdef SPLIT_MONITOR
+                /* The phase it was given up in */
+                linkXfer.wait[LINK_PHASE(linkXfer.ptr - linkXfer.bytes)] = MAX_TIMEOUT_TICKS;
+            #endif // SPLIT_MONITOR
+            linkFinish(LINK_FAILED);
+        } else
+            HAL_ARCOM_STROBE_INT_ENABLE();
+    }
+    HAL_CAN_INT_RESTORE(int_enabled);
+    return linkXfer.state;
+}
+
+/*! Wait until the transaction run by the strobe interrupt is over or given
+    up, with PREFETCH the reply of a prefetched point stored, and with
+    SPLIT_MONITOR the queued requests run and their replies queued, sending
+    them while every reply slot is taken.  Called from the main loop and,
+    without SPLIT_MONITOR, by the CAN interrupt before every control and
+    monitor request it forwards. */
+void linkWaitIdle(void) {
+    do {
+        while (linkPoll() == LINK_BUSY) {
+            /* Watch the strobe line meanwhile, the bytes are moved by linkStrobe */
+            HAL_ARCOM_DSTROBE();
+        }
+        PREFETCH_DONE();
+        BATCH_DONE();
+        LINK_MAKE_ROOM();
+    } while (LINK_COMPLETE());
+}
+
+#ifdef SPLIT_MONITOR
+/*! Queue \p message for the link, and start it at once if the link is free.
+    Called by the CAN interrupt, or with it held off, which never waits for
+    the link: linkComplete starts the queued requests from the main loop.
+    \return 0 if it was queued, -1 with the queue full */
+int linkSubmit(CAN_MSG_TYPE *message) {
+    if (linkQueueDepth == LINK_QUEUE_SIZE)
+        return -1;
+    linkQueue[(linkQueueHead + linkQueueDepth) % LINK_QUEUE_SIZE] = *message;
+    linkQueueDepth++;
+    linkNext();
+    return 0;
+}
+
+/*! Start the next transaction if the link is free, with the result of the
+    last one looked at: a fetch of the tagged replies while one is due, else
+    the oldest queued request.  A monitor request is tagged while a slot is
+    free, else it is a split transaction.  The CAN interrupt is held off.
+    \return 1 if a transaction was started, else 0 */
+unsigned char linkNext(void) {
+    CAN_MSG_TYPE *message;
+    #ifdef LINK_TAGS
+        CAN_MSG_TYPE fetch;
+    #endif
+
+    if (splitPending || linkPoll() == LINK_BUSY)
+        return 0;
+    #ifdef LINK_TAGS
+        if (tagPending)
+            return 0;
+    #endif // LINK_TAGS
+    #ifdef PREFETCH
+        if (prefetchPending)
+            return 0;
+    #endif // PREFETCH
+    #ifdef BATCH_MONITOR
+        if (batchPending)
+            return 0;
+    #endif // BATCH_MONITOR
+
+    #ifdef LINK_TAGS
+        /* The fetches keep going while requests are queued, so the slots are freed */
+        if (tagOutstanding && (uword) (HAL_TIMER_READ() - tagPolled) >= TAG_POLL_TICKS) {
+            fetch.dirn = CAN_MONITOR;
+            fetch.len = 0;
+            fetch.relative_address = GET_TAGGED_REPLY;
+            tagPending = 1;
+            linkStart(&fetch, 0);
+            return 1;
+        }
+    #endif // LINK_TAGS
+
+    if (!linkQueueDepth)
+        return 0;
+    message = &linkQueue[linkQueueHead];
+    linkQueueHead = (linkQueueHead + 1) % LINK_QUEUE_SIZE;
+    linkQueueDepth--;
+
+    if (message->dirn == CAN_MONITOR) {
+        #ifdef LINK_TAGS
+            /* Tagged while a slot is free, the reply is fetched later */
+            if (tagStart(message))
+                return 1;
+        #endif // LINK_TAGS
+        splitPending = 1;
+        splitRetried = 0;
+        #ifdef MONITOR_CACHE
+            splitTTL = cacheTTL(message->relative_address);
+        #endif // MONITOR_CACHE
+        splitRequests++;
+    }
+    linkStart(message, 0);
+    return 1;
+}
+
+/*! Look at the transaction the strobe interrupt is done with, queueing the
+    reply of a monitor request for linkSendReplies, and start the next one.
+    Called from the main loop and by linkWaitIdle, never by the CAN
+    interrupt, which is held off meanwhile.  The result is left in linkXfer
+    while every reply slot is taken.
+    \return 1 if a transaction was started, else 0 */
+unsigned char linkComplete(void) {
+    bit int_enabled;
+    unsigned char started;
+
+    /* Not over the reply of a prefetched point or of a batched RCA */
+    PREFETCH_DONE();
+    BATCH_DONE();
+    if (linkReplyDepth == LINK_REPLIES || linkPoll() == LINK_BUSY)
+        return 0;
+
+    started = 0;
+    HAL_CAN_INT_DISABLE(int_enabled);
+    #ifdef LINK_TAGS
+        /* A tagged request or a fetch */
+        if (tagPending) {
+            tagPending = 0;
+            started = tagDone();
+        }
+    #endif // LINK_TAGS
+    if (!started && splitPending)
+        started = splitDone();
+    if (!started)
+        started = linkNext();
+    HAL_CAN_INT_RESTORE(int_enabled);
+    return started;
+}
+
+/*! Look at the split monitor transaction just run: queue its reply, try it
+    again once, or queue an empty reply when the retry failed too.  Counted
+    in the link health as monitorTries counts a blocking one.
+    \return 1 if it was started again, else 0 */
+unsigned char splitDone(void) {
+    int ret;
+
+    ret = linkXfer.state == LINK_IDLE ? 0 : -1;
+    linkHealthXfer(ret);
+    if (!splitRetried)
+        healthTransactions++;
+
+    if (ret == 0) {
+        splitPending = 0;
+        if (splitRetried)
+            healthRetry++;
+        else
+            healthFirstTry++;
+        #ifdef MONITOR_CACHE
+            if (splitTTL)
+                cacheStore(&linkXfer.msg, splitTTL);
+        #endif // MONITOR_CACHE
+        #ifdef LINK_BREAKER
+            breakerResult(0);
+        #endif // LINK_BREAKER
+        splitAnswered++;
+        linkReplyPut(&linkXfer.msg);
+        return 0;
+    }
+
+    if (!splitRetried && !BREAKER_PROBING) {
+        /* The request is still in linkXfer.msg, only a reply overwrites it */
+        splitRetried = 1;
+        splitRetries++;
+        linkStart(&linkXfer.msg, 0);
+        return 1;
+    }
+
+    splitPending = 0;
+    splitFailed++;
+    healthFailed++;
+    #ifdef LINK_BREAKER
+        breakerResult(-1);
+    #endif // LINK_BREAKER
+    linkXfer.msg.len = 0;
+    linkReplyPut(&linkXfer.msg);
+    return 0;
+}
+
+/*! Account for the try just run by the strobe interrupt, which returned
+    \p ret, with linkHealthTry: the waits of its phases go to the monitor
+    timers, as after a blocking try.  Its bytes never wait for less than
+    the full timeout. */
+void linkHealthXfer(int ret) {
+    monTimer1 = linkXfer.wait[0];
+    monTimer2 = linkXfer.wait[1];
+    monTimer3 = linkXfer.wait[2];
+    monTimer4 = linkXfer.wait[3];
+    monTimer5 = linkXfer.wait[4];
+    monTimer6 = linkXfer.wait[5];
+    monTimer7 = linkXfer.wait[6];
+    linkHealthTry(ret, fullTimeouts);
+}
+
+/*! Queue \p message for linkSendReplies, which has room for it */
+void linkReplyPut(CAN_MSG_TYPE *message) {
+    linkReply[(linkReplyHead + linkReplyDepth) % LINK_REPLIES] = *message;
+    linkReplyDepth++;
+}
+
+/*! Send the queued replies, oldest first.  Called from the main loop, as
+    amb_send_monitor waits for a free transmit object. */
+void linkSendReplies(void) {
+    while (linkReplyDepth) {
+        if (amb_send_monitor(&linkReply[linkReplyHead]) != 0)
+            splitFailed++;
+        linkReplyHead = (linkReplyHead + 1) % LINK_REPLIES;
+        linkReplyDepth--;
+    }
+}
+
+/*! return the split monitor transactions: started, answered, tried again
+    and failed, 2 bytes each.  The failed ones got an empty response: their
+    retry failed, or they found the link queue full.  A reply which found no
+    free transmit object counts as failed too. */
+int getLinkSplit(CAN_MSG_TYPE *message) {
+    message->data[1] = (unsigned char) (splitRequests);
+    message->data[0] = (unsigned char) (splitRequests >> 8);
+    message->data[3] = (unsigned char) (splitAnswered);
+    message->data[2] = (unsigned char) (splitAnswered >> 8);
+    message->data[5] = (unsigned char) (splitRetries);
+    message->data[4] = (unsigned char) (splitRetries >> 8);
+    message->data[7] = (unsigned char) (splitFailed);
+    message->data[6] = (unsigned char) (splitFailed >> 8);
+    message->len=8;
+    return 0;
+}
+#endif // SPLIT_MONITOR
+
+#ifdef LINK_TAGS
+/*! Send \p message as a tagged request if a slot is free.  Called by linkNext.
+    \return 1 if it was sent, else 0 */
+unsigned char tagStart(CAN_MSG_TYPE *message) {
+    LINK_TAG *slot, *used;
+
+    for (slot = linkTag; slot < &linkTag[TAG_SLOTS] && slot->tag; slot++) {}
+    if (slot == &linkTag[TAG_SLOTS])
+        return 0;
+
+    /* The next tag not in use, 0 is an untagged request */
+    do {
+        if (!++tagNext)
+            tagNext = 1;
+        for (used = linkTag; used < &linkTag[TAG_SLOTS] && used->tag != tagNext; used++) {}
+    } while (used != &linkTag[TAG_SLOTS]);
+
+    slot->rca = message->relative_address;
+    slot->seq = tagSeq++;
+    slot->sent = HAL_SLOW_TIMER_READ();
+    #ifdef MONITOR_CACHE
+        slot->ttl = cacheTTL(message->relative_address);
+    #endif // MONITOR_CACHE
+    slot->tag = tagNext;
+    tagRequests++;
+
+    /* The ARCOM needs a while for the reply, don't ask for it at once */
+    if (!tagOutstanding++)
+        tagPolled = HAL_TIMER_READ();
+    tagPending = 1;
+    linkStart(message, tagNext);
+    return 1;
+}
+
+/*! Look at the tagged request or fetch just run in linkXfer.  The reply of
+    a fetch is queued as the response of the request with its tag, and a
+    failed tagged request is tried again as a split transaction.  Counted in
+    the link health as monitorTries counts a blocking transaction: the
+    request once it is answered or failed, and each try over the link but a
+    tagged request which went through.  The CAN interrupt is held off.
+    \return 1 if a transaction was started again, else 0 */
+unsigned char tagDone(void) {
+    LINK_TAG *slot, *other;
+
+    /* The request with the tag of linkXfer, none for tag 0 */
+    for (slot = linkTag; slot < &linkTag[TAG_SLOTS] && (!linkXfer.tag || slot->tag != linkXfer.tag); slot++) {}
+    if (slot == &linkTag[TAG_SLOTS])
+        slot = 0;
+
+    if (linkXfer.msg.relative_address != GET_TAGGED_REPLY) {
+        /* A tagged request: the ARCOM has it unless it failed */
+        if (linkXfer.state == LINK_IDLE || !slot)
+            return 0;
+        linkHealthXfer(-1);
+        healthTransactions++;
+        #ifdef MONITOR_CACHE
+            splitTTL = slot->ttl;
+        #endif // MONITOR_CACHE
+        tagRelease(slot);
+        #ifdef LINK_BREAKER
+            if (BREAKER_PROBING) {
+                breakerResult(-1);
+                tagGivenUp++;
+                healthFailed++;
+                linkXfer.msg.len = 0;
+                linkReplyPut(&linkXfer.msg);
+                return 0;
+            }
+        #endif // LINK_BREAKER
+
+        /* The request is still in linkXfer.msg, as for the retry of splitDone */
+        splitPending = 1;
+        splitRetried = 1;
+        splitRetries++;
+        linkStart(&linkXfer.msg, 0);
+        return 1;
+    }
+
+    /* A fetch: no reply ready yet, or the reply of a tagged request */
+    linkHealthXfer(linkXfer.state == LINK_IDLE ? 0 : -1);
+    if (linkXfer.state != LINK_IDLE || !slot) {
+        tagPolled = HAL_TIMER_READ();
+        return 0;
+    }
+
+    for (other = linkTag; other < &linkTag[TAG_SLOTS]; other++)
+        if (other->tag && (int) (other->seq - slot->seq) < 0) {
+            tagOutOfOrder++;
+            break;
+        }
+
+    linkXfer.msg.relative_address = slot->rca;
+    #ifdef MONITOR_CACHE
+        if (slot->ttl)
+            cacheStore(&linkXfer.msg, slot->ttl);
+    #endif // MONITOR_CACHE
+    #ifdef LINK_BREAKER
+        breakerResult(0);
+    #endif // LINK_BREAKER
+    healthTransactions++;
+    healthFirstTry++;
+    tagAnswered++;
+    linkReplyPut(&linkXfer.msg);
+    tagRelease(slot);
+    return 0;
+}
+
+/*! Give up the tagged requests whose reply was not fetched within
+    TAG_TIMEOUT, with an empty response as a failed split transaction gets.
+    Called by the main loop; linkNext does the fetches. */
+void tagExpire(void) {
+    bit int_enabled;
+    LINK_TAG *slot;
+    CAN_MSG_TYPE empty;
+
+    if (!tagOutstanding)
+        return;
+
+    HAL_CAN_INT_DISABLE(int_enabled);
+    for (slot = linkTag; slot < &linkTag[TAG_SLOTS] && linkReplyDepth < LINK_REPLIES; slot++)
+        if (slot->tag && (uword) (HAL_SLOW_TIMER_READ() - slot->sent) >= TAG_TIMEOUT_TICKS) {
+            empty.dirn = CAN_MONITOR;
+            empty.len = 0;
+            empty.relative_address = slot->rca;
+            linkReplyPut(&empty);
+            tagRelease(slot);
+            tagGivenUp++;
+            healthTransactions++;
+            healthFailed++;
+            #ifdef LINK_BREAKER
+                breakerResult(-1);
+            #endif // LINK_BREAKER
+        }
+    HAL_CAN_INT_RESTORE(int_enabled);
+}
+
+/*! Free the slot of a tagged request */
+void tagRelease(LINK_TAG *slot) {
+    slot->tag = 0;
+    tagOutstanding--;
+}
+
+/*! return the tagged monitor requests: sent, answered, answered while an
+    older one was still outstanding and given up, 2 bytes each. */
+int getLinkTags(CAN_MSG_TYPE *message) {
+    message->data[1] = (unsigned char) (tagRequests);
+    message->data[0] = (unsigned char) (tagRequests >> 8);
+    message->data[3] = (unsigned char) (tagAnswered);
+    message->data[2] = (unsigned char) (tagAnswered >> 8);
+    message->data[5] = (unsigned char) (tagOutOfOrder);
+    message->data[4] = (unsigned char) (tagOutOfOrder >> 8);
+    message->data[7] = (unsigned char) (tagGivenUp);
+    message->data[6] = (unsigned char) (tagGivenUp >> 8);
+    message->len=8;
+    return 0;
+}
+#endif // LINK_TAGS
+#endif // STROBE_INT
+
+#ifdef LINK_CRC
+/*! return the CRC-8 of the 4 bytes of \p rca, LSB first as sent on the link */
+unsigned char crcRCA(unsigned long rca) {
+    unsigned char crc, i;
+
+    crc = 0;
+    for (i = 0; i < 4; i++)
+        CRC8(crc, (unsigned char) (rca >> (8 * i)));
+    return crc;
+}
+
+/*! return the check sent after the request of \p message: the CRC-8 of
+    the RCA, the payload length (0 for a monitor request) and the payload */
+unsigned char crcRequest(CAN_MSG_TYPE *message) {
+    unsigned char crc, i;
+
+    crc = crcRCA(message->relative_address);
+    if (message->dirn == CAN_MONITOR)
+        return CRC8(crc, 0);
+    CRC8(crc, message->len);
+    for (i = 0; i < message->len; i++)
+        CRC8(crc, message->data[i]);
+    return crc;
+}
+
+/*! Send the status of a monitor reply to the ARCOM, waiting at most \p timeout
+    ticks for it to be asked for.
+    \return 0, or -1 on a timeout */
+int sendReplyStatus(unsigned char status, unsigned int timeout) {
+    unsigned int timer;
+
+    IMPL_HANDSHAKE_LIMIT(timer, timeout)
+    if (HANDSHAKE_TIMED_OUT(timer, timeout))
+        return -1;
+    HAL_ARCOM_WRITE(status);    // Put data on port
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   // Wait down as quick as possible for next message
+    return 0;
+}
+
+/*! return the counters of the checked link: replies asked for again with
+    LINK_NAK (2 bytes), replies given up after LINK_NAKS of them (2 bytes) and
+    monitor requests refused by the ARCOM for failing their check (2 bytes). */
+int getLinkCheck(CAN_MSG_TYPE *message) {
+    message->data[1] = (unsigned char) (crcNaks);
+    message->data[0] = (unsigned char) (crcNaks >> 8);
+    message->data[3] = (unsigned char) (crcGiveUps);
+    message->data[2] = (unsigned char) (crcGiveUps >> 8);
+    message->data[5] = (unsigned char) (crcRejects);
+    message->data[4] = (unsigned char) (crcRejects >> 8);
+    message->len=6;
+    return 0;
+}
+#endif // LINK_CRC
+
+#ifdef LINK_BREAKER
+/*! May a request go to the ARCOM?  Not while the breaker is open, and the
+    request is then counted as failed fast.
+    \return 1 if it may, 0 if not */
+unsigned char breakerAllows(void) {
+    breakerPoll();
+    if (breakerState == BREAKER_OPEN) {
+        breakerFastFails++;
+        return 0;
+    }
+    return 1;
+}
+
+/*! Account for a monitor transaction which returned \p ret.  The half open
+    breaker closes on an answer and opens again on a failure, the closed
+    breaker opens on the BREAKER_FAILURES failure in a row. */
+void breakerResult(int ret) {
+    if (ret == 0) {
+        breakerFailures = 0;
+        if (breakerState == BREAKER_HALF_OPEN) {
+            breakerState = BREAKER_CLOSED;
+            breakerRecoveries++;
+        }
+        return;
+    }
+
+    if (breakerFailures < 0xFF)
+        breakerFailures++;
+    if (breakerState == BREAKER_HALF_OPEN || breakerFailures >= BREAKER_FAILURES) {
+        breakerState = BREAKER_OPEN;
+        breakerOpened = HAL_SLOW_TIMER_READ();
+        breakerTrips++;
+    }
+}
+
+/*! Half open the breaker once the cool-down is over. */
+void breakerPoll(void) {
+    if (breakerState == BREAKER_OPEN &&
+        (uword) (HAL_SLOW_TIMER_READ() - breakerOpened) >= BREAKER_COOLDOWN_TICKS)
+        breakerState = BREAKER_HALF_OPEN;
+}
+
+/*! return the circuit breaker: state (0 closed, 1 open, 2 half open),
+    monitor transactions failed in a row, times it opened (2 bytes), times
+    a probe closed it (2 bytes) and requests failed or dropped while it was
+    open (2 bytes). */
+int getLinkBreaker(CAN_MSG_TYPE *message) {
+    message->data[0] = breakerState;
+    message->data[1] = breakerFailures;
+    message->data[3] = (unsigned char) (breakerTrips);
+    message->data[2] = (unsigned char) (breakerTrips >> 8);
+    message->data[5] = (unsigned char) (breakerRecoveries);
+    message->data[4] = (unsigned char) (breakerRecoveries >> 8);
+    message->data[7] = (unsigned char) (breakerFastFails);
+    message->data[6] = (unsigned char) (breakerFastFails >> 8);
+    message->len=8;
+    return 0;
+}
+#endif // LINK_BREAKER
+
 /*! This function get the RCAs info from the ARCOM board and register the appropriate CAN functions.
 	
 	This function will return a CAN message with 1 byte (uchar) payload. The meaning of the payload
@@ -242,12 +2702,15 @@ int getMonTimers2(CAN_MSG_TYPE *message) {
 	   	- 0x05 -> No Error. Previous setup completed successfully.
 	   	- 0x06 -> Communication between ARCOM and AMBSI not yet established
 		- 0x07 -> Timeout while forwarding CAN message to the ARCOM board
+		- 0x08 -> The callback table has no room for the ARCOM ranges (MAX_CALLBACKS)
 
 	\param	*message	a CAN_MSG_TYPE
 	\return
 		- 0  -> Everything went OK
 		- -1 -> ERROR */
 int getSetupInfo(CAN_MSG_TYPE *message){
+	unsigned long ranges[ARCOM_RANGES][2];
+	unsigned char i;
 
 	/* The initialization message has to be a monitor message */
 	if(message->dirn==CAN_CONTROL){
@@ -269,109 +2732,34 @@ int getSetupInfo(CAN_MSG_TYPE *message){
 		return -1;
 	}
 
-	/* SPECIAL MONITOR RCAs */
-	/* Get the information on the available special monitor RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_SPECIAL_MONITOR_RCAS; // 0x20003 -> RCA: special address to retrieve the special monitor RCAs informations
-	if(monitorMsg(&myCANMessage)){ // Send the monitor request.
+	/* Get the information on the available RCAs from the ARCOM board */
+	if(getRanges(ranges)){
 		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
 		return -1;
 	}
-	/* Rebuild highestMonitorRCA */
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[0]);
-	/* Register callbacks for special messages */
-	amb_register_function(lowestSpecialMonitorRCA, highestSpecialMonitorRCA, monitorMsg);
-
-
-	/* SPECIAL CONTROL RCAs */
-	/* Get the information on the available special control RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_SPECIAL_CONTROL_RCAS; // 0x20004 -> RCA: special address to retrieve the special control RCAs informations
-	if(monitorMsg(&myCANMessage)){ // Send the monitor request.
-		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		/* Unregister previously succesfully registered functions */
-		amb_unregister_last_function(); // SPECIAL MONITOR RCAs
-		return -1;
-	}
-	/* Rebuild highestMonitorRCA */
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[0]);
-	/* Register callbacks for special control RCA messages */
-	amb_register_function(lowestSpecialControlRCA, highestSpecialControlRCA, controlMsg);
-
-
-	/* MONITOR RCAs */
-	/* Get the information on the available monitor RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_MONITOR_RCAS; // 0x20005 -> RCA: special address to retrieve the monitor RCAs informations
-	if(monitorMsg(&myCANMessage)){ // Send the monitor request.
-		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		/* Unregister previously succesfully registered functions */
-		amb_unregister_last_function(); // SPECIAL CONTROL RCAs
-		amb_unregister_last_function(); // SPECIAL MONITOR RCAs
-		return -1;
-	}
-	/* Rebuild highestMonitorRCA */
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[0]);
-	/* Register callbacks for special messages */
-	amb_register_function(lowestMonitorRCA, highestMonitorRCA, monitorMsg);
-
-
-	/* CONTROL RCAs */
-	/* Get the information on the available special monitor RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_CONTROL_RCAS; // 0x20006 -> RCA: special address to retrieve the special control RCAs informations
-	if(monitorMsg(&myCANMessage)){ // Send the monitor request.
-		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		/* Unregister previously succesfully registered functions */
-		amb_unregister_last_function(); // MONITOR RCAs
-		amb_unregister_last_function(); // SPECIAL CONTROL RCAs
-		amb_unregister_last_function(); // SPECIAL MONITOR RCAs
-		return -1;
+
+	/* Nothing is kept from a failed attempt: the ranges are only set and registered
+	   once all of them are known, so a retry starts from scratch */
+	lowestSpecialMonitorRCA = ranges[0][0];
+	highestSpecialMonitorRCA = ranges[0][1];
+	lowestSpecialControlRCA = ranges[1][0];
+	highestSpecialControlRCA = ranges[1][1];
+	lowestMonitorRCA = ranges[2][0];
+	highestMonitorRCA = ranges[2][1];
+	lowestControlRCA = ranges[3][0];
+	highestControlRCA = ranges[3][1];
+
+	/* Register callbacks for special messages, special control RCA messages,
+	   monitor messages and control messages, in the order of the ranges */
+	for (i = 0; i < ARCOM_RANGES; i++) {
+		if (amb_register_function(ranges[i][0], ranges[i][1], (i & 1) ? controlMsg : monitorMsg) != 0) {
+			/* Out of callback memory: take back the ones registered */
+			while (i--)
+				amb_unregister_last_function();
+			message->data[0]=0x08; // Error 0x08: MAX_CALLBACKS too small for the ARCOM ranges
+			return -1;
+		}
 	}
-	/* Rebuild highestMonitorRCA */
-	highestControlRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestControlRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestControlRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestControlRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestControlRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestControlRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestControlRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestControlRCA += ((unsigned long)myCANMessage.data[0]);
-	/* Register callbacks for special messages */
-	amb_register_function(lowestControlRCA, highestControlRCA, controlMsg);
 
 
 	/* No error */
@@ -381,6 +2769,104 @@ int getSetupInfo(CAN_MSG_TYPE *message){
     return 0;
 }
 
+/*! Get the four RCA ranges of the ARCOM board, in the order of GET_SPECIAL_MONITOR_RCAS
+	to GET_CONTROL_RCAS: [0] lowest, [1] highest.  One GET_ALL_RCA_RANGES transaction
+	is tried first, and when it fails each range is asked for in turn.  ARCOM
+	firmware which answers it with anything but the four ranges, or which only
+	gives them one at a time, is not asked for it again.
+
+	\param	ranges	the ranges
+	\return
+		- 0  -> Everything went OK
+		- -1 -> Time out during CAN message forwarding */
+int getRanges(unsigned long ranges[][2]) {
+	unsigned char i;
+	int ret;
+
+	if (!allRangesUnsupported) {
+		ret = getAllRanges(ranges);
+		if (ret == 0)
+			return 0;
+		/* An answer, but not the ranges: older ARCOM firmware */
+		if (ret > 0)
+			allRangesUnsupported = 1;
+	}
+
+	/* Older ARCOM firmware: one request per range */
+	for (i = 0; i < ARCOM_RANGES; i++) {
+		myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
+		myCANMessage.len=0;	// Size: 0
+		myCANMessage.relative_address=GET_SPECIAL_MONITOR_RCAS + i; // 0x20003 to 0x20006
+		if(monitorMsg(&myCANMessage)) // Send the monitor request.
+			return -1;
+		decodeRange(ranges[i], myCANMessage.data);
+	}
+
+	/* Known one at a time only: older ARCOM firmware */
+	allRangesUnsupported = 1;
+	return 0;
+}
+
+/*! Get the four RCA ranges in one GET_ALL_RCA_RANGES transaction: the ARCOM
+	answers with the replies to GET_SPECIAL_MONITOR_RCAS to GET_CONTROL_RCAS in
+	a row, each with its own reply length (and check and status with LINK_CRC).
+
+	\param	ranges	the ranges
+	\return
+		- 0  -> Everything went OK
+		- 1  -> The ARCOM answered, but not with the four ranges in a row:
+				it does not know GET_ALL_RCA_RANGES
+		- -1 -> No answer at all */
+int getAllRanges(unsigned long ranges[][2]) {
+	unsigned char i;
+	int ret;
+
+	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
+	myCANMessage.len=0;	// Size: 0
+	myCANMessage.relative_address=GET_ALL_RCA_RANGES;
+
+	#ifdef LINK_BREAKER
+		if (!breakerAllows())
+			return -1;
+	#endif // LINK_BREAKER
+
+	/* Trigger interrupt */
+	LINK_WAIT_IDLE();
+	HAL_ARCOM_INT(1);
+
+	ret = monitorTries(&myCANMessage);
+	for (i = 0; ret == 0 && myCANMessage.len == 8; ) {
+		decodeRange(ranges[i], myCANMessage.data);
+		if (++i == ARCOM_RANGES)
+			break;
+		ret = implMonitorChecked(&myCANMessage, fullTimeouts, CRC_RCA(GET_ALL_RCA_RANGES));
+	}
+
+	/* Untrigger interrupt */
+	HAL_ARCOM_INT(0);
+
+	if (i == ARCOM_RANGES)
+		return 0;
+	/* No answer: the link is not up yet */
+	if (i == 0 && ret != 0)
+		return -1;
+	/* Anything else, even a first reply the length of a range: older ARCOM firmware */
+	return 1;
+}
+
+/*! Decode the reply of the ARCOM to a range request: lowest RCA in bytes 0 to 3
+	and highest RCA in bytes 4 to 7, LSB first. */
+void decodeRange(unsigned long *range, unsigned char *data) {
+	unsigned char i;
+
+	range[0] = 0;
+	range[1] = 0;
+	for (i = 4; i; i--) {
+		range[0] = (range[0] << 8) + data[i - 1];
+		range[1] = (range[1] << 8) + data[i + 3];
+	}
+}
+
 
 
 /*! Return the temperature of the AMBSI as measured by the DS1820 onboard chip.
@@ -403,7 +2889,7 @@ int ambient_msg(CAN_MSG_TYPE *message) {
 
 
 /* Triggers every 48ms pulse */
-void received_48ms(void) interrupt 0x30{
+void received_48ms(void) HAL_INTERRUPT(0x30){
 // Put whatever you want to be execute at the 48ms clock.
 // Remember that right now this interrupt has higher priority than the CAN.
 // Also to be able to use the 48ms, the Xilinx has to be programmed to connect the
@@ -413,8 +2899,8 @@ void received_48ms(void) interrupt 0x30{
 
 
 /*! This function will be called in case a CAN control message is received.
-	It will start communication with the ARCOM board triggering the parallel port
-	interrupt and the sending the CAN message information to the ARCOM board.
+	It forwards the CAN message to the ARCOM board, or with CONTROL_QUEUE puts
+	it in the queue for the main loop to forward.
 
 	Since a CAN control request doesn't require any aknowledgment, this function
 	will then return.
@@ -422,23 +2908,90 @@ void received_48ms(void) interrupt 0x30{
 	\param	*message	a CAN_MSG_TYPE 
 	\return	0 -	Everything went OK */
 int controlMsg(CAN_MSG_TYPE *message){
-
-	unsigned char counter;
-	unsigned int timer;
+	#ifdef CONTROL_QUEUE
+		CAN_MSG_TYPE *queued;
+	#endif
 
 	if(message->dirn==CAN_MONITOR){
 		monitorMsg(message);
 		return 0;
 	}
 
+	#ifdef MONITOR_CACHE
+		/* The point is about to change: forget its cached reply */
+		cacheInvalidate(message->relative_address);
+	#endif // MONITOR_CACHE
+
+	#ifdef CONTROL_QUEUE
+		/* Only the newest value of a coalesced RCA is forwarded */
+		queued = controlPending(message->relative_address);
+		if (queued) {
+			*queued = *message;
+			controlCoalesced++;
+			return 0;
+		}
+
+		/* Full: drop the request rather than hold up the CAN interrupt */
+		if (controlDepth == CONTROL_QUEUE_SIZE) {
+			controlDrops++;
+			return 0;
+		}
+		queued = &controlQueue[(controlHead + controlDepth) % CONTROL_QUEUE_SIZE];
+		*queued = *message;
+		controlDepth++;
+		if (controlDepth > controlMaxDepth)
+			controlMaxDepth = controlDepth;
+		return 0;
+	#else
+		return forwardControl(message);
+	#endif
+}
+
+
+/*! Forward a control message to the ARCOM board, triggering the parallel port
+	interrupt and then sending the CAN message information to the ARCOM board.
+
+	\param	*message	a CAN_MSG_TYPE 
+	\return
+		- 0 -> Everything went OK
+		- -1 -> No room in the link queue (SPLIT_MONITOR) */
+int forwardControl(CAN_MSG_TYPE *message){
+
+	#ifndef STROBE_INT
+		unsigned char counter;
+		unsigned int timer;
+		#ifdef LINK_CRC
+			unsigned char crc;
+		#endif
+	#endif // STROBE_INT
+
+	#ifdef LINK_BREAKER
+		/* Dropped while the breaker is open */
+		if (!breakerAllows())
+			return 0;
+	#endif // LINK_BREAKER
+
+#if defined(SPLIT_MONITOR)
+	/* Queued for the strobe interrupt, -1 with the queue full */
+	return linkSubmit(message);
+#elif defined(STROBE_INT)
+	/* Left to the strobe interrupt */
+	linkWaitIdle();
+	linkStart(message, 0);
+	return 0;
+#else
+	#ifdef LINK_CRC
+		crc = crcRequest(message);
+	#endif // LINK_CRC
+
 	/* Trigger interrupt */
-	INT = 1;
+	HAL_ARCOM_INT(1);
 
 	/* Send RCA */
     IMPL_HANDSHAKE(timer)
-	P7 = (uword) (message->relative_address);	// Put data on port
-	WAIT = 1;	// Acknowledge with Wait going high
-	WAIT = 0; 	/* Wait down as quick as possible for next message.
+	HAL_ARCOM_WRITE((uword) (message->relative_address));	// Put data on port
+	HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+	HAL_ARCOM_WAIT(0); 	/* Wait down as quick as possible for next message.
 				   Any wait state will keep wait high too long and make the ARCOM believe it is an
 				   aknowledgment to the following data strobe. */
 	#ifdef FULL_HANDSHAKE
@@ -446,9 +2999,9 @@ int controlMsg(CAN_MSG_TYPE *message){
 	#else
 		_nop_();  // One nop to wait for following data strobe to go low
 	#endif
-	P7 = (uword) (message->relative_address>>8); 	// Put data on port
-	WAIT = 1;	// Acknowledge with Wait going high
-	WAIT = 0; 	/* Wait down as quick as possible for next message.
+	HAL_ARCOM_WRITE((uword) (message->relative_address>>8)); 	// Put data on port
+	HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+	HAL_ARCOM_WAIT(0); 	/* Wait down as quick as possible for next message.
 				   Any wait state will keep wait high too long and make the ARCOM believe it is an
 				   aknowledgment to the following data strobe. */
 
@@ -457,9 +3010,9 @@ int controlMsg(CAN_MSG_TYPE *message){
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-	P7 = (uword) (message->relative_address>>16); 	// Put data on port
-	WAIT = 1;	// Acknowledge with Wait going high
-	WAIT = 0;	/* Wait down as quick as possible for next message.
+	HAL_ARCOM_WRITE((uword) (message->relative_address>>16)); 	// Put data on port
+	HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+	HAL_ARCOM_WAIT(0);	/* Wait down as quick as possible for next message.
 				   Any wait state will keep wait high too long and make the ARCOM believe it is an
 				   aknowledgment to the following data strobe. */
 
@@ -468,9 +3021,9 @@ int controlMsg(CAN_MSG_TYPE *message){
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-	P7 = (uword) (message->relative_address>>24); 	// Put data on port
-	WAIT = 1;	// Acknowledge with Wait going high
-	WAIT = 0;	/* Wait down as quick as possible for next message.
+	HAL_ARCOM_WRITE((uword) (message->relative_address>>24)); 	// Put data on port
+	HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+	HAL_ARCOM_WAIT(0);	/* Wait down as quick as possible for next message.
 				   Any wait state will keep wait high too long and make the ARCOM believe it is an
 				   aknowledgment to the following data strobe. */
 
@@ -480,9 +3033,9 @@ int controlMsg(CAN_MSG_TYPE *message){
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-	P7 = message->len;  // Put data on port (0 -> monitor message)
-	WAIT = 1;	// Acknowledge with Wait going high
-	WAIT = 0;	/* Wait down as quick as possible for next message.
+	HAL_ARCOM_WRITE(message->len);  // Put data on port (0 -> monitor message)
+	HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+	HAL_ARCOM_WAIT(0);	/* Wait down as quick as possible for next message.
 				   Any wait state will keep wait high too long and make the ARCOM believe it is an
 				   aknowledgment to the following data strobe. */
 
@@ -492,17 +3045,26 @@ int controlMsg(CAN_MSG_TYPE *message){
         #else
             // The for cycle is slow enough for following data strobe to go low
         #endif
-		P7 = message->data[counter];	// Put data on port (0 -> monitor message)
-		WAIT = 1;	// Acknowledge with Wait going high
-		WAIT = 0; 	/* Wait down as quick as possible for next message.
+		HAL_ARCOM_WRITE(message->data[counter]);	// Put data on port (0 -> monitor message)
+		HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+		HAL_ARCOM_WAIT(0); 	/* Wait down as quick as possible for next message.
 					   Any wait state will keep wait high too long and make the ARCOM believe it is an
 					   aknowledgment to the following data strobe. */
 	}
 
+	#ifdef LINK_CRC
+		/* Send the check of the request */
+		IMPL_HANDSHAKE(timer)
+		HAL_ARCOM_WRITE(crc);	// Put data on port
+		HAL_ARCOM_WAIT(1);	// Acknowledge with Wait going high
+		HAL_ARCOM_WAIT(0);	// Wait down as quick as possible for next message
+	#endif // LINK_CRC
+
 	/* Untrigger interrupt */
-	INT = 0;
+	HAL_ARCOM_INT(0);
 
 	return 0;
+#endif // SPLIT_MONITOR, STROBE_INT
 }
 
 
@@ -510,105 +3072,205 @@ int controlMsg(CAN_MSG_TYPE *message){
     Abstracted out so that monitorMsg below can retry
     
     \param  *message    a CAN_MSG_TYPE 
+    \param  *timeout    ticks to wait in each of the MONITOR_PHASES phases
     \return
         - 0 -> Everything went OK
         - -1 -> Time out during CAN message forwarding */
-int implMonitorSingle(CAN_MSG_TYPE *message) {
-    unsigned char counter;
+int implMonitorSingle(CAN_MSG_TYPE *message, const unsigned int *timeout) {
+    #ifdef LINK_CRC
+        unsigned char crc;
+    #endif
 
     /* Send RCA */
-    IMPL_HANDSHAKE(monTimer1)
-    P7 = (uword) (message->relative_address);   // Put data on port
-    WAIT = 1;   // Acknowledge with Wait going high
-    WAIT = 0;   /* Wait down as quick as possible for next message.
+    IMPL_HANDSHAKE_LIMIT(monTimer1, timeout[0])
+    GIVE_UP_IF_TIMED_OUT(monTimer1, timeout[0]);
+    HAL_ARCOM_WRITE((uword) (message->relative_address));   // Put data on port
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                    Any wait state will keep wait high too long and make the ARCOM believe it is an
                    aknowledgment to the following data strobe. */
 
     #ifdef FULL_HANDSHAKE
-        IMPL_HANDSHAKE(monTimer2)
+        IMPL_HANDSHAKE_LIMIT(monTimer2, timeout[1])
+        GIVE_UP_IF_TIMED_OUT(monTimer2, timeout[1]);
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-    P7 = (uword) (message->relative_address>>8);    // Put data on port
-    WAIT = 1;   // Acknowledge with Wait going high
-    WAIT = 0;   /* Wait down as quick as possible for next message.
+    HAL_ARCOM_WRITE((uword) (message->relative_address>>8));    // Put data on port
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                    Any wait state will keep wait high too long and make the ARCOM believe it is an
                    aknowledgment to the following data strobe. */
 
     #ifdef FULL_HANDSHAKE
-        IMPL_HANDSHAKE(monTimer3)
+        IMPL_HANDSHAKE_LIMIT(monTimer3, timeout[2])
+        GIVE_UP_IF_TIMED_OUT(monTimer3, timeout[2]);
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-    P7 = (uword) (message->relative_address>>16);   // Put data on port
-    WAIT = 1;   // Acknowledge with Wait going high
-    WAIT = 0;   /* Wait down as quick as possible for next message.
+    HAL_ARCOM_WRITE((uword) (message->relative_address>>16));   // Put data on port
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                    Any wait state will keep wait high too long and make the ARCOM believe it is an
                    aknowledgment to the following data strobe. */
 
     #ifdef FULL_HANDSHAKE
-        IMPL_HANDSHAKE(monTimer4)
+        IMPL_HANDSHAKE_LIMIT(monTimer4, timeout[3])
+        GIVE_UP_IF_TIMED_OUT(monTimer4, timeout[3]);
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-    P7 = (uword) (message->relative_address>>24);   // Put data on port
-    WAIT = 1;   // Acknowledge with Wait going high
-    WAIT = 0;   /* Wait down as quick as possible for next message.
+    HAL_ARCOM_WRITE((uword) (message->relative_address>>24));   // Put data on port
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                    Any wait state will keep wait high too long and make the ARCOM believe it is an
                    aknowledgment to the following data strobe. */
 
     /* Send payload size (0 -> monitor message) */
     #ifdef FULL_HANDSHAKE
-        IMPL_HANDSHAKE(monTimer5)
+        IMPL_HANDSHAKE_LIMIT(monTimer5, timeout[4])
+        GIVE_UP_IF_TIMED_OUT(monTimer5, timeout[4]);
     #else
         _nop_();  // One nop to wait for following data strobe to go low
     #endif
-    P7 = message->len;  // Put data on port (0 -> monitor message)
-    WAIT = 1;   // Acknowledge with Wait going high
-    WAIT = 0;   /* Wait down as quick as possible for next message.
+    HAL_ARCOM_WRITE(message->len);  // Put data on port (0 -> monitor message)
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                    Any wait state will keep wait high too long and make the ARCOM believe it is an
                    aknowledgment to the following data strobe. */
 
+    #ifdef LINK_CRC
+        /* Send the check of the request, timed as phase 5 */
+        crc = crcRCA(message->relative_address);
+        CRC8(crc, message->len);
+        IMPL_HANDSHAKE_LIMIT(monTimer5, timeout[4])
+        GIVE_UP_IF_TIMED_OUT(monTimer5, timeout[4]);
+        HAL_ARCOM_WRITE(crc);   // Put data on port
+        HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+        HAL_ARCOM_WAIT(0);   // Wait down as quick as possible for next message
+
+    #endif // LINK_CRC
+
+    return implMonitorChecked(message, timeout, CRC_RCA(message->relative_address));
+}
+
+/*! Reply of a monitor transaction.  With LINK_CRC a reply failing its check is
+    asked for again, rather than the whole transaction, and every reply is
+    answered with its status.
+
+    \param  *message    a CAN_MSG_TYPE
+    \param  *timeout    ticks to wait in each of the MONITOR_PHASES phases
+    \param  crc         with LINK_CRC the CRC-8 of the RCA asked for
+    \return
+        - 0 -> Everything went OK
+        - -1 -> Time out, bad reply length or no reply passing its check */
+int implMonitorChecked(CAN_MSG_TYPE *message, const unsigned int *timeout, unsigned char crc) {
+    #ifdef LINK_CRC
+        unsigned char naks;
+        int ret;
+
+        for (naks = 0; (ret = implMonitorReply(message, timeout, crc)) > 0 && naks < LINK_NAKS; naks++) {
+            if (sendReplyStatus(LINK_NAK, timeout[4]))
+                return -1;
+            crcNaks++;
+        }
+        if (ret > 0) {
+            crcGiveUps++;
+            sendReplyStatus(LINK_ABORT, timeout[4]);
+            return -1;
+        }
+        if (ret == 0)
+            sendReplyStatus(LINK_ACK, timeout[4]);
+        return ret;
+    #else
+        return implMonitorReply(message, timeout, crc);
+    #endif // LINK_CRC
+}
+
+/*! Reply of a monitor transaction: the reply length and the reply, with
+    LINK_CRC followed by their check.
+
+    \param  *message    a CAN_MSG_TYPE
+    \param  *timeout    ticks to wait in each of the MONITOR_PHASES phases
+    \param  crc         with LINK_CRC the CRC-8 of the RCA, which the check covers too
+    \return
+        - 0 -> Everything went OK
+        - 1 -> The reply failed its check
+        - -1 -> Time out or bad reply length */
+int implMonitorReply(CAN_MSG_TYPE *message, const unsigned int *timeout, unsigned char crc) {
+    unsigned char counter;
+    #ifdef LINK_CRC
+        unsigned char check = 0;    // Not read after a payload timeout
+    #endif
+
+    #ifndef LINK_CRC
+        (void) crc;    // Only checked with LINK_CRC
+    #endif
+
     /* Set port to receive data */
-    DP7 = 0x00;
+    HAL_ARCOM_DIR_IN();
 
     /* Receive monitor payload size */
-    IMPL_HANDSHAKE(monTimer6)
-    message->len = (ubyte) P7;  // Read data from port
-    WAIT = 1;   // Acknowledge with Wait going high
-    WAIT = 0;   /* Wait down as quick as possible for next message.
+    IMPL_HANDSHAKE_LIMIT(monTimer6, timeout[5])
+    message->len = HAL_ARCOM_READ();  // Read data from port
+    HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+    HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                    Any wait state will keep wait high too long and make the ARCOM believe it is an
                    aknowledgment to the following data strobe. */
 
     /* Detect timeout or error receiving payload size */
-    if (!monTimer6 || message->len > MAX_CAN_MSG_PAYLOAD) {
+    if (HANDSHAKE_TIMED_OUT(monTimer6, timeout[5]) || message->len > MAX_CAN_MSG_PAYLOAD) {
+        if (!HANDSHAKE_TIMED_OUT(monTimer6, timeout[5])) {
+            healthLenRejects++;
+            #ifdef LINK_CRC
+                // The ARCOM refused a request failing its check:
+                if (message->len == LINK_NAK)
+                    crcRejects++;
+            #endif
+        }
         // Set port to transmit data:
-        DP7 = 0xFF;
-        // Set the payload timer to zero:
+        HAL_ARCOM_DIR_OUT();
+        // No payload was read, send back an empty reply rather than the length byte:
         monTimer7 = 0;
+        message->len = 0;
         // And exit:
         return -1;
     }
 
     /* Get the payload */
+    monTimer7 = 0;
     for(counter = 0; counter < message->len; counter++) { 
         #ifdef FULL_HANDSHAKE
-            IMPL_HANDSHAKE(monTimer7)
+            IMPL_HANDSHAKE_LIMIT(monTimer7, timeout[6])
+            // A byte which never came must not be taken from the stale port:
+            if (HANDSHAKE_TIMED_OUT(monTimer7, timeout[6]))
+                break;
         #else
             // The for cycle is slow enough for following data strobe to go low
         #endif
-        message->data[counter] = (ubyte) P7;    // Read data from port
-        WAIT = 1;   // Acknowledge with Wait going high
-        WAIT = 0;   /* Wait down as quick as possible for next message.
+        message->data[counter] = HAL_ARCOM_READ();    // Read data from port
+        HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+        HAL_ARCOM_WAIT(0);   /* Wait down as quick as possible for next message.
                        Any wait state will keep wait high too long and make the ARCOM believe it is an
                        aknowledgment to the following data strobe. */
     }
 
+    #ifdef LINK_CRC
+        /* Get the check of the reply, timed as phase 7, unless the payload
+           already timed out: a later handshake must not hide that timeout */
+        if (!HANDSHAKE_TIMED_OUT(monTimer7, timeout[6])) {
+            IMPL_HANDSHAKE_LIMIT(monTimer7, timeout[6])
+            check = HAL_ARCOM_READ();    // Read data from port
+            HAL_ARCOM_WAIT(1);   // Acknowledge with Wait going high
+            HAL_ARCOM_WAIT(0);   // Wait down as quick as possible for next message
+        }
+    #endif
+
     //Set port to transmit data:
-    DP7 = 0xFF;
+    HAL_ARCOM_DIR_OUT();
 
     /* Detect timeout */
-    if(!monTimer7) {
+    if(HANDSHAKE_TIMED_OUT(monTimer7, timeout[6])) {
         // timed out communicating with the ARCOM:
         // We don't want to send back garbage data (as in earlier versions)
         // but there is no way to return a value which prevents transmitting the buffer.
@@ -618,6 +3280,15 @@ int implMonitorSingle(CAN_MSG_TYPE *message) {
         message->len=0;
         return -1;
     }
+
+    #ifdef LINK_CRC
+        /* Check the reply against the RCA asked for */
+        CRC8(crc, message->len);
+        for (counter = 0; counter < message->len; counter++)
+            CRC8(crc, message->data[counter]);
+        if (crc != check)
+            return 1;
+    #endif
     return 0;
 }
     
@@ -635,25 +3306,173 @@ int implMonitorSingle(CAN_MSG_TYPE *message) {
 	    - -1 -> Time out during CAN message forwarding */
 int monitorMsg(CAN_MSG_TYPE *message) {
     int ret = 0;
+    #ifdef MONITOR_CACHE
+        unsigned int ttl;
+    #endif
 
 	if(message->dirn==CAN_CONTROL){
 		controlMsg(message);
 		return 0;
 	}
 
+    #ifdef MONITOR_CACHE
+        /* Answer from the cache while the last reply is live */
+        if (cacheLookup(message) == 0)
+            return 0;
+        ttl = cacheTTL(message->relative_address);
+        if (ttl)
+            cacheMisses++;
+    #endif // MONITOR_CACHE
+
+    #ifdef LINK_BREAKER
+        /* Fail at once while the breaker is open, with an empty response */
+        if (!breakerAllows()) {
+            message->len = 0;
+            return -1;
+        }
+    #endif // LINK_BREAKER
+
+    #ifdef SPLIT_MONITOR
+        /* Once the link is up, queued for the strobe interrupt and answered by the main loop */
+        if (initialized) {
+            if (linkSubmit(message) != 0) {
+                /* No waiting for room in the queue, an empty response */
+                splitFailed++;
+                message->len = 0;
+                return -1;
+            }
+            // No response now: tell the caller it's a control msg
+            message->dirn = CAN_CONTROL;
+            message->len = 0;
+            return 0;
+        }
+    #endif // SPLIT_MONITOR
+
 	/* Trigger interrupt */
-	INT = 1;
+	LINK_WAIT_IDLE();
+	HAL_ARCOM_INT(1);
 
-    // Try 1:
-    ret = implMonitorSingle(message);
+    ret = monitorTries(message);
 
-    if (ret != 0) {
-        // Retry once:
-        ret = implMonitorSingle(message);
-    }
+    #ifdef MONITOR_CACHE
+        if (ttl && ret == 0)
+            cacheStore(message, ttl);
+    #endif // MONITOR_CACHE
 
 	/* Untrigger interrupt */
-	INT = 0;
+	HAL_ARCOM_INT(0);
 	return ret;
 }
 
+/*! Monitor transaction with the ARCOM, retried once on a timeout.
+    The caller holds the parallel port interrupt.
+
+    \param  *message    a CAN_MSG_TYPE 
+    \return
+        - 0 -> Everything went OK
+        - -1 -> Time out during CAN message forwarding */
+int monitorTries(CAN_MSG_TYPE *message) {
+    int ret;
+    const unsigned int *timeout;
+    #ifdef ADAPTIVE_TIMEOUT
+        uword start;
+    #endif
+
+    // Try 1:
+    #ifdef ADAPTIVE_TIMEOUT
+        timeout = phaseTimeout[RCA_CLASS(message->relative_address)];
+    #else
+        timeout = fullTimeouts;
+    #endif
+    ret = implMonitorSingle(message, timeout);
+    linkHealthTry(ret, timeout);
+    healthTransactions++;
+
+    if (ret == 0) {
+        healthFirstTry++;
+    } else if (BREAKER_PROBING) {
+        // A probe of the half open breaker is not retried:
+        healthFailed++;
+    } else {
+        #ifdef ADAPTIVE_TIMEOUT
+            // The first try may have given up with the ARCOM in the middle of
+            // the transaction: end it and let the ARCOM time out on its side,
+            // so that the retry is a transaction of its own
+            HAL_ARCOM_INT(0);
+            for (start = HAL_TIMER_READ(); (uword) (HAL_TIMER_READ() - start) < MAX_TIMEOUT_TICKS; )
+                HAL_ARCOM_DSTROBE();
+            HAL_ARCOM_INT(1);
+        #endif
+        // Retry once, waiting the full timeout, as a monitor request again:
+        message->dirn = CAN_MONITOR;
+        message->len = 0;
+        ret = implMonitorSingle(message, fullTimeouts);
+        linkHealthTry(ret, fullTimeouts);
+        if (ret == 0)
+            healthRetry++;
+        else
+            healthFailed++;
+    }
+
+    #ifdef LINK_BREAKER
+        breakerResult(ret);
+    #endif // LINK_BREAKER
+
+    #ifdef LINK_CRC
+        // Nothing unchecked goes back to the CAN master, only an empty reply:
+        if (ret != 0) {
+            message->dirn = CAN_MONITOR;
+            message->len = 0;
+        }
+    #endif // LINK_CRC
+
+    #ifdef ADAPTIVE_TIMEOUT
+        // Learn from the phases of an answer, the payload phase only if there was one
+        if (ret == 0)
+            learnTimeouts(RCA_CLASS(message->relative_address), message->len ? MONITOR_PHASES : MONITOR_PHASES - 1);
+    #endif
+
+    return ret;
+}
+
+/*! Account for one try of a monitor transaction, which returned \p ret
+    waiting at most \p timeout ticks in each phase: the phase it was given
+    up in, or the ticks waited in each phase of an answer.  The phases after
+    the one given up in were not reached and keep the timers of an earlier
+    transaction. */
+void linkHealthTry(int ret, const unsigned int *timeout) {
+    unsigned int sample[MONITOR_PHASES];
+    unsigned char phase;
+
+    sample[0] = monTimer1;
+    sample[1] = monTimer2;
+    sample[2] = monTimer3;
+    sample[3] = monTimer4;
+    sample[4] = monTimer5;
+    sample[5] = monTimer6;
+    sample[6] = monTimer7;
+
+    for (phase = 0; phase < MONITOR_PHASES; phase++) {
+        if (HANDSHAKE_TIMED_OUT(sample[phase], timeout[phase])) {
+            healthTimeouts[phase]++;
+            return;
+        }
+        if (ret != 0)
+            continue;
+
+        // No payload, no wait in the payload phase:
+        if (phase == MONITOR_PHASES - 1 && !sample[phase])
+            break;
+        if (!healthSamples[phase] || sample[phase] < healthMin[phase])
+            healthMin[phase] = sample[phase];
+        if (sample[phase] > healthMax[phase])
+            healthMax[phase] = sample[phase];
+        if (healthSamples[phase] == 0xFFFF) {
+            healthSum[phase] >>= 1;
+            healthSamples[phase] >>= 1;
+        }
+        healthSum[phase] += sample[phase];
+        healthSamples[phase]++;
+    }
+}
+